@@ -9,17 +9,42 @@
  */
 
 
+/* For copy_file_range. */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
 
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include <mruby.h>
 #include <mruby/array.h>
 #include "mruby/class.h"
 #include <mruby/proc.h>
 #include <mruby/compile.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/dump.h>
+#include <mruby/irep.h>
+#include <mruby/hash.h>
 #include <mruby/string.h>
+#include <mruby/variable.h>
 
 #include <mucgly_mod.h>
 
@@ -58,14 +83,63 @@ void mucgly_debug( void ) {}
  * Global variables:
  * ------------------------------------------------------------ */
 
-/** Default hook settings. */
-stackfile_t* stack_default = NULL;
+/** Open Outfiles. Pending writes are flushed at (error) exit. */
+static GList* outfile_live = NULL;
+
+/** Lock for outfile_live. */
+static GMutex outfile_live_lock;
+
+/** Process umask, for permissions of committed outputs. */
+static mode_t outfile_umask = 022;
+
+/** Include file cache, shared by all Pstates. */
+static GHashTable* fcache_table = NULL;
+
+/** Include file cache entries, most recently used first. */
+static GQueue fcache_lru = G_QUEUE_INIT;
+
+/** Include file cache hits and misses. */
+static gint64 fcache_hits = 0;
+static gint64 fcache_misses = 0;
+
+/** Lock for include file cache. */
+static GMutex fcache_lock;
+
+/** Lock for stats report file. */
+static GMutex stats_lock;
+
+/** Names of macro types (in stats and trace). */
+static const char* stats_macro_names[] = { "cmd", "var", "postpone", "comment", "ruby" };
+
+/** Trace event file (or NULL if tracing is disabled). */
+static FILE* trace_fh = NULL;
+
+/** Lock for trace event file. */
+static GMutex trace_lock;
+
+/** Trace time origin. */
+static gint64 trace_t0 = 0;
+
+/** No events written to trace file yet. */
+static gboolean trace_first = TRUE;
 
-/** Pointer to current file. Useful for debugging. */
-stackfile_t* csf;
+/** Trace thread id of current thread (see trace_tid). */
+static GPrivate trace_tid_key;
 
-/** Ruby side reference to parser. */
-pstate_t* ruby_ps;
+/** Number of traced threads. */
+static gint trace_tids = 0;
+
+/** Registered internal commands (see mucgly_cmd_register). */
+static GHashTable* mucgly_cmd_table = NULL;
+
+/** Lock for registered internal commands. */
+static GMutex mucgly_cmd_lock;
+
+/** Error trap of current thread (or NULL). */
+static GPrivate mucgly_trap_key;
+
+/** Batch worker of current thread. Freed at thread exit. */
+static GPrivate batch_worker_key = G_PRIVATE_INIT( batch_worker_rem );
 
 
 
@@ -73,7 +147,6 @@ pstate_t* ruby_ps;
  * Function declarations:
  * ------------------------------------------------------------ */
 
-void sf_update_hook_cache( stackfile_t* sf );
 gchar* ps_current_hookbeg( pstate_t* ps );
 gchar* ps_current_hookend( pstate_t* ps );
 gchar* ps_current_hooksusp( pstate_t* ps );
@@ -104,6 +177,37 @@ int len_str_cmp( char* str1, char* str2 )
 }
 
 
+/**
+ * Count newlines in str. Uses memchr, which is vectorized by the C
+ * library.
+ *
+ * @param str  String to scan.
+ * @param len  String length.
+ * @param last Position of last newline (or NULL if none). Ignored if NULL.
+ *
+ * @return Number of newlines.
+ */
+gsize mucgly_count_lines( const gchar* str, gsize len, const gchar** last )
+{
+  const gchar* end = str + len;
+  const gchar* nl = NULL;
+  gsize cnt = 0;
+
+  for ( const gchar* p = str;
+        p < end && ( p = memchr( p, '\n', end - p ) );
+        p++ )
+    {
+      nl = p;
+      cnt++;
+    }
+
+  if ( last )
+    *last = nl;
+
+  return cnt;
+}
+
+
 /**
  * Common routine for user info message output.
  *
@@ -116,7 +220,7 @@ void mucgly_user_info_str( stackfile_t* sf, char* infotype, GString* str, char*
 {
   if ( sf )
     {
-      int lineno, column;
+      gint64 lineno, column;
 
       if ( sf->macro )
         {
@@ -125,11 +229,10 @@ void mucgly_user_info_str( stackfile_t* sf, char* infotype, GString* str, char*
         }
       else
         {
-          lineno = sf->lineno;
-          column = sf->column;
+          sf_position( sf, &lineno, &column );
         }
 
-      g_string_append_printf( str, "mucgly %s in \"%s:%d:%d\": ",
+      g_string_append_printf( str, "mucgly %s in \"%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT "\": ",
                               infotype,
                               sf->filename,
                               lineno+1,
@@ -189,9 +292,8 @@ void mucgly_error( stackfile_t* sf, char* format, ... )
 {
   va_list ap;
   va_start( ap, format );
-  mucgly_user_info( sf, "error", format, ap );
+  mucgly_exit( sf, "error", format, ap );
   va_end( ap );
-  exit( EXIT_FAILURE );
 }
 
 
@@ -205,12 +307,75 @@ void mucgly_fatal( stackfile_t* sf, char* format, ... )
 {
   va_list ap;
   va_start( ap, format );
-  mucgly_user_info( sf, "fatal error", format, ap );
+  mucgly_exit( sf, "fatal error", format, ap );
   va_end( ap );
+}
+
+
+/**
+ * Report error and exit, or return to the error trap of current
+ * thread (if set). Message is stored to the trap instead of output.
+ *
+ * @param sf        Current input file.
+ * @param infotype  Severity type.
+ * @param format    Message formatter.
+ * @param ap        Message args.
+ */
+void mucgly_exit( stackfile_t* sf, char* infotype, char* format, va_list ap )
+{
+  mucgly_trap_t* trap;
+
+  trap = g_private_get( &mucgly_trap_key );
+
+  if ( trap )
+    {
+      g_string_truncate( trap->msg, 0 );
+      mucgly_user_info_str( sf, infotype, trap->msg, format, ap );
+      longjmp( trap->env, 1 );
+    }
+
+  mucgly_user_info( sf, infotype, format, ap );
   exit( EXIT_FAILURE );
 }
 
 
+/**
+ * Report complete error message from another thread, i.e. exit or
+ * return to the error trap (see mucgly_exit).
+ *
+ * @param msg Error message (freed).
+ */
+void mucgly_rethrow( gchar* msg )
+{
+  mucgly_trap_t* trap;
+
+  trap = g_private_get( &mucgly_trap_key );
+
+  if ( trap )
+    {
+      g_string_assign( trap->msg, msg );
+      g_free( msg );
+      longjmp( trap->env, 1 );
+    }
+
+  fputs( msg, stderr );
+  fputc( '\n', stderr );
+  fflush( stderr );
+  exit( EXIT_FAILURE );
+}
+
+
+/**
+ * Set error trap for current thread.
+ *
+ * @param trap Error trap (or NULL to exit on errors).
+ */
+void mucgly_set_trap( mucgly_trap_t* trap )
+{
+  g_private_set( &mucgly_trap_key, trap );
+}
+
+
 /**
  * Raise MRuby exception.
  *
@@ -224,7 +389,7 @@ void mucgly_raise( pstate_t* ps, char* infotype, char* format, ... )
   va_list ap;
   mrb_state* mrb = ps->mrb;
   va_start( ap, format );
-  mucgly_user_info_str( ps_topfile(ps), infotype, out, format, ap );
+  mucgly_user_info_str( ps_current_file(ps), infotype, out, format, ap );
   va_end( ap );
   mrb_raise( mrb, E_RUNTIME_ERROR, (char*) out->str );
   g_string_free( out, TRUE );
@@ -232,2197 +397,9280 @@ void mucgly_raise( pstate_t* ps, char* infotype, char* format, ... )
 
 
 /**
- * Copy hookpair content.
+ * Create new Arena. Blocks are allocated on demand.
  *
- * @param from Source.
- * @param to   Destination.
- *
- * @return Destination.
+ * @return Arena.
  */
-hookpair_t* hookpair_cpy( hookpair_t* from, hookpair_t* to )
+arena_t* arena_new( void )
 {
-  to->beg = g_strdup( from->beg );
-  to->end = g_strdup( from->end );
-  to->susp = g_strdup( from->susp );
-  return to;
+  return g_new0( arena_t, 1 );
 }
 
 
 /**
- * Free allocated hookpair memory.
+ * Release Arena and all memory allocated from it.
  *
- * @param pair Pair to dealloc.
+ * @param arena Arena.
  */
-void hookpair_del( hookpair_t* pair )
+void arena_rem( arena_t* arena )
 {
-  g_free( pair->beg );
-  g_free( pair->end );
-  g_free( pair->susp );
+  gpointer block = arena->blocks;
+
+  while ( block )
+    {
+      gpointer prev = *(gpointer*) block;
+      g_free( block );
+      block = prev;
+    }
+
+  if ( arena->strs )
+    g_hash_table_destroy( arena->strs );
+  if ( arena->pairs )
+    g_hash_table_destroy( arena->pairs );
+
+  g_free( arena );
 }
 
 
 /**
- * Create new Stackfile.
+ * Allocate zeroed memory from Arena. The memory is valid until the
+ * Arena is removed.
  *
- * @param filename Filename (NULL for stdin).
- * @param inherit  Inherit hooks source (NULL for defaults).
+ * @param arena Arena.
+ * @param size  Allocation size.
  *
- * @return Stackfile.
+ * @return Allocated memory.
  */
-stackfile_t* sf_new( gchar* filename, stackfile_t* inherit )
+gpointer arena_alloc( arena_t* arena, gsize size )
 {
-  stackfile_t* sf;
+  gpointer ret;
 
-  sf = g_new0( stackfile_t, 1 );
+  /* Keep allocations pointer aligned. */
+  size = ( size + sizeof( gpointer ) - 1 ) & ~( sizeof( gpointer ) - 1 );
 
-  if ( filename )
+  if ( size > arena->left )
     {
-      /* Real file. */
-
-      sf->fh = g_fopen( filename, (gchar*) "r" );
-      sf->filename = g_strdup( filename );
-
-      if ( sf->fh == NULL )
-        {
-          stackfile_t* err_sf;
+      gsize bsize = sizeof( gpointer ) + MAX( size, ARENA_BLOCK );
+      gpointer block = g_malloc0( bsize );
 
-          /* Get the includer. */
-          err_sf = ruby_ps->fs->file->data;
-
-          mucgly_fatal( err_sf, "Can't open \"%s\"", filename );
-        }
+      /* Chain to previous block. */
+      *(gpointer*) block = arena->blocks;
+      arena->blocks = block;
 
+      arena->pos = (gchar*) block + sizeof( gpointer );
+      arena->left = bsize - sizeof( gpointer );
     }
-  else
-    {
-      /* Use stdin. */
-      sf->fh = stdin;
-      sf->filename = g_strdup( "<STDIN>" );
-    }
-
-  sf->buf = g_string_sized_new( 0 );
-  sf->lineno = 0;
-  sf->column = 0;
-  sf->old_column = 0;
-
-  sf->macro = FALSE;
-  sf->macro_line = 0;
-  sf->macro_col = 0;
-  sf->eat_tail = FALSE;
 
-  sf->multi = NULL;
-  sf->multi_cnt = 0;
+  ret = arena->pos;
+  arena->pos += size;
+  arena->left -= size;
 
-  sf->curhook = NULL;
+  return ret;
+}
 
 
-  if ( inherit )
-    {
-      /* Inherited hook values. */
-      hookpair_cpy( &inherit->hook, &sf->hook );
-      sf->hookesc = g_strdup( inherit->hookesc );
+/**
+ * Intern string to Arena. Equal strings get the same pointer.
+ *
+ * @param arena Arena.
+ * @param str   String (or NULL).
+ *
+ * @return Interned string (or NULL).
+ */
+gchar* arena_strdup( arena_t* arena, const gchar* str )
+{
+  gchar* ret;
+  gsize len;
 
-      /* Setup fast-lookup caches. */
-      sf_update_hook_cache( sf );
+  if ( str == NULL )
+    return NULL;
 
-      if ( inherit->multi )
-        {
-          for ( int i = 0; i < inherit->multi_cnt; i++ )
-            {
-              sf_multi_hook( sf, inherit->multi[i].beg, inherit->multi[i].end, inherit->multi[i].susp  );
-            }
-        }
-    }
-  else
-    {
-      /* Default hook values. */
-      sf->hook.beg = g_strdup( HOOKBEG_DEFAULT );
-      sf->hook.end = g_strdup( HOOKEND_DEFAULT );
-      sf->hookesc = g_strdup( HOOKESC_DEFAULT );
+  if ( arena->strs == NULL )
+    arena->strs = g_hash_table_new( g_str_hash, g_str_equal );
+  else if ( ( ret = g_hash_table_lookup( arena->strs, str ) ) )
+    return ret;
 
-      /* Setup fast-lookup caches. */
-      sf_update_hook_cache( sf );
-    }
+  len = strlen( str );
+  ret = arena_alloc( arena, len+1 );
+  memcpy( ret, str, len );
+  g_hash_table_add( arena->strs, ret );
 
-  return sf;
+  return ret;
 }
 
 
 /**
- * Store macro start info.
+ * Hash function for interned hookpairs. Strings are interned, hence
+ * pointers identify the content.
  *
- * @param sf Stackfile.
+ * @param key Hookpair.
+ *
+ * @return Hash value.
  */
-void sf_mark_macro( stackfile_t* sf )
+guint hookpair_hash( gconstpointer key )
 {
-  sf->macro = TRUE;
-  sf->macro_line = sf->lineno;
-  sf->macro_col = sf->column;
+  const hookpair_t* pair = key;
+
+  return ( g_direct_hash( pair->beg ) * 31
+           + g_direct_hash( pair->end ) ) * 31
+    + g_direct_hash( pair->susp );
 }
 
 
 /**
- * Reset macro start info.
+ * Equality function for interned hookpairs.
  *
- * @param sf Stackfile.
+ * @param a Hookpair.
+ * @param b Hookpair.
+ *
+ * @return TRUE if equal.
  */
-void sf_unmark_macro( stackfile_t* sf )
+gboolean hookpair_equal( gconstpointer a, gconstpointer b )
 {
-  sf->macro = FALSE;
+  const hookpair_t* pa = a;
+  const hookpair_t* pb = b;
+
+  return ( pa->beg == pb->beg && pa->end == pb->end && pa->susp == pb->susp );
 }
 
 
 /**
- * Free Stackfile and close the file stream.
+ * Intern hookpair to Arena. The returned pair is shared and must
+ * not be modified.
  *
- * @param sf Stackfile.
+ * @param arena Arena.
+ * @param beg   Hookbeg.
+ * @param end   Hookend.
+ * @param susp  Suspension (or NULL).
+ *
+ * @return Interned hookpair.
  */
-void sf_rem( stackfile_t* sf )
+hookpair_t* arena_pair( arena_t* arena, const gchar* beg, const gchar* end, const gchar* susp )
 {
-  g_string_free( sf->buf, TRUE );
+  hookpair_t key;
+  hookpair_t* ret;
 
-  if ( sf->fh != stdin )
-    {
-      fclose( sf->fh );
-    }
-
-  g_free( sf->filename );
+  key.beg = arena_strdup( arena, beg );
+  key.end = arena_strdup( arena, end );
+  key.susp = arena_strdup( arena, susp );
 
-  hookpair_del( &sf->hook );
-  g_free( sf->hookesc );
+  if ( arena->pairs == NULL )
+    arena->pairs = g_hash_table_new( hookpair_hash, hookpair_equal );
+  else if ( ( ret = g_hash_table_lookup( arena->pairs, &key ) ) )
+    return ret;
 
-  if ( sf->multi )
-    {
-      for ( int i = 0; i < sf->multi_cnt; i++ )
-        hookpair_del( &sf->multi[i] );
-      g_free( sf->multi );
-    }
+  ret = arena_alloc( arena, sizeof( hookpair_t ) );
+  *ret = key;
+  g_hash_table_add( arena->pairs, ret );
 
-  g_free( sf );
+  return ret;
 }
 
 
 /**
- * Get char from Stackfile.
- *
- * @param sf Stackfile.
+ * Create new Hookcfg with default hooks.
  *
- * @return Char or EOF.
+ * @return Hookcfg (with one reference).
  */
-int sf_get( stackfile_t* sf )
+hookcfg_t* hookcfg_new( void )
 {
-  int ret;
-
- re_read:
-  if ( sf->buf->len > 0 )
-    {
-      /* Pending chars in buffer, don't need to read file (yet). */
-      int pos = sf->buf->len-1;
-
-      /* Use buffer as stack with oldest (first to use) on right. */
-      ret = sf->buf->str[ pos ];
-      g_string_truncate( sf->buf, pos );
-    }
-  else
-    {
-      /* Read from actual file stream. */
-#ifdef DEBUG_CHAR
-      ret = fgetc( sf->fh );
-      if ( DEBUG_CHAR == (char) ret )
-        {
-          mucgly_debug();
-          ret = fgetc( sf->fh );
-        }
-#else
-      ret = fgetc( sf->fh );
-#endif
+  hookcfg_t* hc;
 
-    }
+  hc = g_new0( hookcfg_t, 1 );
+  hc->refcnt = 1;
+  hc->arena = arena_new();
 
-  /* Update file point info. */
-  if ( ret != EOF )
-    {
-      if ( ret == '\n' )
-        {
-          sf->old_column = sf->column;
-          sf->lineno++;
-          sf->column = 0;
-        }
-      else
-        {
-          sf->column++;
-        }
-    }
+  hc->hook = arena_pair( hc->arena, HOOKBEG_DEFAULT, HOOKEND_DEFAULT, NULL );
+  hc->hookesc = arena_strdup( hc->arena, HOOKESC_DEFAULT );
 
-  if ( sf->eat_tail == TRUE )
-    {
-      /* Eat tail if not in EOF. */
-      sf->eat_tail = FALSE;
-      if ( ret != EOF )
-        goto re_read;
-    }
+  /* Setup fast-lookup caches. */
+  hookcfg_update_cache( hc );
 
-  return ret;
+  return hc;
 }
 
 
 /**
- * Put char back to Stackfile.
+ * Take reference to Hookcfg.
  *
- * @param sf Stackfile.
- * @param c  Char.
+ * @param hc Hookcfg.
  *
- * @return TRUE.
+ * @return Hookcfg.
  */
-gboolean sf_put( stackfile_t* sf, char c )
+hookcfg_t* hookcfg_ref( hookcfg_t* hc )
 {
-  if ( c == '\n' )
-    {
-      sf->lineno--;
-      sf->column = sf->old_column;
-      sf->old_column = 0;
-    }
-  else
-    {
-      sf->column--;
-    }
-
-  /* Use buffer as stack with oldest (first to use) on right. */
-  g_string_append_c( sf->buf, c );
-
-  return TRUE;
+  hc->refcnt++;
+  return hc;
 }
 
 
 /**
- * Update the hooks related cache/lookup entries.
+ * Release reference to Hookcfg. Last reference frees the Hookcfg.
  *
- * @param sf Stackfile.
+ * @param hc Hookcfg.
  */
-void sf_update_hook_cache( stackfile_t* sf )
+void hookcfg_unref( hookcfg_t* hc )
 {
-  if ( sf->multi )
-    {
-      /* Esc can never match multihooks. */
-      sf->hook_esc_eq_beg = FALSE;
-      sf->hook_esc_eq_end = FALSE;
-
-      /* Add the latest addition to 1st char lookup. */
-      sf->hook_1st_chars[ sf->multi[ sf->multi_cnt-1 ].beg[0] ] = 1;
-      sf->hook_1st_chars[ sf->multi[ sf->multi_cnt-1 ].end[0] ] = 1;
-      if ( sf->multi[ sf->multi_cnt-1 ].susp )
-        sf->hook_1st_chars[ sf->multi[ sf->multi_cnt-1 ].susp[0] ] = 1;
+  if ( --hc->refcnt > 0 )
+    return;
 
-      sf->hook_1st_chars[ sf->hookesc[0] ] = 1;
-    }
-  else
-    {
-      /* Store these equalities for speed-up. */
-      if ( !g_strcmp0( sf->hookesc, sf->hook.beg ) )
-        sf->hook_esc_eq_beg = TRUE;
-      else
-        sf->hook_esc_eq_beg = FALSE;
-
-      if ( !g_strcmp0( sf->hookesc, sf->hook.end ) )
-        sf->hook_esc_eq_end = TRUE;
-      else
-        sf->hook_esc_eq_end = FALSE;
-
-      /* Initialize 1st char lookup. */
-      memset( sf->hook_1st_chars, 0, 256 * sizeof( guchar ) );
-
-      /* Hook 1st char lookup. */
-      sf->hook_1st_chars[ sf->hook.beg[0] ] = 1;
-      sf->hook_1st_chars[ sf->hook.end[0] ] = 1;
-      sf->hook_1st_chars[ sf->hookesc[0] ] = 1;
-    }
+  hookcfg_clear_multi( hc );
+  arena_rem( hc->arena );
+  g_free( hc );
 }
 
 
 /**
- * Set hook value.
+ * Copy Hookcfg for modification. Pairs are re-interned to the arena
+ * of the copy, and lookups and matcher are copied as is (pair indices
+ * are preserved).
  *
- * @param sf    Stackfile.
- * @param hook  Hook type.
- * @param value New hook value.
+ * @param from Hookcfg to copy.
+ *
+ * @return Hookcfg (with one reference).
  */
-void sf_set_hook( stackfile_t* sf, hook_t hook, char* value )
+hookcfg_t* hookcfg_copy( hookcfg_t* from )
 {
-  /* Check that we are not in multi-hook mode. */
-  if ( sf->multi && hook != hook_esc )
+  hookcfg_t* hc;
+
+  hc = g_new0( hookcfg_t, 1 );
+  *hc = *from;
+  hc->refcnt = 1;
+  hc->arena = arena_new();
+
+  hc->hook = arena_pair( hc->arena, from->hook->beg, from->hook->end, NULL );
+  hc->hookesc = arena_strdup( hc->arena, from->hookesc );
+
+  if ( from->multi )
     {
-      /* Disable multi-hook mode. */
-      for ( int i = 0; i < sf->multi_cnt; i++ )
-        hookpair_del( &sf->multi[i] );
-      g_free( sf->multi );
-      sf->multi_cnt = 0;
+      hc->multi = g_new0( hookpair_t*, from->multi_size );
+      for ( int i = 0; i < from->multi_cnt; i++ )
+        hc->multi[i] = arena_pair( hc->arena,
+                                   from->multi[i]->beg,
+                                   from->multi[i]->end,
+                                   from->multi[i]->susp );
     }
 
-  /* Set values. */
-  switch ( hook )
+  if ( from->trie )
     {
-    case hook_beg: g_free( sf->hook.beg ); sf->hook.beg = g_strdup( value ); break;
-    case hook_end: g_free( sf->hook.end ); sf->hook.end = g_strdup( value ); break;
-    case hook_esc:
-      {
-        /* Remove old esc from 1st char lookup. */
-        sf->hook_1st_chars[ sf->hookesc[0] ] = 0;
-        g_free( sf->hookesc );
-        sf->hookesc = g_strdup( value );
-        break;
-      }
-    default: break;
+      hc->trie = g_new( hooknode_t, from->trie_size );
+      memcpy( hc->trie, from->trie, from->trie_cnt * sizeof( hooknode_t ) );
     }
 
-  sf_update_hook_cache( sf );
+  return hc;
 }
 
 
 /**
- * Set eater value.
+ * Check if include file cache entry matches file status.
  *
- * @param sf     Stackfile.
- * @param value  New eater value.
+ * @param e  Cache entry (or NULL).
+ * @param st File status.
+ *
+ * @return TRUE if entry is for the same unchanged file.
  */
-void sf_set_eater( stackfile_t* sf, char* value )
+gboolean fcache_match( fcache_entry_t* e, GStatBuf* st )
 {
-  if ( sf->eater )
-    g_free( sf->eater );
-
-  sf->eater = NULL;
-  if ( value )
-    sf->eater = g_strdup( value );
+  return ( e
+           && e->mtime == mucgly_mtime_ns( st )
+           && e->size == (gint64) st->st_size
+           && e->ino == (guint64) st->st_ino
+           && e->dev == (guint64) st->st_dev );
 }
 
 
-
 /**
- * Add multi-hook pair.
+ * Get shared content of regular file from include file cache. File
+ * is mapped, if it is not cached or it has changed since mapping
+ * (device, inode, size, or mtime in ns). Mapping is done without the
+ * cache lock, so that workers missing the cache are not serialized.
  *
- * @param sf    Stackfile.
- * @param beg   Hookbeg of pair.
- * @param end   Hookend of pair.
- * @param susp  Suspension.
+ * Note that content is shared memory mapping of the file. A file
+ * replaced by rename is detected and re-mapped, but a file truncated
+ * in place while it is being processed causes SIGBUS on access
+ * beyond the new end. Inputs should not be rewritten in place during
+ * a run.
+ *
+ * @param path File name.
+ * @param st   File status.
+ *
+ * @return Content with new reference (or NULL if file can't be mapped).
  */
-void sf_multi_hook( stackfile_t* sf, const char* beg, const char* end, const char* susp )
+GMappedFile* fcache_get( const gchar* path, GStatBuf* st )
 {
-  /* Check that hooks don't match escape. */
-  if ( !g_strcmp0( sf->hookesc, beg )
-       || !g_strcmp0( sf->hookesc, end ) )
+  fcache_entry_t* e;
+  GMappedFile* map;
+
+  g_mutex_lock( &fcache_lock );
+
+  if ( fcache_table == NULL )
+    fcache_table = g_hash_table_new( g_str_hash, g_str_equal );
+
+  e = g_hash_table_lookup( fcache_table, path );
+
+  if ( fcache_match( e, st ) )
     {
-      g_print( "mucgly: Esc hook is not allowed to match multihooks\n" );
-      exit( EXIT_FAILURE );
+      /* Unchanged, move to most recently used. */
+      fcache_hits++;
+      g_queue_unlink( &fcache_lru, &e->link );
+      g_queue_push_head_link( &fcache_lru, &e->link );
+      map = g_mapped_file_ref( e->map );
+      g_mutex_unlock( &fcache_lock );
+      return map;
     }
 
-  if ( sf->multi == NULL )
-    {
-      /* Allocate enough pairs. */
-      sf->multi = g_new0( hookpair_t, MULTI_LIMIT );
-      sf->multi[0] = (hookpair_t) {0,0,0};
-      sf->multi_cnt = 0;
+  fcache_misses++;
 
-      /* Clear non-multi-mode lookups. */
-      memset( sf->hook_1st_chars, 0, 256 * sizeof( guchar ) );
-    }
+  g_mutex_unlock( &fcache_lock );
 
-  if ( sf->multi_cnt >= (MULTI_LIMIT-1) )
+  map = g_mapped_file_new( path, FALSE, NULL );
+
+  if ( map == NULL )
+    return NULL;
+
+  if ( (gint64) g_mapped_file_get_length( map ) != (gint64) st->st_size )
     {
-      g_print( "mucgly: Too many multihooks, 127 allowed!\n" );
-      exit( EXIT_FAILURE );
+      /* Changed between stat and mapping, caller reads the file
+         without cache. */
+      g_mapped_file_unref( map );
+      return NULL;
     }
 
-  sf->multi[sf->multi_cnt].beg = g_strdup( beg );
-  sf->multi[sf->multi_cnt].end = g_strdup( end );
-  sf->multi[sf->multi_cnt].susp = g_strdup( susp );
+#ifdef MADV_SEQUENTIAL
+  madvise( g_mapped_file_get_contents( map ), g_mapped_file_get_length( map ), MADV_SEQUENTIAL );
+#endif
 
-  sf->multi_cnt++;
-  sf->multi[sf->multi_cnt] = (hookpair_t) {0,0,0};
+  g_mutex_lock( &fcache_lock );
 
-  sf_update_hook_cache( sf );
-}
+  /* Another thread may have cached the same file meanwhile. */
+  e = g_hash_table_lookup( fcache_table, path );
 
+  if ( fcache_match( e, st ) )
+    {
+      g_queue_unlink( &fcache_lru, &e->link );
+      g_queue_push_head_link( &fcache_lru, &e->link );
+      g_mutex_unlock( &fcache_lock );
+      return map;
+    }
 
-/**
- * Create new Filestack.
- *
- * @return Filestack.
- */
-filestack_t* fs_new( void )
-{
-  filestack_t* fs;
+  if ( e )
+    {
+      /* Changed, current users keep their references. */
+      g_mapped_file_unref( e->map );
+      g_queue_unlink( &fcache_lru, &e->link );
+    }
+  else
+    {
+      fcache_evict( FCACHE_LIMIT-1 );
 
-  fs = g_new0( filestack_t, 1 );
-  fs->file = NULL;
-  return fs;
+      e = g_new0( fcache_entry_t, 1 );
+      e->path = g_strdup( path );
+      e->link.data = e;
+      g_hash_table_insert( fcache_table, e->path, e );
+    }
+
+  e->map = g_mapped_file_ref( map );
+  e->mtime = mucgly_mtime_ns( st );
+  e->size = st->st_size;
+  e->ino = st->st_ino;
+  e->dev = st->st_dev;
+  g_queue_push_head_link( &fcache_lru, &e->link );
+
+  g_mutex_unlock( &fcache_lock );
+
+  return map;
 }
 
 
 /**
- * Free Filestack and close all Stackfiles.
+ * Evict least recently used files from include file cache until at
+ * most limit files remain. Caller holds the cache lock.
  *
- * @param fs Filestack.
- *
- * @return NULL.
+ * @param limit Number of files to keep.
  */
-filestack_t* fs_rem( filestack_t* fs )
+void fcache_evict( int limit )
 {
-  if ( fs )
+  while ( (int) fcache_lru.length > limit )
     {
-      for ( GList* p = fs->file; p; p = p->next )
-        {
-          sf_rem( (stackfile_t*) p->data );
-        }
+      fcache_entry_t* e;
 
-      g_free( fs );
+      e = g_queue_peek_tail_link( &fcache_lru )->data;
+      g_queue_unlink( &fcache_lru, &e->link );
+      g_hash_table_remove( fcache_table, e->path );
+
+      g_mapped_file_unref( e->map );
+      g_free( e->path );
+      g_free( e );
     }
+}
 
-  return NULL;
+
+/**
+ * Get include file cache status.
+ *
+ * @param hits   Number of cache hits.
+ * @param misses Number of cache misses.
+ * @param size   Number of cached files.
+ */
+void fcache_stats( gint64* hits, gint64* misses, int* size )
+{
+  g_mutex_lock( &fcache_lock );
+  *hits = fcache_hits;
+  *misses = fcache_misses;
+  *size = fcache_lru.length;
+  g_mutex_unlock( &fcache_lock );
 }
 
 
 /**
- * Push file on top of Filestack.
+ * Create new Stackfile. Regular files are shared through the include
+ * file cache.
  *
- * @param fs       Filestack.
- * @param filename New top file.
+ * @param filename Filename (NULL for stdin).
+ * @param inherit  Inherit hooks source (NULL for defaults).
+ *
+ * @return Stackfile.
  */
-void fs_push_file( filestack_t* fs, gchar* filename )
+stackfile_t* sf_new( gchar* filename, stackfile_t* inherit )
 {
   stackfile_t* sf;
 
-  if ( fs->file )
-    /* Additional file. */
-    sf = sf_new( filename, fs_topfile(fs) );
+  sf = g_new0( stackfile_t, 1 );
+
+  if ( filename )
+    {
+      /* Real file. */
+
+      GStatBuf st;
+
+      sf->filename = g_strdup( filename );
+
+      if ( g_stat( filename, &st ) == 0
+           && S_ISREG( st.st_mode )
+           && st.st_size > 0
+           && ( sf->map = fcache_get( filename, &st ) ) )
+        {
+          /* Shared read-only content. */
+          sf->data = g_mapped_file_get_contents( sf->map );
+          sf->data_len = g_mapped_file_get_length( sf->map );
+          sf_init_hooks( sf, inherit );
+          return sf;
+        }
+
+      sf->fh = g_fopen( filename, (gchar*) "r" );
+
+      if ( sf->fh == NULL )
+        /* Report at the includer. */
+        mucgly_fatal( inherit, "Can't open \"%s\"", filename );
+
+      if ( fstat( fileno( sf->fh ), &st ) == 0
+           && S_ISREG( st.st_mode ) )
+        {
+          /* Regular file, map the whole content. Zero size files are
+             streamed, since procfs and sysfs files report zero size
+             but have content. */
+
+          if ( st.st_size > 0 )
+            sf->map = g_mapped_file_new_from_fd( fileno( sf->fh ), FALSE, NULL );
+
+          if ( sf->map )
+            {
+              sf->data = g_mapped_file_get_contents( sf->map );
+              sf->data_len = g_mapped_file_get_length( sf->map );
+#ifdef MADV_SEQUENTIAL
+              madvise( sf->data, sf->data_len, MADV_SEQUENTIAL );
+#endif
+
+              /* Mapping is independent of the stream. */
+              fclose( sf->fh );
+              sf->fh = NULL;
+            }
+        }
+
+    }
   else
-    /* First file, i.e. inherit stack_default hooks. */
-    sf = sf_new( filename, stack_default );
+    {
+      /* Use stdin. */
+      sf->fh = stdin;
+      sf->filename = g_strdup( "<STDIN>" );
+    }
 
-  /* Push file. */
-  fs->file = g_list_prepend( fs->file, sf );
+  if ( sf->fh )
+    {
+      /* Streaming input (stdin, pipe, or unmappable file). */
+      sf->data_size = SF_READ_SIZE;
+      sf->data = g_malloc( sf->data_size );
+    }
+
+  sf_init_hooks( sf, inherit );
 
-  /* Set global CurrentStackfile handle. */
-  csf = (stackfile_t*) fs->file->data;
+  return sf;
 }
 
 
 /**
- * Push file on top of Filestack for later use (i.e. current macro is
- * completely processed).
+ * Create Stackfile for data in memory. Data is not copied and it has
+ * to stay available while Stackfile is used. Replay of precompiled
+ * templates uses Stackfiles without data (NULL).
  *
- * @param fs       Filestack.
- * @param filename New top file.
+ * @param name    Name for input (in messages).
+ * @param data    Input data (or NULL).
+ * @param len     Data length.
+ * @param inherit Inherit hooks from.
+ *
+ * @return Stackfile.
  */
-void fs_push_file_delayed( filestack_t* fs, gchar* filename )
+stackfile_t* sf_new_data( gchar* name, gchar* data, gsize len, stackfile_t* inherit )
 {
-  fs_push_file( fs, filename );
-  fs->file = fs->file->next;
+  stackfile_t* sf;
+
+  sf = g_new0( stackfile_t, 1 );
+
+  sf->filename = g_strdup( name );
+  sf->data = data;
+  sf->data_len = data ? len : 0;
+
+  sf_init_hooks( sf, inherit );
+
+  return sf;
 }
 
 
 /**
- * Pop file from top of Filestack. File is closed.
+ * Initialize position and hook state of new Stackfile.
  *
- * @param fs Filestack.
+ * @param sf      Stackfile.
+ * @param inherit Inherit hooks from (or NULL for defaults).
  */
-void fs_pop_file( filestack_t* fs )
+void sf_init_hooks( stackfile_t* sf, stackfile_t* inherit )
 {
-  stackfile_t* sf;
+  sf->data_pos = 0;
 
-  sf = fs->file->data;
-  sf_rem( sf );
-  fs->file = g_list_delete_link( fs->file, fs->file );
+  sf->data_off = 0;
+  sf->nl_off = 0;
+  sf->nl_cnt = 0;
+  sf->nl_line = 0;
+  sf->line_base = 0;
+  sf->col_base = 0;
 
-  /* Set global CurrentStackfile handle. */
-  if ( fs->file )
-    csf = (stackfile_t*) fs->file->data;
+  sf->macro = FALSE;
+  sf->macro_line = 0;
+  sf->macro_col = 0;
+  sf->eat_tail = FALSE;
+
+  sf->curhook = NULL;
+  sf->curhook_cnt = 0;
+  sf->curhook_size = 0;
+
+  /* Share parent hooks until modified. */
+  if ( inherit )
+    sf->cfg = hookcfg_ref( inherit->cfg );
   else
-    csf = NULL;
+    sf->cfg = hookcfg_new();
 }
 
 
 /**
- * Get char from (through) Filestack (i.e. top file). Stop at EOF, and
- * don't pop the file in order to allow putback to the file.
- *
- * @param fs Filestack.
+ * Store macro start info.
  *
- * @return Char or EOF.
+ * @param sf Stackfile.
  */
-int fs_get( filestack_t* fs )
+void sf_mark_macro( stackfile_t* sf )
 {
-  if ( fs->file != NULL )
-    return sf_get( fs_topfile(fs) );
-  else
-    return EOF;
+  sf->macro = TRUE;
+  sf_position( sf, &sf->macro_line, &sf->macro_col );
 }
 
 
 /**
- * Get char from (through) Filestack (i.e. top file). If EOF is
- * encountered, continue with lower file if possible.
- *
- * @param fs Filestack.
+ * Reset macro start info.
  *
- * @return Char or EOF.
+ * @param sf Stackfile.
  */
-int fs_get_one( filestack_t* fs )
+void sf_unmark_macro( stackfile_t* sf )
 {
-  int ret;
+  sf->macro = FALSE;
+}
 
-  if ( fs->file != NULL )
+
+/**
+ * Free Stackfile and close the file stream. Memory data is owned by
+ * the caller.
+ *
+ * @param sf Stackfile.
+ */
+void sf_rem( stackfile_t* sf )
+{
+  if ( sf->map )
     {
-      ret = sf_get( fs_topfile(fs) );
+      g_mapped_file_unref( sf->map );
+    }
+  else if ( sf->fh )
+    {
+      g_free( sf->data );
 
-      /* Pop Stackfiles until no files or non-EOF char is received. */
-      while ( ret == EOF )
-        {
-          fs_pop_file( fs );
-          if ( fs->file == NULL )
-            return EOF;
-          ret = sf_get( fs_topfile(fs) );
-        }
+      /* Reader is stopped before its stream is closed. Read-ahead
+         beyond the consumed input is dropped (see iopipe_rem). */
+      if ( sf->iop )
+        iopipe_rem( sf->iop );
 
-      return ret;
+      if ( sf->fh != stdin )
+        fclose( sf->fh );
     }
-  else
+  else if ( sf->data_own )
     {
-      return EOF;
+      g_free( sf->data );
     }
+
+  g_free( sf->filename );
+
+  g_free( sf->eater );
+  g_free( sf->curhook );
+
+  hookcfg_unref( sf->cfg );
+
+  g_free( sf );
 }
 
 
 /**
- * Put back char.
+ * Check if streaming input can be read without blocking (data or EOF
+ * is pending).
  *
- * @param fs Filestack.
- * @param c  Char.
+ * @param sf Stackfile.
  *
- * @return TRUE.
+ * @return TRUE if read does not block.
  */
-gboolean fs_put( filestack_t* fs, char c )
+gboolean sf_ready( stackfile_t* sf )
 {
-  sf_put( fs_topfile(fs), c );
-  return TRUE;
+  struct pollfd pfd;
+
+  if ( sf->iop )
+    return iopipe_ready( sf->iop );
+
+  pfd.fd = fileno( sf->fh );
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return ( poll( &pfd, 1, 0 ) != 0 );
 }
 
 
 /**
- * Get n chars from Filestack. If ret is non-null, use that for
- * storage.
+ * Make sure that at least n chars are available after the read
+ * cursor. Streaming input drops the consumed chars and reads more
+ * data, mapped input is complete from the start.
  *
- * @param fs  Filestack.
- * @param n   Number of chars to get.
- * @param ret Storage for data.
+ * @param sf Stackfile.
+ * @param n  Number of chars needed.
  *
- * @return Return data.
+ * @return Number of available chars (less than n only at EOF).
  */
-GString* fs_get_n( filestack_t* fs, int n, GString* ret )
+gsize sf_fill( stackfile_t* sf, gsize n )
 {
+  gsize avail = sf->data_len - sf->data_pos;
+  gssize cnt;
+
+  if ( avail >= n || sf->fh == NULL || sf->data_eof )
+    return avail;
 
-  if ( ret == NULL )
+  /* Drop consumed data. */
+  if ( sf->data_pos > 0 )
     {
-      /* New GString is needed for storage. */
-      ret = g_string_sized_new( 0 );
+      /* Dropped lines are counted first. */
+      sf_count_lines( sf, sf_offset( sf ) );
+      sf->data_off += sf->data_pos;
+      memmove( sf->data, &sf->data[ sf->data_pos ], avail );
+      sf->data_len = avail;
+      sf->data_pos = 0;
     }
-  else
+
+  /* Lookahead can be longer than the block. */
+  if ( sf->data_size < n + SF_READ_SIZE )
     {
-      /* Reset size of the existing storage. */
-      g_string_set_size( ret, 0 );
+      sf->data_size = n + SF_READ_SIZE;
+      sf->data = g_realloc( sf->data, sf->data_size );
     }
 
-
-  /* Get n chars from current file. If EOF is encountered, reading is
-     terminated. */
-
-  for ( int i = 0, c; ; )
+  while ( avail < n )
     {
-      if ( i >= n )
-        break;
-
-      c = fs_get( fs );
+      /* Give a chance to complete pending work before blocking. */
+      if ( sf->wait )
+        sf->wait( sf, sf->wait_data );
 
-      if ( c != EOF )
+      if ( sf->iop )
         {
-          g_string_append_c( ret, (char) c );
-          i++;
+          /* Prefetched by reader thread. */
+          cnt = iopipe_read( sf->iop, &sf->data[ sf->data_len ],
+                             sf->data_size - sf->data_len );
         }
       else
         {
+          /* Use read, since fread would block until the whole block is
+             filled (or EOF), which would stall pipe processing. */
+          do
+            cnt = read( fileno( sf->fh ), &sf->data[ sf->data_len ],
+                        sf->data_size - sf->data_len );
+          while ( cnt < 0 && errno == EINTR );
+        }
+
+      if ( cnt <= 0 )
+        {
+          /* EOF is sticky, same as with stdio. */
+          sf->data_eof = TRUE;
           break;
         }
+
+      sf->data_len += cnt;
+      avail += cnt;
     }
 
-  return ret;
+  return avail;
 }
 
 
 /**
- * Put chars in str back to Filestack. If n is 0, then use strlen to
- * get the count.
+ * Count newlines up to input offset. Positions are not maintained
+ * while reading, but computed on demand (see sf_position), and each
+ * input char is counted only once. Offset must be within the data,
+ * and at least the previous count offset.
  *
- * @param fs  Filestack.
- * @param str Content to add.
- * @param n   Number of chars from content.
- *
- * @return True if success.
+ * @param sf  Stackfile.
+ * @param off Input offset.
  */
-gboolean fs_put_n( filestack_t* fs, gchar* str, int n )
+void sf_count_lines( stackfile_t* sf, gint64 off )
 {
-  if ( n == 0 )
-    n = strlen( str );
+  const gchar* nl;
+  gsize lines;
 
-  /* Put chars with newest first (i.e. reverse order), so that oldest
-     comes out first. */
-  for ( int i = n-1; i >= 0; i-- )
+  if ( off <= sf->nl_off )
+    return;
+
+  lines = mucgly_count_lines( &sf->data[ sf->nl_off - sf->data_off ], off - sf->nl_off, &nl );
+  if ( lines )
     {
-      fs_put( fs, str[ i ] );
+      sf->nl_cnt += lines;
+      sf->nl_line = sf->data_off + ( nl - sf->data ) + 1;
     }
 
-  return TRUE;
+  sf->nl_off = off;
 }
 
 
 /**
- * Create new Outfile. If filename is NULL, then stream is stdout.
- *
- * @param filename File name (or NULL for stdout).
+ * Get file point of read cursor.
  *
- * @return Outfile.
+ * @param sf   Stackfile.
+ * @param line Line number (0->).
+ * @param col  Line column (0->).
  */
-outfile_t* outfile_new( gchar* filename )
+void sf_position( stackfile_t* sf, gint64* line, gint64* col )
 {
-  outfile_t* of;
+  gint64 off = sf_offset( sf );
 
-  of = g_new0( outfile_t, 1 );
-  of->lineno = 0;
-  of->blocked = FALSE;
+  sf_count_lines( sf, off );
 
-  if ( filename )
-    {
-      /* Disk file output. */
+  *line = sf->line_base + sf->nl_cnt;
+  *col = off - sf->nl_line + ( sf->nl_cnt == 0 ? sf->col_base : 0 );
+}
 
-      of->filename = g_strdup( filename );
 
-      of->fh = g_fopen( filename, (gchar*) "w" );
+/**
+ * Get line number of read cursor.
+ *
+ * @param sf Stackfile.
+ *
+ * @return Line number (0->).
+ */
+gint64 sf_line( stackfile_t* sf )
+{
+  gint64 line, col;
 
-      if ( of->fh == NULL )
-        {
-          stackfile_t* err_sf;
+  sf_position( sf, &line, &col );
 
-          /* Get the includer. */
-          err_sf = ruby_ps->fs->file->data;
+  return line;
+}
 
-          mucgly_fatal( err_sf, "Can't open \"%s\"", err_sf->filename );
-        }
-    }
-  else
-    {
-      /* STDOUT output. */
-      of->filename = g_strdup( "<STDOUT>" );
-      of->fh = stdout;
-    }
 
-  return of;
+/**
+ * Set file point of read cursor, i.e. following positions are
+ * relative to it. Used for input which starts in the middle of a
+ * file (parallel segments, template replay).
+ *
+ * @param sf   Stackfile.
+ * @param line Line number (0->).
+ * @param col  Line column (0->).
+ */
+void sf_set_position( stackfile_t* sf, gint64 line, gint64 col )
+{
+  sf->line_base = line;
+  sf->col_base = col;
+  sf->nl_cnt = 0;
+  sf->nl_off = sf_offset( sf );
+  sf->nl_line = sf->nl_off;
 }
 
 
 /**
- * Free Outfile and close output stream if non-stdout.
+ * Eat the char after macro, if pending and not at EOF.
  *
- * @param of Outfile.
+ * @param sf Stackfile.
  */
-void outfile_rem( outfile_t* of )
+void sf_eat_tail( stackfile_t* sf )
 {
-  if ( of->fh != stdout )
-    fclose( of->fh );
-
-  g_free( of->filename );
-  g_free( of );
+  sf->eat_tail = FALSE;
+  if ( sf_fill( sf, 1 ) > 0 )
+    sf_skip( sf, 1 );
 }
 
 
 /**
- * Create Pstate. Create input file stack and output file
- * stack. Initialize parsing state.
+ * Get char from Stackfile.
  *
- * @param outfile Initial input file name.
+ * @param sf Stackfile.
  *
- * @return Pstate.
+ * @return Char or EOF.
  */
-pstate_t* ps_new( gchar* outfile )
+int sf_get( stackfile_t* sf )
 {
-  pstate_t* ps;
-
-  ps = g_new0( pstate_t, 1 );
-
-  ps->fs = fs_new();
+  int ret;
 
-  ps->in_macro = 0;
-  ps->suspension = 0;
+  if ( sf->eat_tail )
+    sf_eat_tail( sf );
 
-  /* Preview input buffer. */
-  ps->check_buf = g_string_sized_new( 0 );
+  if ( sf->data_pos < sf->data_len || sf_fill( sf, 1 ) > 0 )
+    {
+      ret = (guchar) sf->data[ sf->data_pos++ ];
+    }
+  else
+    {
+      ret = EOF;
+    }
 
-  /* Top level input buffer. */
-  ps->macro_buf = g_string_sized_new( 0 );
+  return ret;
+}
 
-  /* Match string buffer. */
-  ps->match_buf = g_string_sized_new( 0 );
 
-  ps->output = g_list_prepend( ps->output, outfile_new( outfile ) );
-  ps->flush = FALSE;
-
-  ps->post_push = FALSE;
-  ps->post_pop = FALSE;
+/**
+ * Peek char from Stackfile, i.e. get char without consuming it.
+ *
+ * @param sf  Stackfile.
+ * @param off Offset from read cursor.
+ *
+ * @return Char or EOF.
+ */
+int sf_peek( stackfile_t* sf, gsize off )
+{
+  if ( sf->eat_tail )
+    sf_eat_tail( sf );
 
-  ps->mrb = NULL;
+#ifdef DEBUG_CHAR
+  while ( off == 0
+          && sf_fill( sf, 1 ) > 0
+          && DEBUG_CHAR == sf->data[ sf->data_pos ] )
+    {
+      mucgly_debug();
+      sf_skip( sf, 1 );
+    }
+#endif
 
-  return ps;
+  if ( sf->data_pos + off < sf->data_len || sf_fill( sf, off+1 ) > off )
+    return (guchar) sf->data[ sf->data_pos + off ];
+  else
+    return EOF;
 }
 
 
 /**
- * Free Pstate. Close all input and output files.
+ * Check if str is coming next in Stackfile. Match is done in place,
+ * i.e. nothing is consumed.
  *
- * @param ps Pstate.
+ * @param sf  Stackfile.
+ * @param str Match string.
+ * @param len Match string length.
+ *
+ * @return TRUE on match.
  */
-void ps_rem( pstate_t* ps )
+gboolean sf_match( stackfile_t* sf, const gchar* str, gsize len )
 {
-  fs_rem( ps->fs );
+  if ( sf->eat_tail )
+    sf_eat_tail( sf );
 
-  g_string_free( ps->check_buf, TRUE );
-  g_string_free( ps->macro_buf, TRUE );
+  if ( sf_fill( sf, len ) < len )
+    return FALSE;
 
-  for ( GList* of = ps->output; of; of = of->next )
-    {
-      outfile_rem( (outfile_t*) of->data );
-    }
+  return !memcmp( &sf->data[ sf->data_pos ], str, len );
+}
 
-  mrb_close( ps->mrb );
 
-  g_free( ps );
+/**
+ * Consume n chars from Stackfile. The chars must be available
+ * (i.e. peeked or matched).
+ *
+ * @param sf Stackfile.
+ * @param n  Number of chars.
+ */
+void sf_skip( stackfile_t* sf, gsize n )
+{
+  sf->data_pos += n;
 }
 
 
 /**
- * Fast check for current input char being first char of any of the
- * hooks.
+ * Scan the buffered input data for the next char that might start a
+ * hook. Only the current data block is scanned.
  *
- * @param ps Pstate.
- * @param c  Char to check.
+ * @param sf Stackfile.
  *
- * @return TRUE if next char matches 1st char of any hook.
+ * @return Number of plain (non-hook) chars from read cursor.
  */
-gboolean ps_check_hook( pstate_t* ps, int c )
+gsize sf_scan_plain( stackfile_t* sf )
 {
-  stackfile_t* sf;
+  const guchar* p = (const guchar*) &sf->data[ sf->data_pos ];
+  gsize n = sf->data_len - sf->data_pos;
+  gsize i = 0;
 
-  if ( c == EOF )
-    return FALSE;
+  switch ( sf->cfg->hook_1st_cnt )
+    {
 
-  sf = ps_topfile(ps);
+    case 1:
+      {
+        /* Single hook char, memchr is the fastest scanner. */
+        const guchar* hit = memchr( p, sf->cfg->hook_1st_list[0], n );
+        return hit ? (gsize) ( hit - p ) : n;
+      }
 
-  if ( sf->hook_1st_chars[ c ] )
-    return TRUE;
-  else
-    return FALSE;
+#ifdef __SSE2__
+    case 2:
+    case 3:
+    case 4:
+      {
+        /* Compare 16 chars against all hook chars at once. Unused
+           list entries are padded with the first hook char. */
+        __m128i c0 = _mm_set1_epi8( sf->cfg->hook_1st_list[0] );
+        __m128i c1 = _mm_set1_epi8( sf->cfg->hook_1st_list[1] );
+        __m128i c2 = _mm_set1_epi8( sf->cfg->hook_1st_list[2] );
+        __m128i c3 = _mm_set1_epi8( sf->cfg->hook_1st_list[3] );
+
+        for ( ; i + 16 <= n; i += 16 )
+          {
+            __m128i v = _mm_loadu_si128( (const __m128i*) &p[ i ] );
+            __m128i m = _mm_or_si128(
+              _mm_or_si128( _mm_cmpeq_epi8( v, c0 ), _mm_cmpeq_epi8( v, c1 ) ),
+              _mm_or_si128( _mm_cmpeq_epi8( v, c2 ), _mm_cmpeq_epi8( v, c3 ) ) );
+            int mask = _mm_movemask_epi8( m );
+
+            if ( mask )
+              return i + __builtin_ctz( mask );
+          }
+        break;
+      }
+#endif
+
+    default: break;
+    }
+
+  /* Generic lookup (also the tail for SIMD scan). */
+  while ( i < n && !sf->cfg->hook_1st_chars[ p[ i ] ] )
+    i++;
+
+  return i;
 }
 
 
 /**
- * Check if input has the match string coming next. Erase the matched
- * string if erase is true and input is matched.
+ * Get run of plain chars, i.e. chars that can't start a hook, from
+ * Stackfile. Run is limited to the current data block, and it is
+ * empty if tail eating is pending.
  *
- * @param ps    Pstate.
- * @param match Match string.
- * @param erase Erase matched string (but only if matched).
+ * @param sf  Stackfile.
+ * @param len Run length.
  *
- * @return True if match.
+ * @return Run start (or NULL for empty run).
  */
-gboolean ps_check( pstate_t* ps, gchar* match, gboolean erase )
+gchar* sf_get_plain( stackfile_t* sf, gsize* len )
 {
-  GString* input;
-  int len;
-  gboolean ret;
+  gchar* run;
+  gsize n;
+
+#ifdef DEBUG_CHAR
+  /* Char based debugging needs every char through sf_peek. */
+  return NULL;
+#endif
+
+  if ( sf->eat_tail )
+    return NULL;
+
+  n = sf_scan_plain( sf );
 
-  /* Dup match string since it might disappear if Filestack stack is
-     popped. */
+  if ( n == 0 )
+    return NULL;
 
-  g_string_assign( ps->match_buf, match );
+  run = &sf->data[ sf->data_pos ];
+  sf_skip( sf, n );
+
+  *len = n;
+  return run;
+}
 
-  len = strlen( match );
-  input = fs_get_n( ps->fs, len, ps->check_buf );
 
-  if ( input->len == 0 )
+/**
+ * Update the hooks related cache/lookup entries.
+ *
+ * @param hc Hook configuration.
+ */
+void hookcfg_update_cache( hookcfg_t* hc )
+{
+  if ( hc->multi )
     {
-      /* We are at end-of-file. Let's give up and pop the file from
-         filestack. */
-      fs_pop_file( ps->fs );
-      return FALSE;
+      /* Esc can never match multihooks. */
+      hc->hook_esc_eq_beg = FALSE;
+      hc->hook_esc_eq_end = FALSE;
+
+      /* Add the latest addition to 1st char lookup. */
+      hc->hook_1st_chars[ (guchar) hc->multi[ hc->multi_cnt-1 ]->beg[0] ] = 1;
+      hc->hook_1st_chars[ (guchar) hc->multi[ hc->multi_cnt-1 ]->end[0] ] = 1;
+      if ( hc->multi[ hc->multi_cnt-1 ]->susp )
+        hc->hook_1st_chars[ (guchar) hc->multi[ hc->multi_cnt-1 ]->susp[0] ] = 1;
+
+      hc->hook_1st_chars[ (guchar) hc->hookesc[0] ] = 1;
     }
   else
     {
-      /* At least partial match string was received. */
+      /* Store these equalities for speed-up. */
+      if ( !g_strcmp0( hc->hookesc, hc->hook->beg ) )
+        hc->hook_esc_eq_beg = TRUE;
+      else
+        hc->hook_esc_eq_beg = FALSE;
 
-      ret = !g_strcmp0( input->str, ps->match_buf->str );
+      if ( !g_strcmp0( hc->hookesc, hc->hook->end ) )
+        hc->hook_esc_eq_end = TRUE;
+      else
+        hc->hook_esc_eq_end = FALSE;
 
-      if ( !ret || !erase )
-        /* Put back checked chars. */
-        fs_put_n( ps->fs, input->str, input->len );
+      /* Initialize 1st char lookup. */
+      memset( hc->hook_1st_chars, 0, 256 * sizeof( guchar ) );
 
-      return ret;
+      /* Hook 1st char lookup. */
+      hc->hook_1st_chars[ (guchar) hc->hook->beg[0] ] = 1;
+      hc->hook_1st_chars[ (guchar) hc->hook->end[0] ] = 1;
+      hc->hook_1st_chars[ (guchar) hc->hookesc[0] ] = 1;
+    }
+
+  /* Collect distinct hook chars for scanning. */
+  hc->hook_1st_cnt = 0;
+  for ( int i = 0; i < 256; i++ )
+    {
+      if ( hc->hook_1st_chars[ i ] )
+        {
+          if ( hc->hook_1st_cnt < 4 )
+            hc->hook_1st_list[ hc->hook_1st_cnt ] = i;
+          hc->hook_1st_cnt++;
+        }
     }
+
+  for ( int i = hc->hook_1st_cnt; i < 4; i++ )
+    hc->hook_1st_list[ i ] = hc->hook_1st_list[ 0 ];
 }
 
 
 /**
- * Check input for hookesc.
+ * Get Stackfile hooks for modification. Shared hooks are copied
+ * first, so that the owners of the other references are unaffected.
  *
- * @param ps Pstate.
+ * @param sf Stackfile.
  *
- * @return TRUE on match.
+ * @return Hookcfg owned by Stackfile.
  */
-gboolean ps_check_hookesc( pstate_t* ps )
+hookcfg_t* sf_own_hooks( stackfile_t* sf )
 {
-  if ( !ps_has_file(ps) )
-    return FALSE;
+  if ( sf->cfg->refcnt > 1 )
+    {
+      hookcfg_t* hc = hookcfg_copy( sf->cfg );
+      hookcfg_unref( sf->cfg );
+      sf->cfg = hc;
+    }
 
-  return ps_check( ps, ps_topfile(ps)->hookesc, TRUE );
+  return sf->cfg;
 }
 
 
 /**
- * Save hookpair on top of stack.
+ * Set hook value.
  *
- * @param sf    Stackfile (as context).
- * @param pair  Hookpair to store.
+ * @param sf    Stackfile.
+ * @param hook  Hook type.
+ * @param value New hook value.
  */
-void ps_push_curhook( stackfile_t* sf, hookpair_t* pair )
+void sf_set_hook( stackfile_t* sf, hook_t hook, char* value )
 {
-  sf->curhook = g_list_prepend(
-    sf->curhook,
-    hookpair_cpy( pair, g_new0( hookpair_t, 1 ) ) );
+  hookcfg_t* hc = sf_own_hooks( sf );
+
+  /* Check that we are not in multi-hook mode. */
+  if ( hc->multi && hook != hook_esc )
+    {
+      /* Disable multi-hook mode. */
+      hookcfg_clear_multi( hc );
+    }
+
+  /* Set values. The previous pair stays valid, since it might be
+     the curhook of an active macro. */
+  switch ( hook )
+    {
+    case hook_beg: hc->hook = arena_pair( hc->arena, value, hc->hook->end, NULL ); break;
+    case hook_end: hc->hook = arena_pair( hc->arena, hc->hook->beg, value, NULL ); break;
+    case hook_esc:
+      {
+        /* Remove old esc from 1st char lookup. */
+        hc->hook_1st_chars[ (guchar) hc->hookesc[0] ] = 0;
+        hc->hookesc = arena_strdup( hc->arena, value );
+        break;
+      }
+    default: break;
+    }
+
+  hookcfg_update_cache( hc );
 }
 
 
 /**
- * Pop of top of stack hookpair.
+ * Set eater value.
  *
- * @param sf Stackfile (as context).
+ * @param sf     Stackfile.
+ * @param value  New eater value.
  */
-void ps_pop_curhook( stackfile_t* sf )
+void sf_set_eater( stackfile_t* sf, char* value )
 {
-  hookpair_del( (hookpair_t*) sf->curhook->data );
-  sf->curhook = g_list_delete_link( sf->curhook, sf->curhook );
+  g_free( sf->eater );
+  sf->eater = g_strdup( value );
 }
 
 
 /**
- * Check input for hookbeg.
+ * Remove all multi-hook pairs and the matcher, i.e. disable
+ * multi-hook mode.
  *
- * @param ps Pstate.
+ * @param hc Hook configuration.
+ */
+void hookcfg_clear_multi( hookcfg_t* hc )
+{
+  if ( hc->multi )
+    {
+      /* Pairs are owned by arena. */
+      g_free( hc->multi );
+      g_free( hc->trie );
+    }
+
+  hc->multi = NULL;
+  hc->multi_cnt = 0;
+  hc->multi_size = 0;
+  hc->trie = NULL;
+  hc->trie_cnt = 0;
+  hc->trie_size = 0;
+}
+
+
+/**
+ * Add hookbeg of multi-hook pair to the matcher trie. For identical
+ * hookbegs the first pair is used.
  *
- * @return TRUE on match.
+ * @param hc   Hook configuration.
+ * @param beg  Hookbeg.
+ * @param pair Pair index.
  */
-gboolean ps_check_hookbeg( pstate_t* ps )
+void hookcfg_trie_add( hookcfg_t* hc, const char* beg, int pair )
 {
-  if ( !ps_has_file(ps) )
-    return FALSE;
+  int node = 0;
 
-  gboolean ret;
-  stackfile_t* sf = ps_topfile(ps);
+  if ( hc->trie == NULL )
+    {
+      /* Root node. */
+      hc->trie_size = MULTI_INIT * 4;
+      hc->trie = g_new0( hooknode_t, hc->trie_size );
+      hc->trie[0].pair = -1;
+      hc->trie_cnt = 1;
+    }
 
-  if ( sf->multi )
+  /* Empty hookbeg can't ever be matched. */
+  if ( beg[0] == 0 )
+    return;
+
+  for ( const guchar* c = (const guchar*) beg; *c; c++ )
     {
-      ret = FALSE;
+      int child;
+
+      for ( child = hc->trie[ node ].child;
+            child && hc->trie[ child ].c != *c;
+            child = hc->trie[ child ].sibling )
+        ;
 
-      /* Check all hookbegs for match. */
-      for ( int i = 0; i < sf->multi_cnt; i++ )
+      if ( !child )
         {
-          ret = ps_check( ps, sf->multi[i].beg, TRUE );
-          if ( ret )
+          /* New node as first child. */
+          if ( hc->trie_cnt >= hc->trie_size )
             {
-              ps_push_curhook( sf, &sf->multi[i] );
-              break;
+              hc->trie_size *= 2;
+              hc->trie = g_renew( hooknode_t, hc->trie, hc->trie_size );
             }
+
+          child = hc->trie_cnt++;
+          hc->trie[ child ].c = *c;
+          hc->trie[ child ].child = 0;
+          hc->trie[ child ].sibling = hc->trie[ node ].child;
+          hc->trie[ child ].pair = -1;
+          hc->trie[ node ].child = child;
         }
-    }
-  else
-    {
-      ret = ps_check( ps, sf->hook.beg, TRUE );
 
-      if ( ret )
-        ps_push_curhook( sf, &sf->hook );
+      node = child;
     }
 
-  return ret;
+  if ( hc->trie[ node ].pair < 0 )
+    hc->trie[ node ].pair = pair;
 }
 
 
 /**
- * Check input for hookend.
+ * Find longest multi-hook hookbeg coming next in Stackfile. The
+ * input is walked once through the trie, and nothing is consumed.
  *
- * @param ps Pstate.
+ * @param sf  Stackfile.
+ * @param len Length of match.
  *
- * @return TRUE on match.
+ * @return Pair index (or -1 for no match).
  */
-gboolean ps_check_hookend( pstate_t* ps )
+int sf_match_multi( stackfile_t* sf, gsize* len )
 {
-  if ( !ps_has_file(ps) )
-    return FALSE;
-  else
-    return ps_check( ps, ps_current_hookend(ps), TRUE );
-}
+  hookcfg_t* hc = sf->cfg;
+  int node = 0;
+  int ret = -1;
 
+  for ( gsize off = 0; ; off++ )
+    {
+      int c = sf_peek( sf, off );
+      int child;
 
-/**
- * Check input for hooksusp.
- *
- * @param ps Pstate.
- *
- * @return TRUE on match.
- */
-gboolean ps_check_hooksusp( pstate_t* ps )
-{
-  gchar* susp;
+      if ( c == EOF )
+        break;
 
-  if ( !ps_has_file(ps) )
-    return FALSE;
-  else if ( susp = ps_current_hooksusp(ps) )
-    return ps_check( ps, susp, TRUE );
-  else
-    return FALSE;
+      for ( child = hc->trie[ node ].child;
+            child && hc->trie[ child ].c != c;
+            child = hc->trie[ child ].sibling )
+        ;
+
+      if ( !child )
+        break;
+
+      node = child;
+      if ( hc->trie[ node ].pair >= 0 )
+        {
+          ret = hc->trie[ node ].pair;
+          *len = off+1;
+        }
+    }
+
+  return ret;
 }
 
 
 /**
- * Check input for eater.
+ * Add multi-hook pair.
  *
- * @param ps Pstate.
+ * @param sf    Stackfile.
+ * @param beg   Hookbeg of pair.
+ * @param end   Hookend of pair.
+ * @param susp  Suspension.
  *
- * @return TRUE on match.
+ * @return FALSE if hooks match escape (pair is not added).
  */
-gboolean ps_check_eater( pstate_t* ps )
+gboolean sf_multi_hook( stackfile_t* sf, const char* beg, const char* end, const char* susp )
 {
-  if ( !ps_has_file(ps) )
-    return FALSE;
+  hookcfg_t* hc;
 
-  if ( ps_topfile(ps)->eater )
-    return ps_check( ps, ps_topfile(ps)->eater, TRUE );
-  else
+  /* Check that hooks don't match escape. */
+  if ( !g_strcmp0( sf->cfg->hookesc, beg )
+       || !g_strcmp0( sf->cfg->hookesc, end ) )
     return FALSE;
+
+  hc = sf_own_hooks( sf );
+
+  if ( hc->multi == NULL )
+    {
+      hc->multi_size = MULTI_INIT;
+      hc->multi = g_new0( hookpair_t*, hc->multi_size );
+      hc->multi_cnt = 0;
+
+      /* Clear non-multi-mode lookups. */
+      memset( hc->hook_1st_chars, 0, 256 * sizeof( guchar ) );
+    }
+  else if ( hc->multi_cnt >= hc->multi_size )
+    {
+      hc->multi_size *= 2;
+      hc->multi = g_renew( hookpair_t*, hc->multi, hc->multi_size );
+    }
+
+  hc->multi[hc->multi_cnt] = arena_pair( hc->arena, beg, end, susp );
+
+  hookcfg_trie_add( hc, beg, hc->multi_cnt );
+
+  hc->multi_cnt++;
+
+  hookcfg_update_cache( hc );
+
+  return TRUE;
 }
 
 
 /**
- * Return hookbeg string that opened the current macro.
- *
- * @param ps PState.
+ * Create new Filestack.
  *
- * @return
+ * @return Filestack.
  */
-gchar* ps_current_hookbeg( pstate_t* ps )
+filestack_t* fs_new( void )
 {
-  hookpair_t* h;
-  h = ps_topfile(ps)->curhook->data;
-  return h->beg;
+  filestack_t* fs;
+
+  fs = g_new0( filestack_t, 1 );
+  fs->file = NULL;
+  fs->base = NULL;
+  return fs;
 }
 
 
 /**
- * Return hookend string that closes the current macro.
+ * Free Filestack and close all Stackfiles.
  *
- * @param ps PState.
+ * @param fs Filestack.
  *
- * @return
+ * @return NULL.
  */
-gchar* ps_current_hookend( pstate_t* ps )
+filestack_t* fs_rem( filestack_t* fs )
 {
-  hookpair_t* h;
-  h = ps_topfile(ps)->curhook->data;
-  return h->end;
-}
+  if ( fs )
+    {
+      for ( GList* p = fs->file; p; p = p->next )
+        {
+          sf_rem( (stackfile_t*) p->data );
+        }
 
+      /* Recording is incomplete after errors. */
+      if ( fs->rec )
+        mcgc_rem( fs->rec );
 
-/**
- * Return hooksusp string that suspends the current hookend.
- *
- * @param ps PState.
- *
- * @return
- */
-gchar* ps_current_hooksusp( pstate_t* ps )
-{
-  hookpair_t* h;
-  h = ps_topfile(ps)->curhook->data;
-  return h->susp;
-}
+      if ( fs->deps )
+        deps_rem( fs->deps );
 
+      g_free( fs );
+    }
 
-/**
- * Get char (through Filestack).
- *
- * @param ps Pstate.
- *
- * @return Char or EOF.
- */
-int ps_in( pstate_t* ps )
-{
-  return fs_get_one( ps->fs );
+  return NULL;
 }
 
 
 /**
- * Output char to current output stream.
+ * Push Stackfile on top of Filestack.
  *
- * @param ps Pstate.
- * @param c  Char.
+ * @param fs Filestack.
+ * @param sf New top file.
  */
-void ps_out( pstate_t* ps, int c )
+void fs_push_stackfile( filestack_t* fs, stackfile_t* sf )
 {
-  outfile_t* of = ps->output->data;
+  sf->wait = fs->wait;
+  sf->wait_data = fs->wait_data;
 
-  if ( of->blocked == FALSE )
-    {
-      if ( c == '\n' )
-        of->lineno++;
+  if ( G_UNLIKELY( trace_fh != NULL ) )
+    trace_stream( "b", "input", sf->filename ? sf->filename : "<STRING>", sf );
 
-      fputc( c, of->fh );
-      if ( ps->flush )
-        fflush( of->fh );
-    }
+  /* Push file. */
+  fs->file = g_list_prepend( fs->file, sf );
 }
 
 
 /**
- * Output chars with ps_out.
+ * Push file on top of Filestack. Files are not read in template
+ * replay, only their hook state is maintained.
  *
- * @param ps  Pstate.
- * @param str Output string (or NULL for no output).
+ * @param fs       Filestack.
+ * @param filename New top file.
  */
-void ps_out_str( pstate_t* ps, gchar* str )
+void fs_push_file( filestack_t* fs, gchar* filename )
 {
-  if ( str )
-    {
-      int len = strlen( str );
+  stackfile_t* inherit;
+  stackfile_t* sf;
 
-      for ( int i = 0; i < len; i++ )
-        {
-          ps_out( ps, str[ i ] );
-        }
-    }
-}
+  if ( fs->file )
+    /* Additional file. */
+    inherit = fs_topfile(fs);
+  else
+    /* First file, i.e. inherit base hooks. */
+    inherit = fs->base;
+
+  if ( fs->replay )
+    sf = sf_new_data( filename, NULL, 0, inherit );
+  else
+    sf = sf_new( filename, inherit );
 
+  if ( fs->rec && filename )
+    mcgc_rec_dep( fs->rec, filename );
 
-/**
- * Block output stream.
- *
- * @param ps Pstate.
- */
-void ps_block_output( pstate_t* ps )
-{
-  outfile_t* of = ps->output->data;
-  of->blocked = TRUE;
+  if ( fs->deps && filename )
+    deps_add( fs->deps->inputs, filename );
+
+  if ( fs->pipelined && !fs->replay )
+    sf_start_pipe( sf );
+
+  fs_push_stackfile( fs, sf );
 }
 
 
 /**
- * Unblock output stream.
+ * Push file on top of Filestack for later use (i.e. current macro is
+ * completely processed).
  *
- * @param ps Pstate.
+ * @param fs       Filestack.
+ * @param filename New top file.
  */
-void ps_unblock_output( pstate_t* ps )
+void fs_push_file_delayed( filestack_t* fs, gchar* filename )
 {
-  outfile_t* of = ps->output->data;
-  of->blocked = FALSE;
+  fs_push_file( fs, filename );
+  fs->file = fs->file->next;
 }
 
 
 /**
- * Push new output stream on top of output file stack.
+ * Push Stackfile on top of Filestack for later use (i.e. current
+ * macro is completely processed).
  *
- * @param ps       Pstate.
- * @param filename File name.
+ * @param fs Filestack.
+ * @param sf New top file.
  */
-void ps_push_file( pstate_t* ps, gchar* filename )
+void fs_push_stackfile_delayed( filestack_t* fs, stackfile_t* sf )
 {
-  ps->output = g_list_prepend( ps->output,
-                               outfile_new( filename ) );
+  fs_push_stackfile( fs, sf );
+  fs->file = fs->file->next;
 }
 
 
 /**
- * Pop file from output file stack. Close the stream.
+ * Pop file from top of Filestack. File is closed.
  *
- * @param ps Pstate.
+ * @param fs Filestack.
  */
-void ps_pop_file( pstate_t* ps )
+void fs_pop_file( filestack_t* fs )
 {
-  outfile_t* of;
+  stackfile_t* sf;
 
-  of = ps->output->data;
-  outfile_rem( of );
-  ps->output = g_list_delete_link( ps->output, ps->output );
+  sf = fs->file->data;
+
+  if ( G_UNLIKELY( trace_fh != NULL ) )
+    trace_stream( "e", "input", sf->filename ? sf->filename : "<STRING>", sf );
+
+  /* References to file data are released first. */
+  if ( fs->pop )
+    fs->pop( sf, fs->wait_data );
+
+  sf_rem( sf );
+  fs->file = g_list_delete_link( fs->file, fs->file );
 }
 
 
 /**
- * Return current Stackfile (input stream).
+ * Get char from (through) Filestack (i.e. top file). Stop at EOF, and
+ * don't pop the file in order to allow putback to the file.
  *
- * @param ps Pstate.
+ * @param fs Filestack.
  *
- * @return Stackfile (or NULL if none).
+ * @return Char or EOF.
  */
-stackfile_t* ps_current_file( pstate_t* ps )
+int fs_get( filestack_t* fs )
 {
-  if ( ps == NULL )
-    return NULL;
-  else if ( !ps_has_file(ps) )
-    return NULL;
+  if ( fs->file != NULL )
+    return sf_get( fs_topfile(fs) );
   else
-    return ps_topfile(ps);
+    return EOF;
 }
 
 
-
 /**
- * Initialize macro content collection.
+ * Get char from (through) Filestack (i.e. top file). If EOF is
+ * encountered, continue with lower file if possible.
  *
- * @param ps Pstate.
+ * @param fs Filestack.
+ *
+ * @return Char or EOF.
  */
-void ps_start_collect( pstate_t* ps )
+int fs_get_one( filestack_t* fs )
 {
-  g_string_set_size( ps->macro_buf, 0 );
-}
+  int ret;
 
+  if ( fs->file != NULL )
+    {
+      ret = sf_get( fs_topfile(fs) );
 
-/**
- * Add content to macro.
- *
- * @param ps Pstate.
- * @param c  Char to add.
- */
-void ps_collect( pstate_t* ps, int c )
-{
-  g_string_append_c( ps->macro_buf, c );
+      /* Pop Stackfiles until no files or non-EOF char is received. */
+      while ( ret == EOF )
+        {
+          if ( fs->rec )
+            mcgc_rec_pop( fs->rec );
+          fs_pop_file( fs );
+          if ( fs->file == NULL )
+            return EOF;
+          ret = sf_get( fs_topfile(fs) );
+        }
+
+      return ret;
+    }
+  else
+    {
+      return EOF;
+    }
 }
 
 
 /**
- * Add str content to macro.
+ * Peek char from (through) Filestack (i.e. top file). If EOF is
+ * encountered, continue with lower file if possible. The char is
+ * not consumed.
  *
- * @param ps  Pstate.
- * @param str String to add.
+ * @param fs Filestack.
+ *
+ * @return Char or EOF.
  */
-void ps_collect_str( pstate_t* ps, gchar* str )
+int fs_peek_one( filestack_t* fs )
 {
-  g_string_append( ps->macro_buf, str );
-}
+  int ret;
 
+  for (;;)
+    {
+      if ( fs->file == NULL )
+        return EOF;
 
-/**
- * Enter first level macro and setup state accordingly.
- *
- * @param ps Pstate.
- */
-void ps_enter_macro( pstate_t* ps )
-{
-  /* New macro starting. */
-  ps->in_macro++;
+      ret = sf_peek( fs_topfile(fs), 0 );
 
-  /* Store macro start info. */
-  sf_mark_macro( ps_topfile( ps ) );
+      if ( ret != EOF )
+        return ret;
 
-  ps_start_collect( ps );
+      /* Pop Stackfiles until no files or non-EOF char is available. */
+      if ( fs->rec )
+        mcgc_rec_pop( fs->rec );
+      fs_pop_file( fs );
+    }
 }
 
 
 /**
- * Get current macro content.
- *
- * @param ps Pstate.
- *
- * @return Macro content.
+ * Flush pending writes of all open Outfiles to their streams. Called
+ * at exit, so that output is not lost on error exits. Uncommitted
+ * outputs are discarded instead (see outfile_commit).
  */
-char* ps_get_macro( pstate_t* ps )
+void outfile_flush_live( void )
 {
-  if ( ps->macro_buf->str[0] == '+' )
+  g_mutex_lock( &outfile_live_lock );
+  for ( GList* p = outfile_live; p; p = p->next )
     {
-      /* Eat the next char after macro. */
-      ps_topfile(ps)->eat_tail = TRUE;
-      return &ps->macro_buf->str[1];
-    }
-  else
-    {
-      return ps->macro_buf->str;
+      outfile_t* of = p->data;
+
+      if ( of->tmpname )
+        g_unlink( of->tmpname );
+      else
+        outfile_flush( of, FALSE );
+
+      if ( of->iop && !of->tmpname )
+        iopipe_drain( of->iop );
     }
+  g_mutex_unlock( &outfile_live_lock );
 }
 
 
 /**
- * Evaluate str as Ruby code and convert result to string. Conversion
- * is performed if execution was successful and conversion was
- * requested.
+ * Open temporary file for output commit (see outfile_commit). The
+ * temporary file is in the same directory as the target, so that it
+ * can be renamed over the target. Non-regular targets (devices,
+ * pipes, symlinks) are written directly.
  *
- * @param ps     Pstate.
- * @param str    Ruby code string.
- * @param to_str Result convert enable.
- * @param ctxt   Context (name) for execution.
+ * @param filename Target file name.
+ * @param tmpname  Temporary file name (allocated).
  *
- * @return Ruby code execution as string (or NULL).
+ * @return Stream (or NULL if target is not committed).
  */
-gchar* ps_eval_ruby_str( pstate_t* ps, gchar* str, gboolean to_str, char* ctxt )
+FILE* outfile_open_tmp( const gchar* filename, gchar** tmpname )
 {
-  mrb_value ret;
-
-  if ( !ctxt )
-    /* Used default context. */
-    ctxt = "macro";
-
-  ret = mrb_load_string( ps->mrb, (char*) str );
-
-  if ( ps->mrb->exc ) {
-    mrb_value obj;
-    gchar* str;
-
-    /* Error handling. */
-    obj = mrb_funcall( ps->mrb, mrb_obj_value( ps->mrb->exc ), "inspect", 0 );
-    str = RSTRING_PTR(obj);
-    mucgly_error( ps_current_file( ps ), str );
-
+  GStatBuf st;
+  gboolean exists;
+  gchar* dir;
+  gchar* base;
+  gchar* name;
+  FILE* fh;
+  int fd;
+
+  exists = ( g_lstat( filename, &st ) == 0 );
+  if ( exists && !S_ISREG( st.st_mode ) )
     return NULL;
-  }
 
-  /* Successfull execution. */
-  if ( to_str )
+  dir = g_path_get_dirname( filename );
+  base = g_path_get_basename( filename );
+  name = g_strdup_printf( "%s/.%s.XXXXXX", dir, base );
+  g_free( dir );
+  g_free( base );
+
+  fd = g_mkstemp( name );
+  if ( fd < 0 )
     {
-      if ( mrb_obj_is_kind_of( ps->mrb, ret, ps->mrb->string_class ) )
-        {
-          return ( (gchar*) RSTRING_PTR( ret ) );
-        }
-      else
-        {
-          /* Convert to Ruby String. */
-          ret = mrb_inspect( ps->mrb, ret );
-          return ( (gchar*) RSTRING_PTR( ret ) );
-        }
+      g_free( name );
+      return NULL;
     }
-  else
+
+  /* Same permissions as the target would get without commit. */
+  fchmod( fd, exists ? ( st.st_mode & 07777 ) : ( 0666 & ~outfile_umask ) );
+
+  fh = fdopen( fd, "w" );
+  if ( fh == NULL )
     {
+      close( fd );
+      g_unlink( name );
+      g_free( name );
       return NULL;
     }
+
+  *tmpname = name;
+
+  return fh;
 }
 
 
 /**
- * Load file with Ruby intepreter.
- *
- * @param ps       Pstate.
- * @param filename Source file.
+ * Read process umask for permissions of committed outputs. Umask is
+ * taken from /proc/self/status, since the umask() probe changes the
+ * process umask temporarily. The probe is used only where /proc is
+ * not available, and then it is called during single-threaded
+ * initialization (see mrb_mruby_mucgly_gem_init).
  */
-void ps_load_ruby_file( pstate_t* ps, gchar* filename )
+static void outfile_init_umask( void )
 {
-  FILE* ufh = fopen( filename, "r" );
+  gchar* status;
+  gchar* p;
 
-  if ( ufh )
+  if ( g_file_get_contents( "/proc/self/status", &status, NULL, NULL ) )
     {
-      mrb_load_file( ps->mrb, ufh );
-      fclose( ufh );
+      p = strstr( status, "\nUmask:" );
+      if ( p )
+        {
+          outfile_umask = strtol( p + strlen( "\nUmask:" ), NULL, 8 ) & 0777;
+          g_free( status );
+          return;
+        }
+      g_free( status );
     }
+
+  outfile_umask = umask( 022 );
+  umask( outfile_umask );
 }
 
 
 /**
- * Execute Mucgly command/macro.
+ * Create new Outfile. If filename is NULL, then stream is stdout.
  *
- * @param ps Pstate.
+ * @param filename   File name (or NULL for stdout).
+ * @param if_changed Write to temporary file, and replace the target
+ *                   at close only if content changed.
  *
- * @return TRUE if input processing should be aborted.
+ * @return Outfile (or NULL if file can't be opened).
  */
-gboolean ps_eval_cmd( pstate_t* ps )
+outfile_t* outfile_open( gchar* filename, gboolean if_changed )
 {
-  char* cmd;
-
-  cmd = ps_get_macro( ps );
+  static gboolean at_exit = FALSE;
+  outfile_t* of;
+  gchar* tmpname = NULL;
+  FILE* fh;
 
-  if ( cmd[0] == ':' )
+  g_mutex_lock( &outfile_live_lock );
+  if ( !at_exit )
     {
+      at_exit = TRUE;
+      atexit( outfile_flush_live );
+    }
+  g_mutex_unlock( &outfile_live_lock );
 
-      /* Mucgly internal command. */
+  if ( filename )
+    {
+      /* Disk file output. */
+      fh = NULL;
+      if ( if_changed )
+        fh = outfile_open_tmp( filename, &tmpname );
 
-      int len;
+      if ( fh == NULL )
+        fh = g_fopen( filename, (gchar*) "w" );
 
-      if ( 0 ) {}
-      else if ( ( len = len_str_cmp( ":hookbeg", cmd ) ) )
-        sf_set_hook( ps_topfile(ps), hook_beg, &cmd[ len+1 ] );
-      else if ( ( len = len_str_cmp( ":hookend", cmd ) ) )
-        sf_set_hook( ps_topfile(ps), hook_end, &cmd[ len+1 ] );
-      else if ( ( len = len_str_cmp( ":hookesc", cmd ) ) )
-        sf_set_hook( ps_topfile(ps), hook_esc, &cmd[ len+1 ] );
-      else if ( ( len = len_str_cmp( ":eater", cmd ) ) )
-        sf_set_eater( ps_topfile(ps), &cmd[ len+1 ] );
+      if ( fh == NULL )
+        return NULL;
+    }
+  else
+    {
+      /* STDOUT output. */
+      fh = stdout;
+    }
 
-      else if ( ( len = len_str_cmp( ":hookall", cmd ) ) )
-        {
-          sf_set_hook( ps_topfile(ps), hook_beg, &cmd[ len+1 ] );
-          sf_set_hook( ps_topfile(ps), hook_end, &cmd[ len+1 ] );
-          sf_set_hook( ps_topfile(ps), hook_esc, &cmd[ len+1 ] );
-        }
+  of = g_new0( outfile_t, 1 );
+  of->lineno = 0;
+  of->blocked = FALSE;
 
-      else if ( ( len = len_str_cmp( ":hook", cmd ) ) )
-        {
-          gchar** pieces;
+  of->fh = fh;
+  of->filename = g_strdup( filename ? filename : "<STDOUT>" );
+  of->tmpname = tmpname;
 
-          pieces = g_strsplit( &cmd[ len+1 ], " ", 2 );
-          if ( g_strv_length( pieces ) == 2 )
-            {
-              /* Two hooks separated by space. */
-              sf_set_hook( ps_topfile(ps), hook_beg, pieces[0] );
-              sf_set_hook( ps_topfile(ps), hook_end, pieces[1] );
-            }
-          else
-            {
-              /* Only one hook specified. */
-              sf_set_hook( ps_topfile(ps), hook_beg, pieces[0] );
-              sf_set_hook( ps_topfile(ps), hook_end, pieces[0] );
-            }
-          g_strfreev( pieces );
-        }
+  of->wbuf = g_malloc( OF_WRITE_SIZE );
+  of->wlen = 0;
 
-      else if ( ( len = len_str_cmp( ":include", cmd ) ) )
-        {
-          fs_push_file_delayed( ps->fs, &cmd[ len+1 ] );
-          ps->post_push = TRUE;
-        }
+  g_mutex_lock( &outfile_live_lock );
+  outfile_live = g_list_prepend( outfile_live, of );
+  g_mutex_unlock( &outfile_live_lock );
 
-      else if ( ( len = len_str_cmp( ":source", cmd ) ) )
-        ps_load_ruby_file( ps, &cmd[ len+1 ] );
+  return of;
+}
 
-      else if ( ( len = len_str_cmp( ":block", cmd ) ) )
-        ps_block_output( ps );
 
-      else if ( ( len = len_str_cmp( ":unblock", cmd ) ) )
-        ps_unblock_output( ps );
+/**
+ * Create new Outfile, and exit if file can't be opened.
+ *
+ * @param filename   File name (or NULL for stdout).
+ * @param if_changed Commit output at close (see outfile_open).
+ * @param err_sf     Current input file for error reporting (or NULL).
+ *
+ * @return Outfile.
+ */
+outfile_t* outfile_new( gchar* filename, gboolean if_changed, stackfile_t* err_sf )
+{
+  outfile_t* of;
 
-      else if ( ( len = len_str_cmp( ":comment", cmd ) ) )
-        {
-          /* Do nothing. */
-        }
+  of = outfile_open( filename, if_changed );
 
-      else if ( ( len = len_str_cmp( ":exit", cmd ) ) )
-        {
-          /* Exit processing. */
-          return TRUE;
-        }
+  if ( of == NULL )
+    mucgly_fatal( err_sf, "Can't open \"%s\"", filename );
 
-      else
-        {
-          mucgly_error( ps_topfile(ps), "Unknown internal command: \"%s\"", &cmd[len+1] );
-        }
-    }
+  return of;
+}
 
-  else if ( cmd[0] == '.' )
-    {
-      /* Mucgly variable output. */
-      ps_out_str( ps, ps_eval_ruby_str( ps, &cmd[1], TRUE, NULL ) );
-    }
 
-  else if ( cmd[0] == '/' )
-    {
-      /* Mucgly comment, do nothing. */
-    }
+/**
+ * Create new memory Outfile. Output is appended directly to a Ruby
+ * String, which is kept alive until Outfile is freed.
+ *
+ * @param mrb MRuby.
+ *
+ * @return Outfile.
+ */
+outfile_t* outfile_new_str( mrb_state* mrb )
+{
+  outfile_t* of;
 
-  else if ( cmd[0] == '#' )
-    {
-      /* Postpone evaluation (to next round). */
+  of = g_new0( outfile_t, 1 );
+  of->filename = g_strdup( "<STRING>" );
+  of->fh = NULL;
+  of->lineno = 0;
+  of->blocked = FALSE;
+  of->wbuf = NULL;
+  of->wlen = 0;
 
-      ps_out_str( ps, ps_current_hookbeg( ps ) );
+  of->mrb = mrb;
+  of->rstr = mrb_str_new( mrb, NULL, 0 );
+  mrb_gc_register( mrb, of->rstr );
 
-      /* Remove one # sign. */
-      ps_out_str( ps, &cmd[1] );
+  return of;
+}
 
-      ps_out_str( ps, ps_current_hookend( ps ) );
-    }
 
-  else
+/**
+ * Check if files have the same content.
+ *
+ * @param a File name.
+ * @param b File name.
+ *
+ * @return TRUE if same (FALSE if either is not readable).
+ */
+gboolean outfile_same( const gchar* a, const gchar* b )
+{
+  GMappedFile* ma;
+  GMappedFile* mb;
+  gboolean same = FALSE;
+
+  ma = g_mapped_file_new( a, FALSE, NULL );
+  if ( ma == NULL )
+    return FALSE;
+
+  mb = g_mapped_file_new( b, FALSE, NULL );
+  if ( mb )
     {
-      /* Ruby code execution. */
-      ps_eval_ruby_str( ps, cmd, FALSE, NULL );
+      gsize len = g_mapped_file_get_length( ma );
+
+      same = ( len == g_mapped_file_get_length( mb )
+               && ( len == 0
+                    || !memcmp( g_mapped_file_get_contents( ma ),
+                                g_mapped_file_get_contents( mb ), len ) ) );
+      g_mapped_file_unref( mb );
     }
 
-  return FALSE;
+  g_mapped_file_unref( ma );
+
+  return same;
 }
 
 
 /**
- * Processing routine for hookend phase.
+ * Commit output written to temporary file. The target is replaced
+ * atomically, but only if its content changed, so that unchanged
+ * outputs keep their mtime. Write errors leave the target as is.
  *
- * @param ps       Pstate.
- * @param do_break True if current processing phase is over.
+ * @param of Outfile.
  */
-void ps_process_hook_end_seq( pstate_t* ps, gboolean* do_break )
+void outfile_commit( outfile_t* of )
 {
-  ps->in_macro--;
+  gboolean ok;
 
-  if ( ps->in_macro < 0 )
+  ok = ( outfile_stop_pipe( of ) && !ferror( of->fh ) );
+  if ( fclose( of->fh ) != 0 )
+    ok = FALSE;
+  of->fh = NULL;
+
+  if ( !ok )
     {
-      mucgly_fatal( ps_topfile(ps), "Internal error in macro status..." );
+      mucgly_warn( NULL, "Can't write \"%s\"", of->filename );
+      g_unlink( of->tmpname );
     }
-  else if ( ps->in_macro )
+  else if ( outfile_same( of->tmpname, of->filename ) )
     {
-      /* Multilevel macro decrement. */
-      /* Output the consumed hookend. */
-      ps_out_str( ps, ps_current_hookend( ps ) );
-      ps_pop_curhook( ps_topfile(ps) );
-      *do_break = FALSE;
+      /* Unchanged. */
+      g_unlink( of->tmpname );
     }
-  else
+  else if ( g_rename( of->tmpname, of->filename ) != 0 )
     {
-      /* Back to base level from macro, eval the macro. */
-      *do_break = ps_eval_cmd( ps );
-      sf_unmark_macro( ps_topfile( ps ) );
-      ps_pop_curhook( ps_topfile(ps) );
+      mucgly_warn( NULL, "Can't replace \"%s\"", of->filename );
+      g_unlink( of->tmpname );
+    }
 
-      if ( ps->post_push == TRUE )
-        {
-          ps->post_push = FALSE;
-          ps->fs->file = ps->fs->file->prev;
-        }
+  g_free( of->tmpname );
+  of->tmpname = NULL;
+}
 
-      if ( ps->post_pop )
-        {
-          ps->post_pop = FALSE;
-          fs_pop_file( ps->fs );
-        }
+
+/**
+ * Discard output of uncommitted Outfile (after errors). Outfile is
+ * freed with outfile_rem as usual.
+ *
+ * @param of Outfile.
+ */
+void outfile_discard( outfile_t* of )
+{
+  if ( of->tmpname )
+    {
+      of->wlen = 0;
+      outfile_stop_pipe( of );
+      fclose( of->fh );
+      of->fh = NULL;
+
+      g_unlink( of->tmpname );
+      g_free( of->tmpname );
+      of->tmpname = NULL;
     }
 }
 
 
 /**
- * Processing routine for non-hook chars.
+ * Free Outfile and close output stream if non-stdout. Output written
+ * to temporary file is committed (see outfile_commit).
  *
- * @param ps        Pstate.
- * @param c         Current char input.
- * @param do_break  True if should break from current phase.
+ * @param of Outfile.
  */
-void ps_process_non_hook_seq( pstate_t* ps, int c, gboolean* do_break )
+void outfile_rem( outfile_t* of )
 {
-  /* Non-hook input. */
-  if ( ps->in_macro )
+  g_mutex_lock( &outfile_live_lock );
+  outfile_live = g_list_remove( outfile_live, of );
+  g_mutex_unlock( &outfile_live_lock );
+
+  if ( of->fh )
+    outfile_flush( of, FALSE );
+
+  if ( of->mrb )
+    mrb_gc_unregister( of->mrb, of->rstr );
+  else if ( of->tmpname )
+    outfile_commit( of );
+  else if ( of->fh && !outfile_stop_pipe( of ) )
+    mucgly_warn( NULL, "Can't write \"%s\"", of->filename );
+
+  if ( of->fh && of->fh != stdout )
+    fclose( of->fh );
+
+  g_free( of->wbuf );
+  g_free( of->filename );
+  g_free( of );
+}
+
+
+/**
+ * Write chars to Outfile. Chars are collected to the write buffer,
+ * and large writes go directly to the stream.
+ *
+ * @param of  Outfile.
+ * @param str Chars to write.
+ * @param len Number of chars.
+ */
+void outfile_write( outfile_t* of, const gchar* str, gsize len )
+{
+  if ( of->mrb )
     {
-      *do_break = FALSE;
+      /* Memory output. */
+      mrb_str_cat( of->mrb, of->rstr, str, len );
+      return;
+    }
 
-      if ( c == EOF )
-        mucgly_error( ps_current_file(ps), "Got EOF within macro!" );
+  if ( of->iop )
+    {
+      /* Write buffers are passed to writer thread. */
+      while ( of->wlen + len > OF_WRITE_SIZE )
+        {
+          gsize n = OF_WRITE_SIZE - of->wlen;
 
-      /* Add content to macro. */
-      ps_collect( ps, c );
+          memcpy( &of->wbuf[ of->wlen ], str, n );
+          of->wlen += n;
+          outfile_flush( of, FALSE );
+          str += n;
+          len -= n;
+        }
     }
-  else
+  else if ( of->wlen + len > OF_WRITE_SIZE )
     {
-      if ( c == EOF )
+      outfile_flush( of, FALSE );
+
+      if ( len >= OF_WRITE_SIZE )
         {
-          *do_break = TRUE;
+          /* No point in buffering. */
+          fwrite( str, 1, len, of->fh );
+          return;
         }
-      else
+    }
+
+  memcpy( &of->wbuf[ of->wlen ], str, len );
+  of->wlen += len;
+}
+
+
+/**
+ * Write pending chars of Outfile to stream.
+ *
+ * @param of   Outfile.
+ * @param sync Flush the stream as well.
+ */
+void outfile_flush( outfile_t* of, gboolean sync )
+{
+  if ( of->iop )
+    {
+      /* Pipelined, i.e. buffer is swapped with a free block, and
+         writer writes it promptly. */
+      if ( of->wlen > 0 )
         {
-          *do_break = FALSE;
+          iopipe_block_t* blk = iopipe_put_begin( of->iop );
+          gchar* buf = blk->data;
 
-          /* Output to current output file. */
-          ps_out( ps, c );
+          blk->data = of->wbuf;
+          blk->len = of->wlen;
+          blk->pos = 0;
+          iopipe_put_end( of->iop );
+
+          of->wbuf = buf;
+          of->wlen = 0;
         }
+
+      of->wtime = 0;
+      return;
+    }
+
+  if ( of->wlen > 0 )
+    {
+      fwrite( of->wbuf, 1, of->wlen, of->fh );
+      of->wlen = 0;
     }
+
+  if ( sync && of->fh )
+    fflush( of->fh );
+
+  of->wtime = 0;
 }
 
 
 /**
- * Process input file (or stack of files).
+ * Copy file to Outfile stream in kernel, without passing the data
+ * through user space. Write buffer is flushed first. Copy stops at
+ * the first failure (e.g. unsupported fd types), and the caller
+ * writes the rest.
  *
- * @param ps      Pstate.
- * @param infile  Input file name.
- * @param outfile Output file name (or NULL). Outfile string is freed.
+ * @param of  Outfile (stream).
+ * @param fd  Input file (at start).
+ * @param len Number of chars to copy.
+ *
+ * @return Number of chars copied.
  */
-void ps_process_file( pstate_t* ps, gchar* infile, gchar* outfile )
+gsize outfile_copy_fd( outfile_t* of, int fd, gsize len )
 {
-  int c;
-  gboolean do_break = FALSE;
+  gsize done = 0;
 
-  fs_push_file( ps->fs, infile );
+#ifdef __linux__
+  int out;
+  gssize cnt;
 
-  if ( outfile )
+  outfile_flush( of, TRUE );
+  if ( of->iop )
+    iopipe_drain( of->iop );
+  out = fileno( of->fh );
+
+  /* File to file (or reflink on supporting filesystems). */
+  while ( done < len )
     {
-      ps_push_file( ps, outfile );
-      g_free( outfile );
-    }
+      do
+        cnt = copy_file_range( fd, NULL, out, NULL, len - done, 0 );
+      while ( cnt < 0 && errno == EINTR );
 
-  /* ------------------------------------------------------------
-   * Process input:
-   * ------------------------------------------------------------ */
+      if ( cnt <= 0 )
+        break;
+      done += cnt;
+    }
 
-  for (;;)
+  /* File to any fd (e.g. pipe). Continues from copy_file_range. */
+  while ( done < len )
     {
+      do
+        cnt = sendfile( out, fd, NULL, len - done );
+      while ( cnt < 0 && errno == EINTR );
 
-      /* For each input char, we must explicitly read it since
-         otherwise the Filestack does not operate correctly, i.e. we
-         are not allowed to put back to stream after EOF has been
-         encountered. Files are popped automatically after EOF. */
+      if ( cnt <= 0 )
+        break;
+      done += cnt;
+    }
+#endif
 
-      c = ps_in( ps );
+  return done;
+}
 
-      /* Check if next char starts one of the hooks. */
-      if ( ps_check_hook( ps, c ) )
-        {
 
-          fs_put( ps->fs, c );
+/* ------------------------------------------------------------
+ * Mucgly pipelined I/O:
+ * ------------------------------------------------------------ */
 
-          /* Escape is always checked before other hooks. */
-          if ( ps_check_hookesc( ps ) )
-            {
-              /* Handle ESCAPEs depending whether in macro or not. */
 
-              if ( ps->in_macro )
-                {
+/**
+ * Wait until ring index changes from val, or the other side is done.
+ *
+ * @param iop Iopipe.
+ * @param idx Ring index (of the other side).
+ * @param val Current value.
+ */
+void iopipe_wait( iopipe_t* iop, gint* idx, gint val )
+{
+  g_mutex_lock( &iop->lock );
+  g_atomic_int_inc( &iop->waiting );
 
-                  /* Escape in macro. */
+  while ( g_atomic_int_get( idx ) == val
+          && !g_atomic_int_get( &iop->eof )
+          && !g_atomic_int_get( &iop->stop ) )
+    g_cond_wait( &iop->cond, &iop->lock );
 
-                  /* Just transfer the following char to output. */
-                  c = ps_in( ps );
+  g_atomic_int_add( &iop->waiting, -1 );
+  g_mutex_unlock( &iop->lock );
+}
 
-                  /* Error, if EOF in macro. */
-                  if ( c == EOF )
-                    {
-                      mucgly_error( ps_current_file(ps), "Got EOF within macro!" );
-                    }
-                  else
-                    {
-                      if ( ( c == ' ' || c == '\n' ) &&
-                           ps_topfile(ps)->hook_esc_eq_end )
-                        {
-                          /* Space/newline and hookesc is same as hookbeg. */
-                          ps_process_hook_end_seq( ps, &do_break );
-                          if ( do_break )
-                            break;
-                        }
-                      else if ( ps_topfile(ps)->eater
-                                && ps_topfile(ps)->eater[0] == c )
-                        {
-                          fs_put( ps->fs, c );
-                          if ( ps_check_eater( ps ) )
-                            ps_in( ps );
-                          else
-                            ps_collect( ps, c );
-                        }
-                      else
-                        {
-                          ps_collect( ps, c );
-                        }
-                    }
-                }
-              else
-                {
 
-                  /* Escape outside macro. */
+/**
+ * Wake the other side, if it is waiting. Ring indeces are updated
+ * without lock, and the lock is taken only for sleeping.
+ *
+ * @param iop Iopipe.
+ */
+void iopipe_wake( iopipe_t* iop )
+{
+  if ( g_atomic_int_get( &iop->waiting ) )
+    {
+      g_mutex_lock( &iop->lock );
+      g_cond_broadcast( &iop->cond );
+      g_mutex_unlock( &iop->lock );
+    }
+}
 
-                  /* Map next char according to escape rules. */
-                  c = ps_in( ps );
 
-                  if ( c == EOF )
-                    {
+/**
+ * Get free block from ring for producer. Waits while ring is full.
+ *
+ * @param iop Iopipe.
+ *
+ * @return Block (or NULL if consumer has stopped).
+ */
+iopipe_block_t* iopipe_put_begin( iopipe_t* iop )
+{
+  gint head = iop->head;
+  gint tail;
+
+  while ( head - ( tail = g_atomic_int_get( &iop->tail ) ) >= IOPIPE_BLOCKS )
+    {
+      if ( g_atomic_int_get( &iop->stop ) )
+        return NULL;
+      iopipe_wait( iop, &iop->tail, tail );
+    }
+
+  if ( g_atomic_int_get( &iop->stop ) )
+    return NULL;
+
+  return &iop->block[ (guint) head % IOPIPE_BLOCKS ];
+}
+
+
+/**
+ * Pass filled block (see iopipe_put_begin) to consumer.
+ *
+ * @param iop Iopipe.
+ */
+void iopipe_put_end( iopipe_t* iop )
+{
+  g_atomic_int_set( &iop->head, iop->head + 1 );
+  iopipe_wake( iop );
+}
+
+
+/**
+ * Get filled block from ring for consumer. Waits while ring is empty.
+ *
+ * @param iop Iopipe.
+ *
+ * @return Block (or NULL at end of data).
+ */
+iopipe_block_t* iopipe_get_begin( iopipe_t* iop )
+{
+  gint tail = iop->tail;
+  gint head;
+
+  while ( ( head = g_atomic_int_get( &iop->head ) ) == tail )
+    {
+      /* Producer may complete just before eof is seen. */
+      if ( g_atomic_int_get( &iop->eof ) )
+        {
+          if ( g_atomic_int_get( &iop->head ) == tail )
+            return NULL;
+          break;
+        }
+      if ( g_atomic_int_get( &iop->stop ) )
+        return NULL;
+      iopipe_wait( iop, &iop->head, head );
+    }
+
+  return &iop->block[ (guint) tail % IOPIPE_BLOCKS ];
+}
+
+
+/**
+ * Return consumed block (see iopipe_get_begin) to producer.
+ *
+ * @param iop Iopipe.
+ */
+void iopipe_get_end( iopipe_t* iop )
+{
+  g_atomic_int_set( &iop->tail, iop->tail + 1 );
+  iopipe_wake( iop );
+}
+
+
+/**
+ * Reader thread. Input is read to blocks ahead of the expansion
+ * thread. Idle input is polled together with the wakeup pipe, so that
+ * the reader notices when input is closed early.
+ *
+ * @param data Iopipe.
+ *
+ * @return NULL.
+ */
+gpointer iopipe_reader( gpointer data )
+{
+  iopipe_t* iop = data;
+  iopipe_block_t* blk;
+  struct pollfd pfd[2];
+  gssize cnt;
+
+  while ( ( blk = iopipe_put_begin( iop ) ) )
+    {
+      pfd[0].fd = iop->fd;
+      pfd[0].events = POLLIN;
+      pfd[0].revents = 0;
+      pfd[1].fd = iop->wake[0];
+      pfd[1].events = POLLIN;
+      pfd[1].revents = 0;
+
+      if ( poll( pfd, 2, -1 ) < 0 && errno != EINTR )
+        break;
+
+      /* Stop is checked by put_begin. */
+      if ( pfd[0].revents == 0 )
+        continue;
+
+      do
+        cnt = read( iop->fd, blk->data, iop->size );
+      while ( cnt < 0 && errno == EINTR );
+
+      if ( cnt <= 0 )
+        break;
+
+      blk->len = cnt;
+      blk->pos = 0;
+      iopipe_put_end( iop );
+    }
+
+  g_atomic_int_set( &iop->eof, 1 );
+  iopipe_wake( iop );
+
+  return NULL;
+}
+
+
+/**
+ * Writer thread. Filled write buffers are written to the stream fd
+ * until the pipe is closed.
+ *
+ * @param data Iopipe.
+ *
+ * @return NULL.
+ */
+gpointer iopipe_writer( gpointer data )
+{
+  iopipe_t* iop = data;
+  iopipe_block_t* blk;
+  gssize cnt;
+
+  while ( ( blk = iopipe_get_begin( iop ) ) )
+    {
+      /* Blocks are consumed after errors too, so that the
+         expansion thread is never stalled. */
+      while ( !iop->err && blk->pos < blk->len )
+        {
+          cnt = write( iop->fd, &blk->data[ blk->pos ], blk->len - blk->pos );
+
+          if ( cnt > 0 )
+            blk->pos += cnt;
+          else if ( cnt < 0 && errno != EINTR )
+            iop->err = TRUE;
+        }
+
+      blk->len = 0;
+      blk->pos = 0;
+      iopipe_get_end( iop );
+    }
+
+  return NULL;
+}
+
+
+/**
+ * Create Iopipe with I/O thread.
+ *
+ * @param fd     File descriptor.
+ * @param size   Block size.
+ * @param reader Reader (otherwise writer).
+ *
+ * @return Iopipe (or NULL if thread can't be created).
+ */
+iopipe_t* iopipe_new( int fd, gsize size, gboolean reader )
+{
+  iopipe_t* iop;
+
+  iop = g_new0( iopipe_t, 1 );
+  iop->fd = fd;
+  iop->size = size;
+  iop->reader = reader;
+  iop->wake[0] = iop->wake[1] = -1;
+  g_mutex_init( &iop->lock );
+  g_cond_init( &iop->cond );
+
+  if ( reader && pipe( iop->wake ) != 0 )
+    {
+      iop->wake[0] = iop->wake[1] = -1;
+      iopipe_rem( iop );
+      return NULL;
+    }
+
+  for ( int i = 0; i < IOPIPE_BLOCKS; i++ )
+    iop->block[i].data = g_malloc( size );
+
+  iop->thread = g_thread_try_new( reader ? "mucgly-reader" : "mucgly-writer",
+                                  reader ? iopipe_reader : iopipe_writer,
+                                  iop, NULL );
+  if ( iop->thread == NULL )
+    {
+      iopipe_rem( iop );
+      return NULL;
+    }
+
+  return iop;
+}
+
+
+/**
+ * Stop I/O thread and free Iopipe. Writer completes pending writes,
+ * and reader drops its prefetched input. Note that when input is
+ * closed before EOF (e.g. by :exit), the dropped blocks have already
+ * been consumed from the descriptor, i.e. they are lost for any later
+ * reader of the same stream (stdin).
+ *
+ * @param iop Iopipe.
+ *
+ * @return FALSE if writes failed.
+ */
+gboolean iopipe_rem( iopipe_t* iop )
+{
+  gboolean ok;
+
+  if ( iop->thread )
+    {
+      /* Writer stops at eof, reader at stop. */
+      g_atomic_int_set( &iop->eof, 1 );
+      g_atomic_int_set( &iop->stop, iop->reader );
+      g_mutex_lock( &iop->lock );
+      g_cond_broadcast( &iop->cond );
+      g_mutex_unlock( &iop->lock );
+      if ( iop->wake[1] >= 0 )
+        while ( write( iop->wake[1], "", 1 ) < 0 && errno == EINTR )
+          ;
+      g_thread_join( iop->thread );
+    }
+
+  if ( iop->wake[0] >= 0 )
+    {
+      close( iop->wake[0] );
+      close( iop->wake[1] );
+    }
+
+  ok = !iop->err;
+
+  for ( int i = 0; i < IOPIPE_BLOCKS; i++ )
+    g_free( iop->block[i].data );
+
+  g_mutex_clear( &iop->lock );
+  g_cond_clear( &iop->cond );
+  g_free( iop );
+
+  return ok;
+}
+
+
+/**
+ * Wait until writer has written all passed blocks.
+ *
+ * @param iop Iopipe (writer).
+ */
+void iopipe_drain( iopipe_t* iop )
+{
+  gint tail;
+
+  while ( ( tail = g_atomic_int_get( &iop->tail ) ) != iop->head )
+    iopipe_wait( iop, &iop->tail, tail );
+}
+
+
+/**
+ * Read prefetched input (see iopipe_reader).
+ *
+ * @param iop  Iopipe (reader).
+ * @param buf  Read buffer.
+ * @param size Buffer size.
+ *
+ * @return Number of chars read (0 at EOF).
+ */
+gsize iopipe_read( iopipe_t* iop, gchar* buf, gsize size )
+{
+  iopipe_block_t* blk;
+  gsize len;
+
+  blk = iopipe_get_begin( iop );
+  if ( blk == NULL )
+    return 0;
+
+  len = MIN( size, blk->len - blk->pos );
+  memcpy( buf, &blk->data[ blk->pos ], len );
+  blk->pos += len;
+
+  if ( blk->pos == blk->len )
+    iopipe_get_end( iop );
+
+  return len;
+}
+
+
+/**
+ * Check if prefetched input is available (or EOF reached).
+ *
+ * @param iop Iopipe (reader).
+ *
+ * @return TRUE if read does not block.
+ */
+gboolean iopipe_ready( iopipe_t* iop )
+{
+  return ( g_atomic_int_get( &iop->head ) != iop->tail
+           || g_atomic_int_get( &iop->eof ) );
+}
+
+
+/**
+ * Start reader thread for streaming Stackfile. Mapped input is
+ * prefetched by the kernel instead.
+ *
+ * @param sf Stackfile.
+ */
+void sf_start_pipe( stackfile_t* sf )
+{
+  if ( sf->fh )
+    {
+      if ( sf->iop == NULL )
+        {
+          sf->iop = iopipe_new( fileno( sf->fh ), SF_READ_SIZE, TRUE );
+        }
+    }
+#if defined( MADV_WILLNEED )
+  else if ( sf->map )
+    {
+      madvise( sf->data, sf->data_len, MADV_WILLNEED );
+    }
+#endif
+}
+
+
+/**
+ * Start writer thread for Outfile stream. Pending writes are
+ * completed first.
+ *
+ * @param of Outfile.
+ */
+void outfile_start_pipe( outfile_t* of )
+{
+  if ( of->fh == NULL || of->iop )
+    return;
+
+  outfile_flush( of, TRUE );
+  of->iop = iopipe_new( fileno( of->fh ), OF_WRITE_SIZE, FALSE );
+}
+
+
+/**
+ * Complete pending writes and stop writer thread of Outfile (if
+ * pipelined).
+ *
+ * @param of Outfile.
+ *
+ * @return FALSE on write errors.
+ */
+gboolean outfile_stop_pipe( outfile_t* of )
+{
+  gboolean ok = TRUE;
+
+  if ( of->iop )
+    {
+      outfile_flush( of, FALSE );
+      ok = iopipe_rem( of->iop );
+      of->iop = NULL;
+    }
+
+  return ok;
+}
+
+
+/**
+ * Set pipelined I/O mode of Pstate. Input files and output files
+ * opened later are pipelined, as well as the current files.
+ *
+ * @param ps Pstate.
+ * @param on Enable.
+ */
+void mucgly_set_pipelined( pstate_t* ps, gboolean on )
+{
+  ps->fs->pipelined = on;
+
+  if ( !on )
+    return;
+
+  for ( GList* p = ps->fs->file; p; p = p->next )
+    sf_start_pipe( p->data );
+
+  for ( GList* p = ps->output; p; p = p->next )
+    outfile_start_pipe( p->data );
+}
+
+
+
+/**
+ * Create Rcache.
+ *
+ * @param limit Max number of entries.
+ *
+ * @return Rcache.
+ */
+rcache_t* rcache_new( int limit )
+{
+  rcache_t* rc;
+
+  rc = g_new0( rcache_t, 1 );
+  rc->table = g_hash_table_new( g_str_hash, g_str_equal );
+  g_queue_init( &rc->lru );
+  rc->limit = limit;
+
+  return rc;
+}
+
+
+/**
+ * Free Rcache and release compiled bodies.
+ *
+ * @param rc  Rcache.
+ * @param mrb MRuby of the compiled bodies (or NULL if closed).
+ */
+void rcache_rem( rcache_t* rc, mrb_state* mrb )
+{
+  rcache_evict( rc, mrb, 0 );
+  g_hash_table_destroy( rc->table );
+  g_free( rc );
+}
+
+
+/**
+ * Compile Ruby code without executing it.
+ *
+ * @param mrb  MRuby.
+ * @param body Ruby code.
+ *
+ * @return Compiled code (or NULL on syntax error).
+ */
+struct RProc* rcache_compile( mrb_state* mrb, const gchar* body )
+{
+  return rcache_compile_file( mrb, body, strlen( body ), NULL );
+}
+
+
+/**
+ * Compile Ruby code without executing it.
+ *
+ * @param mrb      MRuby.
+ * @param src      Ruby code.
+ * @param len      Code length.
+ * @param filename Source file name for backtraces (or NULL).
+ *
+ * @return Compiled code (or NULL on syntax error).
+ */
+struct RProc* rcache_compile_file( mrb_state* mrb, const gchar* src, gsize len,
+                                   const gchar* filename )
+{
+  mrbc_context* cxt;
+  struct mrb_parser_state* p;
+  struct RProc* proc = NULL;
+
+  /* Errors are reported when the code is loaded uncompiled. */
+  cxt = mrbc_context_new( mrb );
+  cxt->capture_errors = TRUE;
+  if ( filename )
+    mrbc_filename( mrb, cxt, filename );
+
+  p = mrb_parse_nstring( mrb, src, len, cxt );
+  if ( p && p->nerr == 0 )
+    {
+      proc = mrb_generate_code( mrb, p );
+#ifdef MRB_PROC_SET_TARGET_CLASS
+      if ( proc )
+        MRB_PROC_SET_TARGET_CLASS( proc, mrb->object_class );
+#endif
+    }
+
+  if ( p )
+    mrb_parser_free( p );
+  mrbc_context_free( mrb, cxt );
+
+  return proc;
+}
+
+
+/**
+ * Evict least recently used entries until at most limit entries
+ * remain.
+ *
+ * @param rc    Rcache.
+ * @param mrb   MRuby of the compiled bodies (or NULL if closed).
+ * @param limit Number of entries to keep.
+ */
+void rcache_evict( rcache_t* rc, mrb_state* mrb, int limit )
+{
+  while ( (int) rc->lru.length > limit )
+    {
+      rcache_entry_t* e;
+
+      e = g_queue_peek_tail_link( &rc->lru )->data;
+      g_queue_unlink( &rc->lru, &e->link );
+      g_hash_table_remove( rc->table, e->body );
+
+      if ( mrb )
+        mrb_gc_unregister( mrb, mrb_obj_value( e->proc ) );
+
+      g_free( e->body );
+      g_free( e );
+    }
+}
+
+
+/**
+ * Find compiled macro body.
+ *
+ * @param rc   Rcache.
+ * @param body Macro body.
+ *
+ * @return Compiled body (or NULL if cache is disabled or body is not stored).
+ */
+struct RProc* rcache_find( rcache_t* rc, const gchar* body )
+{
+  rcache_entry_t* e;
+
+  if ( rc->limit <= 0 )
+    return NULL;
+
+  e = g_hash_table_lookup( rc->table, body );
+
+  if ( e )
+    {
+      /* Move to most recently used. */
+      rc->hits++;
+      g_queue_unlink( &rc->lru, &e->link );
+      g_queue_push_head_link( &rc->lru, &e->link );
+      return e->proc;
+    }
+
+  rc->misses++;
+
+  return NULL;
+}
+
+
+/**
+ * Store compiled macro body. Least recently used body is evicted, if
+ * cache is full.
+ *
+ * @param rc   Rcache.
+ * @param mrb  MRuby.
+ * @param body Macro body.
+ * @param proc Compiled body.
+ */
+void rcache_insert( rcache_t* rc, mrb_state* mrb, const gchar* body, struct RProc* proc )
+{
+  rcache_entry_t* e;
+
+  if ( rc->limit <= 0 )
+    return;
+
+  /* Keep compiled body alive while cached. */
+  mrb_gc_register( mrb, mrb_obj_value( proc ) );
+
+  rcache_evict( rc, mrb, rc->limit-1 );
+
+  e = g_new0( rcache_entry_t, 1 );
+  e->body = g_strdup( body );
+  e->proc = proc;
+  e->link.data = e;
+
+  g_hash_table_insert( rc->table, e->body, e );
+  g_queue_push_head_link( &rc->lru, &e->link );
+}
+
+
+/**
+ * Get compiled macro body. Body is compiled and stored, if not
+ * already available.
+ *
+ * @param rc   Rcache.
+ * @param mrb  MRuby.
+ * @param body Macro body.
+ *
+ * @return Compiled body (or NULL if cache is disabled or on syntax error).
+ */
+struct RProc* rcache_lookup( rcache_t* rc, mrb_state* mrb, const gchar* body )
+{
+  struct RProc* proc;
+
+  if ( rc->limit <= 0 )
+    return NULL;
+
+  proc = rcache_find( rc, body );
+  if ( proc )
+    return proc;
+
+  proc = rcache_compile( mrb, body );
+  if ( proc == NULL )
+    return NULL;
+
+  rcache_insert( rc, mrb, body, proc );
+
+  return proc;
+}
+
+
+/**
+ * Create Pstate. Create input file stack and output file
+ * stack. Initialize parsing state.
+ *
+ * @param outfile Initial input file name.
+ *
+ * @return Pstate.
+ */
+pstate_t* ps_new( gchar* outfile )
+{
+  pstate_t* ps;
+  const gchar* env;
+
+  ps = g_new0( pstate_t, 1 );
+
+  ps->fs = fs_new();
+
+  ps->in_macro = 0;
+  ps->suspension = 0;
+
+  /* Top level input buffer. */
+  ps->macro_buf = g_string_sized_new( 0 );
+  ps->span = NULL;
+  ps->span_len = 0;
+  ps->span_sf = NULL;
+
+  ps->output = g_list_prepend( ps->output, outfile_new( outfile, FALSE, NULL ) );
+  ps->flush = flush_none;
+  ps->flush_size = OF_WRITE_SIZE;
+  ps->flush_time = 0;
+
+  /* Pending output is flushed before input blocks (flush_stream). */
+  ps->fs->wait = ps_input_wait;
+  ps->fs->wait_data = ps;
+  ps->fs->pop = ps_input_pop;
+
+  ps->post_push = FALSE;
+  ps->post_pop = FALSE;
+
+  ps->mrb = NULL;
+  ps->own_mrb = FALSE;
+  ps->rcache = rcache_new( RCACHE_LIMIT );
+
+  /* Precompiled templates are enabled from environment. */
+  env = g_getenv( "MUCGLY_MCGC" );
+  ps->mcgc = ( env && env[0] && strcmp( env, "0" ) );
+
+  /* Stats are reported at Pstate removal (see stats_report). */
+  env = g_getenv( "MUCGLY_STATS" );
+  ps->stats = ( env && env[0] && strcmp( env, "0" ) ) ? stats_new() : NULL;
+
+  /* Incremental mode is enabled from environment (for batch). */
+  env = g_getenv( "MUCGLY_INCREMENTAL" );
+  ps->incremental = ( env && env[0] && strcmp( env, "0" ) );
+  ps->depfile = NULL;
+  ps->manifest = NULL;
+
+  /* Periodic full GC is enabled from environment (for batch). */
+  env = g_getenv( "MUCGLY_GC_INTERVAL" );
+  ps->gc_interval = env ? g_ascii_strtoll( env, NULL, 10 ) : 0;
+  ps->gc_macros = 0;
+
+  /* Output commit is enabled from environment (for batch). */
+  env = g_getenv( "MUCGLY_IF_CHANGED" );
+  ps->if_changed = ( env && env[0] && strcmp( env, "0" ) );
+
+  /* Pipelined I/O is enabled from environment (for batch). Applies
+     to files opened later, not to the default stdout. */
+  env = g_getenv( "MUCGLY_PIPELINED" );
+  ps->fs->pipelined = ( env && env[0] && strcmp( env, "0" ) );
+
+  /* Parallel expansion is enabled with :parallel. */
+  ps->parallel = 0;
+  ps->par = NULL;
+  ps->par_sf = NULL;
+  ps->par_skip = 0;
+  ps->sources = g_ptr_array_new_with_free_func( g_free );
+  ps->pure = FALSE;
+
+  return ps;
+}
+
+
+/**
+ * Free Pstate. Close all input and output files.
+ *
+ * @param ps Pstate.
+ */
+void ps_rem( pstate_t* ps )
+{
+  if ( ps->par )
+    par_rem( ps->par );
+
+  fs_rem( ps->fs );
+
+  g_string_free( ps->macro_buf, TRUE );
+
+  for ( GList* of = ps->output; of; of = of->next )
+    {
+      outfile_rem( (outfile_t*) of->data );
+    }
+
+  if ( ps->stats )
+    {
+      stats_report( ps );
+      stats_rem( ps->stats );
+    }
+
+  g_free( ps->depfile );
+  g_free( ps->manifest );
+
+  if ( ps->preload )
+    g_hash_table_destroy( ps->preload );
+  g_ptr_array_free( ps->sources, TRUE );
+
+  rcache_rem( ps->rcache, ps->mrb );
+  if ( ps->mrb && ps->own_mrb )
+    {
+      ps->mrb->ud = NULL;
+      mrb_close( ps->mrb );
+    }
+
+  g_free( ps );
+}
+
+
+/**
+ * Attach MRuby to Pstate. Pstate is stored as MRuby user data, so
+ * that Mucgly methods find their Pstate. Pstate owns the MRuby.
+ *
+ * @param ps  Pstate.
+ * @param mrb MRuby.
+ */
+void ps_set_mrb( pstate_t* ps, mrb_state* mrb )
+{
+  ps->mrb = mrb;
+  ps->own_mrb = TRUE;
+  if ( mrb )
+    mrb->ud = ps;
+}
+
+
+/**
+ * Fast check for current input char being first char of any of the
+ * hooks.
+ *
+ * @param ps Pstate.
+ * @param c  Char to check.
+ *
+ * @return TRUE if next char matches 1st char of any hook.
+ */
+gboolean ps_check_hook( pstate_t* ps, int c )
+{
+  stackfile_t* sf;
+
+  if ( c == EOF )
+    return FALSE;
+
+  sf = ps_topfile(ps);
+
+  if ( sf->cfg->hook_1st_chars[ c ] )
+    return TRUE;
+  else
+    return FALSE;
+}
+
+
+/**
+ * Check if input has the match string coming next. Erase the matched
+ * string if erase is true and input is matched. Matching is done in
+ * place, hence there is nothing to put back on mismatch.
+ *
+ * @param ps    Pstate.
+ * @param match Match string.
+ * @param erase Erase matched string (but only if matched).
+ *
+ * @return True if match.
+ */
+gboolean ps_check( pstate_t* ps, gchar* match, gboolean erase )
+{
+  stackfile_t* sf = ps_topfile(ps);
+  gsize len = strlen( match );
+
+  if ( G_UNLIKELY( ps->stats != NULL ) )
+    ps->stats->hook_checks++;
+
+  if ( sf_match( sf, match, len ) )
+    {
+      if ( erase )
+        {
+          sf_skip( sf, len );
+          if ( G_UNLIKELY( ps->stats != NULL ) )
+            ps->stats->bytes_in += len;
+        }
+      return TRUE;
+    }
+  else
+    {
+      if ( G_UNLIKELY( ps->stats != NULL ) )
+        ps->stats->hook_misses++;
+      return FALSE;
+    }
+}
+
+
+/**
+ * Check input for hookesc.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE on match.
+ */
+gboolean ps_check_hookesc( pstate_t* ps )
+{
+  if ( !ps_has_file(ps) )
+    return FALSE;
+
+  return ps_check( ps, ps_topfile(ps)->cfg->hookesc, TRUE );
+}
+
+
+/**
+ * Save hookpair on top of stack. Pairs are interned, hence only the
+ * pointer is stored.
+ *
+ * @param sf    Stackfile (as context).
+ * @param pair  Hookpair to store.
+ */
+void ps_push_curhook( stackfile_t* sf, hookpair_t* pair )
+{
+  if ( sf->curhook_cnt >= sf->curhook_size )
+    {
+      sf->curhook_size = sf->curhook_size ? sf->curhook_size * 2 : CURHOOK_INIT;
+      sf->curhook = g_renew( hookpair_t*, sf->curhook, sf->curhook_size );
+    }
+
+  sf->curhook[ sf->curhook_cnt++ ] = pair;
+}
+
+
+/**
+ * Pop of top of stack hookpair.
+ *
+ * @param sf Stackfile (as context).
+ */
+void ps_pop_curhook( stackfile_t* sf )
+{
+  sf->curhook_cnt--;
+}
+
+
+/**
+ * Check input for hookbeg.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE on match.
+ */
+gboolean ps_check_hookbeg( pstate_t* ps )
+{
+  if ( !ps_has_file(ps) )
+    return FALSE;
+
+  gboolean ret;
+  stackfile_t* sf = ps_topfile(ps);
+
+  if ( sf->cfg->multi )
+    {
+      gsize len;
+      int i;
+
+      /* Find the longest matching hookbeg. */
+      i = sf_match_multi( sf, &len );
+      ret = ( i >= 0 );
+
+      if ( G_UNLIKELY( ps->stats != NULL ) )
+        {
+          ps->stats->hook_checks++;
+          if ( ret )
+            ps->stats->bytes_in += len;
+          else
+            ps->stats->hook_misses++;
+        }
+
+      if ( ret )
+        {
+          sf_skip( sf, len );
+          ps_push_curhook( sf, sf->cfg->multi[i] );
+        }
+    }
+  else
+    {
+      ret = ps_check( ps, sf->cfg->hook->beg, TRUE );
+
+      if ( ret )
+        ps_push_curhook( sf, sf->cfg->hook );
+    }
+
+  return ret;
+}
+
+
+/**
+ * Check input for hookend.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE on match.
+ */
+gboolean ps_check_hookend( pstate_t* ps )
+{
+  if ( !ps_has_file(ps) )
+    return FALSE;
+  else
+    return ps_check( ps, ps_current_hookend(ps), TRUE );
+}
+
+
+/**
+ * Check input for hooksusp.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE on match.
+ */
+gboolean ps_check_hooksusp( pstate_t* ps )
+{
+  gchar* susp;
+
+  if ( !ps_has_file(ps) )
+    return FALSE;
+  else if ( susp = ps_current_hooksusp(ps) )
+    return ps_check( ps, susp, TRUE );
+  else
+    return FALSE;
+}
+
+
+/**
+ * Check input for eater.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE on match.
+ */
+gboolean ps_check_eater( pstate_t* ps )
+{
+  if ( !ps_has_file(ps) )
+    return FALSE;
+
+  if ( ps_topfile(ps)->eater )
+    return ps_check( ps, ps_topfile(ps)->eater, TRUE );
+  else
+    return FALSE;
+}
+
+
+/**
+ * Return hookbeg string that opened the current macro.
+ *
+ * @param ps PState.
+ *
+ * @return
+ */
+gchar* ps_current_hookbeg( pstate_t* ps )
+{
+  stackfile_t* sf = ps_topfile(ps);
+  hookpair_t* h = sf->curhook[ sf->curhook_cnt-1 ];
+  return h->beg;
+}
+
+
+/**
+ * Return hookend string that closes the current macro.
+ *
+ * @param ps PState.
+ *
+ * @return
+ */
+gchar* ps_current_hookend( pstate_t* ps )
+{
+  stackfile_t* sf = ps_topfile(ps);
+  hookpair_t* h = sf->curhook[ sf->curhook_cnt-1 ];
+  return h->end;
+}
+
+
+/**
+ * Return hooksusp string that suspends the current hookend.
+ *
+ * @param ps PState.
+ *
+ * @return
+ */
+gchar* ps_current_hooksusp( pstate_t* ps )
+{
+  stackfile_t* sf = ps_topfile(ps);
+  hookpair_t* h = sf->curhook[ sf->curhook_cnt-1 ];
+  return h->susp;
+}
+
+
+/**
+ * Get char (through Filestack).
+ *
+ * @param ps Pstate.
+ *
+ * @return Char or EOF.
+ */
+int ps_in( pstate_t* ps )
+{
+  int c = fs_get_one( ps->fs );
+
+  if ( G_UNLIKELY( ps->stats != NULL ) && c != EOF )
+    ps->stats->bytes_in++;
+
+  return c;
+}
+
+
+/**
+ * Input wait callback of Pstate. In streaming mode, pending output is
+ * flushed if input would block, so that the output of the received
+ * input is not delayed by the wait.
+ *
+ * @param sf   Stackfile to read.
+ * @param data Pstate.
+ */
+void ps_input_wait( stackfile_t* sf, gpointer data )
+{
+  pstate_t* ps = data;
+  outfile_t* of = ps->output->data;
+
+  if ( ps->flush == flush_stream && of->wlen > 0 && !sf_ready( sf ) )
+    outfile_flush( of, TRUE );
+}
+
+
+/**
+ * Input pop callback of Pstate. Macro content span into the popped
+ * input is copied, since a macro may continue (or fail) after its
+ * input ends.
+ *
+ * @param sf   Stackfile to pop.
+ * @param data Pstate.
+ */
+void ps_input_pop( stackfile_t* sf, gpointer data )
+{
+  pstate_t* ps = data;
+
+  if ( ps->span && ps->span_sf == sf )
+    {
+      ps_flush_span( ps );
+      ps->span_sf = NULL;
+    }
+}
+
+
+/**
+ * Flush Outfile according to flush policy, after a write. Streaming
+ * policy flushes at newlines, when flush_size chars are pending, or
+ * when the oldest pending write is older than flush_time. Streaming
+ * also flushes after macros and before blocking input reads.
+ *
+ * @param ps    Pstate.
+ * @param of    Outfile written.
+ * @param len   Number of chars written.
+ * @param lines Number of newlines written.
+ */
+void ps_apply_flush( pstate_t* ps, outfile_t* of, gsize len, gsize lines )
+{
+  switch ( ps->flush )
+    {
+    case flush_write: outfile_flush( of, TRUE ); break;
+    case flush_line: if ( lines ) outfile_flush( of, TRUE ); break;
+    case flush_size:
+      {
+        if ( of->wlen >= ps->flush_size || len >= ps->flush_size )
+          outfile_flush( of, TRUE );
+        break;
+      }
+    case flush_stream:
+      {
+        if ( lines || of->wlen >= ps->flush_size || len >= ps->flush_size )
+          outfile_flush( of, TRUE );
+        else if ( ps->flush_time && of->wlen > 0 )
+          {
+            gint64 now = g_get_monotonic_time();
+
+            if ( of->wtime == 0 )
+              of->wtime = now;
+            else if ( now - of->wtime >= ps->flush_time )
+              outfile_flush( of, TRUE );
+          }
+        break;
+      }
+    default: break;
+    }
+}
+
+
+/**
+ * Output char to current output stream.
+ *
+ * @param ps Pstate.
+ * @param c  Char.
+ */
+void ps_out( pstate_t* ps, int c )
+{
+  outfile_t* of = ps->output->data;
+
+  if ( G_UNLIKELY( ps->fs->rec != NULL ) )
+    {
+      gchar ch = c;
+      mcgc_rec_lit( ps->fs->rec, &ch, 1 );
+    }
+
+  if ( of->blocked == FALSE )
+    {
+      if ( G_UNLIKELY( of->wbuf == NULL ) )
+        {
+          gchar ch = c;
+          outfile_write( of, &ch, 1 );
+        }
+      else
+        {
+          if ( of->wlen >= OF_WRITE_SIZE )
+            outfile_flush( of, FALSE );
+
+          of->wbuf[ of->wlen++ ] = c;
+        }
+
+      if ( c == '\n' )
+        of->lineno++;
+
+      if ( G_UNLIKELY( ps->stats != NULL ) )
+        ps->stats->bytes_out++;
+
+      if ( ps->flush )
+        ps_apply_flush( ps, of, 1, ( c == '\n' ) );
+    }
+}
+
+
+/**
+ * Output n chars to current output stream with one write.
+ *
+ * @param ps  Pstate.
+ * @param str Output chars.
+ * @param len Number of chars.
+ */
+void ps_out_n( pstate_t* ps, const gchar* str, gsize len )
+{
+  outfile_t* of = ps->output->data;
+
+  if ( G_UNLIKELY( ps->fs->rec != NULL ) )
+    mcgc_rec_lit( ps->fs->rec, str, len );
+
+  if ( of->blocked == FALSE )
+    {
+      gsize lines = mucgly_count_lines( str, len, NULL );
+
+      of->lineno += lines;
+      outfile_write( of, str, len );
+
+      if ( G_UNLIKELY( ps->stats != NULL ) )
+        ps->stats->bytes_out += len;
+
+      if ( ps->flush )
+        ps_apply_flush( ps, of, len, lines );
+    }
+}
+
+
+/**
+ * Copy file verbatim to current output (see :rawinclude). Content is
+ * not scanned for hooks. Stream output is copied in kernel, and
+ * otherwise the content is written as one block.
+ *
+ * @param ps       Pstate.
+ * @param filename File to copy.
+ *
+ * @return TRUE if file was copied (FALSE if it can't be opened or
+ *         read).
+ */
+gboolean ps_raw_include( pstate_t* ps, const gchar* filename )
+{
+  outfile_t* of = ps->output->data;
+  GMappedFile* map = NULL;
+  GStatBuf st;
+  const gchar* data;
+  gsize len;
+  gsize done = 0;
+  int fd;
+
+  fd = g_open( filename, O_RDONLY, 0 );
+  if ( fd < 0 )
+    return FALSE;
+
+  if ( ps->fs->deps )
+    deps_add( ps->fs->deps->inputs, filename );
+
+  if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+    map = g_mapped_file_new_from_fd( fd, FALSE, NULL );
+
+  if ( map == NULL )
+    {
+      /* Empty, or not mappable (e.g. pipe). */
+      gchar buf[ OF_WRITE_SIZE ];
+      gssize cnt;
+
+      while ( ( cnt = read( fd, buf, sizeof( buf ) ) ) > 0
+              || ( cnt < 0 && errno == EINTR ) )
+        if ( cnt > 0 )
+          ps_out_n( ps, buf, cnt );
+
+      close( fd );
+
+      /* Read error, e.g. directory. */
+      return ( cnt == 0 );
+    }
+
+  data = g_mapped_file_get_contents( map );
+  len = g_mapped_file_get_length( map );
+
+  /* Output is not recorded to templates, since :rawinclude is
+     re-executed at replay. */
+  if ( !of->blocked && of->mrb == NULL )
+    {
+      done = outfile_copy_fd( of, fd, len );
+
+      of->lineno += mucgly_count_lines( data, done, NULL );
+
+      if ( G_UNLIKELY( ps->stats != NULL ) )
+        ps->stats->bytes_out += done;
+
+      /* Short copy means that file shrank (or read failed), and the
+         mapping beyond the new end is not accessible. Without kernel
+         copy, the mapping is used if file still has its size. */
+      if ( done < len
+           && ( done > 0 || fstat( fd, &st ) != 0 || (gsize) st.st_size < len ) )
+        {
+          g_mapped_file_unref( map );
+          close( fd );
+          return FALSE;
+        }
+    }
+
+  if ( done < len )
+    ps_out_n( ps, &data[ done ], len - done );
+
+  g_mapped_file_unref( map );
+  close( fd );
+
+  return TRUE;
+}
+
+
+/**
+ * Output chars with ps_out_n.
+ *
+ * @param ps  Pstate.
+ * @param str Output string (or NULL for no output).
+ */
+void ps_out_str( pstate_t* ps, gchar* str )
+{
+  if ( str )
+    ps_out_n( ps, str, strlen( str ) );
+}
+
+
+/**
+ * Block output stream.
+ *
+ * @param ps Pstate.
+ */
+void ps_block_output( pstate_t* ps )
+{
+  outfile_t* of = ps->output->data;
+  of->blocked = TRUE;
+}
+
+
+/**
+ * Unblock output stream.
+ *
+ * @param ps Pstate.
+ */
+void ps_unblock_output( pstate_t* ps )
+{
+  outfile_t* of = ps->output->data;
+  of->blocked = FALSE;
+}
+
+
+/**
+ * Push Outfile on top of output file stack. Stream output is
+ * pipelined, if enabled.
+ *
+ * @param ps Pstate.
+ * @param of Outfile.
+ */
+void ps_push_outfile( pstate_t* ps, outfile_t* of )
+{
+  if ( G_UNLIKELY( trace_fh != NULL ) )
+    trace_stream( "b", "output", of->filename, of );
+
+  if ( ps->fs->pipelined )
+    outfile_start_pipe( of );
+
+  ps->output = g_list_prepend( ps->output, of );
+}
+
+
+/**
+ * Push new output stream on top of output file stack.
+ *
+ * @param ps       Pstate.
+ * @param filename File name.
+ */
+void ps_push_file( pstate_t* ps, gchar* filename )
+{
+  outfile_t* of;
+
+  if ( ps->fs->deps && filename )
+    deps_add( ps->fs->deps->outputs, filename );
+
+  of = outfile_new( filename, ps->if_changed, ps_current_file( ps ) );
+  ps_push_outfile( ps, of );
+}
+
+
+/**
+ * Pop file from output file stack. Close the stream.
+ *
+ * @param ps Pstate.
+ */
+void ps_pop_file( pstate_t* ps )
+{
+  outfile_t* of;
+
+  of = ps->output->data;
+
+  if ( G_UNLIKELY( trace_fh != NULL ) )
+    trace_stream( "e", "output", of->filename, of );
+
+  outfile_rem( of );
+  ps->output = g_list_delete_link( ps->output, ps->output );
+}
+
+
+/**
+ * Return current Stackfile (input stream).
+ *
+ * @param ps Pstate.
+ *
+ * @return Stackfile (or NULL if none).
+ */
+stackfile_t* ps_current_file( pstate_t* ps )
+{
+  if ( ps == NULL )
+    return NULL;
+  else if ( !ps_has_file(ps) )
+    return NULL;
+  else
+    return ps_topfile(ps);
+}
+
+
+
+/**
+ * Initialize macro content collection.
+ *
+ * @param ps Pstate.
+ */
+void ps_start_collect( pstate_t* ps )
+{
+  g_string_set_size( ps->macro_buf, 0 );
+  ps->span = NULL;
+  ps->span_len = 0;
+}
+
+
+/**
+ * Copy pending input span to macro content.
+ *
+ * @param ps Pstate.
+ */
+void ps_flush_span( pstate_t* ps )
+{
+  if ( ps->span )
+    {
+      g_string_append_len( ps->macro_buf, ps->span, ps->span_len );
+      ps->span = NULL;
+      ps->span_len = 0;
+    }
+}
+
+
+/**
+ * Add consumed input chars to macro. Chars of stable input (mapped
+ * or memory data) are recorded as span into the input, and
+ * contiguous chars just extend the span. Macro content is copied
+ * only when it is not contiguous input (see ps_flush_span).
+ *
+ * @param ps  Pstate.
+ * @param sf  Input of chars.
+ * @param str Chars to add (within input data).
+ * @param len Number of chars.
+ */
+void ps_collect_span( pstate_t* ps, stackfile_t* sf, const gchar* str, gsize len )
+{
+  if ( ps->span && ps->span_sf == sf && ps->span + ps->span_len == str )
+    {
+      ps->span_len += len;
+      return;
+    }
+
+  ps_flush_span( ps );
+
+  if ( sf->fh == NULL )
+    {
+      /* Data stays in place until Stackfile is freed. */
+      ps->span = str;
+      ps->span_len = len;
+      ps->span_sf = sf;
+    }
+  else
+    {
+      /* Streaming input is moved when more is read. */
+      g_string_append_len( ps->macro_buf, str, len );
+    }
+}
+
+
+/**
+ * Add content to macro.
+ *
+ * @param ps Pstate.
+ * @param c  Char to add.
+ */
+void ps_collect( pstate_t* ps, int c )
+{
+  stackfile_t* sf = ps_has_file( ps ) ? ps_topfile( ps ) : NULL;
+
+  if ( sf && sf->data_pos > 0 && (guchar) sf->data[ sf->data_pos - 1 ] == c )
+    {
+      /* Char was just consumed from input. */
+      ps_collect_span( ps, sf, &sf->data[ sf->data_pos - 1 ], 1 );
+    }
+  else
+    {
+      ps_flush_span( ps );
+      g_string_append_c( ps->macro_buf, c );
+    }
+}
+
+
+/**
+ * Add n chars to macro.
+ *
+ * @param ps  Pstate.
+ * @param str Chars to add.
+ * @param len Number of chars.
+ */
+void ps_collect_n( pstate_t* ps, const gchar* str, gsize len )
+{
+  ps_flush_span( ps );
+  g_string_append_len( ps->macro_buf, str, len );
+}
+
+
+/**
+ * Add str content to macro.
+ *
+ * @param ps  Pstate.
+ * @param str String to add.
+ */
+void ps_collect_str( pstate_t* ps, gchar* str )
+{
+  ps_flush_span( ps );
+  g_string_append( ps->macro_buf, str );
+}
+
+
+/**
+ * Complete macro content collection. Pending span is copied to macro
+ * buffer, except for comments which are not needed as text.
+ *
+ * @param ps Pstate.
+ */
+void ps_end_collect( pstate_t* ps )
+{
+  GString* buf = ps->macro_buf;
+  gsize off;
+  gsize keep;
+
+  if ( ps->span == NULL )
+    return;
+
+  /* Comment marker position (after tail eat marker). */
+  off = ( ( buf->len > 0 ? buf->str[0] : ps->span[0] ) == '+' ) ? 1 : 0;
+
+  if ( off < buf->len + ps->span_len
+       && ( off < buf->len ? buf->str[ off ] : ps->span[ off - buf->len ] ) == '/' )
+    {
+      /* Comment, keep the marker only. */
+      if ( buf->len > off )
+        {
+          g_string_truncate( buf, off + 1 );
+        }
+      else
+        {
+          keep = off + 1 - buf->len;
+          g_string_append_len( buf, ps->span, keep );
+        }
+
+      ps->span = NULL;
+      ps->span_len = 0;
+    }
+  else
+    {
+      ps_flush_span( ps );
+    }
+}
+
+
+/**
+ * Enter first level macro and setup state accordingly.
+ *
+ * @param ps Pstate.
+ */
+void ps_enter_macro( pstate_t* ps )
+{
+  /* New macro starting. */
+  ps->in_macro++;
+
+  /* Store macro start info. */
+  sf_mark_macro( ps_topfile( ps ) );
+
+  ps_start_collect( ps );
+}
+
+
+/**
+ * Get current macro content.
+ *
+ * @param ps Pstate.
+ *
+ * @return Macro content.
+ */
+char* ps_get_macro( pstate_t* ps )
+{
+  if ( ps->macro_buf->str[0] == '+' )
+    {
+      /* Eat the next char after macro. */
+      ps_topfile(ps)->eat_tail = TRUE;
+      return &ps->macro_buf->str[1];
+    }
+  else
+    {
+      return ps->macro_buf->str;
+    }
+}
+
+
+/**
+ * Report the pending Ruby exception as Mucgly error.
+ *
+ * @param ps Pstate.
+ */
+void ps_ruby_error( pstate_t* ps )
+{
+  mrb_value obj;
+  gchar* str;
+
+  obj = mrb_funcall( ps->mrb, mrb_obj_value( ps->mrb->exc ), "inspect", 0 );
+  str = RSTRING_PTR(obj);
+  mucgly_error( ps_current_file( ps ), "%s", str );
+}
+
+
+/**
+ * Scan Ruby identifier.
+ *
+ * @param p      Scan position.
+ * @param end    End of input.
+ * @param method Method name suffix ('?' or '!') allowed.
+ *
+ * @return Position after identifier (p if none).
+ */
+const gchar* mucgly_scan_ident( const gchar* p, const gchar* end, gboolean method )
+{
+  const gchar* s = p;
+
+  if ( p < end && ( g_ascii_isalpha( *p ) || *p == '_' ) )
+    {
+      p++;
+      while ( p < end && ( g_ascii_isalnum( *p ) || *p == '_' ) )
+        p++;
+
+      if ( method && p < end && ( *p == '?' || *p == '!' ) )
+        p++;
+    }
+
+  return ( p > s ) ? p : s;
+}
+
+
+/**
+ * Check if Ruby code is a simple variable reference: identifier,
+ * instance variable, global variable, or constant, optionally followed
+ * by method calls without arguments (e.g. "$rev", "@w.to_s").
+ *
+ * @param str Ruby code.
+ * @param beg Start of reference (after leading space).
+ * @param end End of reference (before trailing space).
+ *
+ * @return TRUE if simple.
+ */
+gboolean mucgly_var_simple( const gchar* str, const gchar** beg, const gchar** end )
+{
+  const gchar* p = str;
+  const gchar* e = str + strlen( str );
+  const gchar* n;
+
+  while ( p < e && g_ascii_isspace( *p ) )
+    p++;
+  while ( e > p && g_ascii_isspace( e[-1] ) )
+    e--;
+
+  *beg = p;
+  *end = e;
+
+  if ( p < e && ( *p == '@' || *p == '$' ) )
+    p++;
+
+  n = mucgly_scan_ident( p, e, ( p == *beg && g_ascii_islower( *p ) ) );
+  if ( n == p )
+    return FALSE;
+  p = n;
+
+  while ( p < e )
+    {
+      if ( *p != '.' )
+        return FALSE;
+      p++;
+
+      n = mucgly_scan_ident( p, e, TRUE );
+      if ( n == p )
+        return FALSE;
+      p = n;
+    }
+
+  return TRUE;
+}
+
+
+/**
+ * Call method without arguments (run by mrb_protect).
+ *
+ * @param mrb  MRuby.
+ * @param data Receiver and method symbol (C pointer to array).
+ *
+ * @return Method result.
+ */
+static mrb_value ps_var_call( mrb_state* mrb, mrb_value data )
+{
+  mrb_value* args = mrb_cptr( data );
+  return mrb_funcall_argv( mrb, args[0], mrb_symbol( args[1] ), 0, NULL );
+}
+
+
+/**
+ * Evaluate simple variable reference natively, without compiling it
+ * (see mucgly_var_simple). Identifiers are method calls on top self,
+ * since locals don't persist between macros. Undefined methods and
+ * constants are left to the compiler path for reporting.
+ *
+ * @param ps  Pstate.
+ * @param str Ruby code.
+ * @param val Result (protected in GC arena).
+ *
+ * @return TRUE if evaluated, FALSE if compiled code is needed.
+ */
+gboolean ps_eval_var( pstate_t* ps, const gchar* str, mrb_value* val )
+{
+  mrb_state* mrb = ps->mrb;
+  mrb_value self = mrb_top_self( mrb );
+  mrb_value args[2];
+  const gchar* p;
+  const gchar* e;
+  const gchar* n;
+  mrb_sym sym;
+  mrb_bool err = FALSE;
+
+  if ( !mucgly_var_simple( str, &p, &e ) )
+    return FALSE;
+
+  /* Head of the reference. */
+  if ( *p == '@' || *p == '$' )
+    n = mucgly_scan_ident( p+1, e, FALSE );
+  else
+    n = mucgly_scan_ident( p, e, g_ascii_islower( *p ) );
+
+  sym = mrb_intern( mrb, p, n - p );
+
+  if ( *p == '@' )
+    {
+      *val = mrb_iv_get( mrb, self, sym );
+    }
+  else if ( *p == '$' )
+    {
+      *val = mrb_gv_get( mrb, sym );
+    }
+  else if ( g_ascii_isupper( *p ) )
+    {
+      if ( !mrb_const_defined( mrb, mrb_obj_value( mrb->object_class ), sym ) )
+        return FALSE;
+      *val = mrb_const_get( mrb, mrb_obj_value( mrb->object_class ), sym );
+    }
+  else
+    {
+      if ( !mrb_respond_to( mrb, self, sym ) )
+        return FALSE;
+      *val = self;
+      n = p;
+    }
+
+  if ( n == e )
+    {
+      mrb_gc_protect( mrb, *val );
+      return TRUE;
+    }
+
+  /* Method calls. Output from methods is reproduced at template
+     replay (same as for compiled code). */
+
+  if ( ( (outfile_t*) ps->output->data )->fh == stdout )
+    outfile_flush( ps->output->data, FALSE );
+
+  if ( ps->fs->rec )
+    ps->fs->rec->mute++;
+
+  for ( p = ( *n == '.' ) ? n+1 : n; p < e && !err; p = ( *n == '.' ) ? n+1 : n )
+    {
+      n = mucgly_scan_ident( p, e, TRUE );
+
+      args[0] = *val;
+      args[1] = mrb_symbol_value( mrb_intern( mrb, p, n - p ) );
+      *val = mrb_protect( mrb, ps_var_call, mrb_cptr_value( mrb, args ), &err );
+    }
+
+  if ( ps->fs->rec )
+    ps->fs->rec->mute--;
+
+  if ( err )
+    {
+      mrb->exc = mrb_obj_ptr( *val );
+      ps_ruby_error( ps );
+      *val = mrb_nil_value();
+      return TRUE;
+    }
+
+  mrb_gc_protect( mrb, *val );
+
+  return TRUE;
+}
+
+
+/**
+ * Execute Ruby code. The result is protected in the GC arena, hence
+ * it is valid until the caller restores the arena.
+ *
+ * @param ps     Pstate.
+ * @param str    Ruby code string.
+ * @param proc   Compiled code (or NULL to compile str).
+ *
+ * @return Ruby code execution result (nil on error).
+ */
+mrb_value ps_eval_ruby_proc( pstate_t* ps, const gchar* str, struct RProc* proc )
+{
+  mrb_value ret;
+  gint64 t0 = 0;
+
+  if ( ( (outfile_t*) ps->output->data )->fh == stdout )
+    /* Keep order with direct stdout writes from Ruby. */
+    outfile_flush( ps->output->data, FALSE );
+
+  /* Output from Ruby is reproduced at template replay. */
+  if ( ps->fs->rec )
+    ps->fs->rec->mute++;
+
+  if ( G_UNLIKELY( ps->stats != NULL ) )
+    t0 = g_get_monotonic_time();
+
+  if ( proc )
+    /* Run the compiled body. */
+    ret = mrb_top_run( ps->mrb, proc, mrb_top_self( ps->mrb ), 0 );
+  else
+    /* Cache disabled or syntax error (reported by mruby). */
+    ret = mrb_load_string( ps->mrb, (char*) str );
+
+  if ( G_UNLIKELY( ps->stats != NULL ) && t0 )
+    ps->stats->ruby_usecs += g_get_monotonic_time() - t0;
+
+  if ( ps->fs->rec )
+    ps->fs->rec->mute--;
+
+  if ( ps->mrb->exc ) {
+    /* Error handling. */
+    ps_ruby_error( ps );
+    return mrb_nil_value();
+  }
+
+  /* Successfull execution. Keep result alive for output. */
+  mrb_gc_protect( ps->mrb, ret );
+
+  return ret;
+}
+
+
+/**
+ * Output Ruby value. Strings are written directly from the Ruby
+ * String (including any NULs), other values are inspected first.
+ *
+ * @param ps  Pstate.
+ * @param val Value (protected from GC by caller).
+ */
+void ps_out_value( pstate_t* ps, mrb_value val )
+{
+  if ( !mrb_string_p( val ) )
+    /* Convert to Ruby String (protected in GC arena). */
+    val = mrb_inspect( ps->mrb, val );
+
+  ps_out_n( ps, RSTRING_PTR( val ), RSTRING_LEN( val ) );
+}
+
+
+/**
+ * Evaluate str as Ruby code and output the result if
+ * requested. Compiled code is taken from Rcache.
+ *
+ * @param ps     Pstate.
+ * @param str    Ruby code string.
+ * @param to_str Output result.
+ * @param ctxt   Context (name) for execution.
+ */
+void ps_eval_ruby_str( pstate_t* ps, gchar* str, gboolean to_str, char* ctxt )
+{
+  struct RProc* proc;
+  mrb_value val;
+  int ai;
+
+  if ( !ctxt )
+    /* Used default context. */
+    ctxt = "macro";
+
+  ai = mrb_gc_arena_save( ps->mrb );
+
+  if ( to_str && ps_eval_var( ps, str, &val ) )
+    {
+      /* Simple variable, no compiled code. */
+      if ( ps->fs->rec )
+        mcgc_rec_ruby( ps->fs->rec, ps->mrb, ps_topfile(ps), str, to_str, NULL );
+    }
+  else
+    {
+      proc = rcache_lookup( ps->rcache, ps->mrb, str );
+
+      if ( ps->fs->rec )
+        mcgc_rec_ruby( ps->fs->rec, ps->mrb, ps_topfile(ps), str, to_str, proc );
+
+      val = ps_eval_ruby_proc( ps, str, proc );
+    }
+
+  if ( to_str )
+    {
+      /* Value is part of the recorded macro. */
+      if ( ps->fs->rec )
+        ps->fs->rec->mute++;
+      ps_out_value( ps, val );
+      if ( ps->fs->rec )
+        ps->fs->rec->mute--;
+    }
+
+  mrb_gc_arena_restore( ps->mrb, ai );
+  ps_gc_macro( ps );
+}
+
+
+/**
+ * Count macro evaluation for periodic full GC. Arena scoped garbage
+ * of macros is normally collected incrementally, and the full GC
+ * bounds memory of long runs with garbage in old generation.
+ *
+ * @param ps Pstate.
+ */
+void ps_gc_macro( pstate_t* ps )
+{
+  if ( ps->gc_interval > 0 && ++ps->gc_macros >= ps->gc_interval )
+    {
+      ps->gc_macros = 0;
+      mrb_full_gc( ps->mrb );
+
+      if ( ps->stats )
+        ps->stats->full_gcs++;
+    }
+}
+
+
+/**
+ * Select MRuby GC mode.
+ *
+ * @param mrb          MRuby.
+ * @param generational Generational GC (otherwise incremental).
+ */
+void mucgly_gc_mode( mrb_state* mrb, gboolean generational )
+{
+  mrb_funcall( mrb, mrb_obj_value( mrb_module_get( mrb, "GC" ) ),
+               "generational_mode=", 1, mrb_bool_value( generational ) );
+}
+
+
+/**
+ * Set GC policy of Pstate.
+ *
+ * @param ps       Pstate.
+ * @param mode     "generational" or "incremental" (or NULL to keep).
+ * @param interval Macros between full GCs (0 for none, negative to keep).
+ */
+void mucgly_set_gc( pstate_t* ps, const gchar* mode, mrb_int interval )
+{
+  if ( mode )
+    {
+      if ( !strcmp( mode, "generational" ) )
+        mucgly_gc_mode( ps->mrb, TRUE );
+      else if ( !strcmp( mode, "incremental" ) )
+        mucgly_gc_mode( ps->mrb, FALSE );
+      else
+        mucgly_raise( ps, "error", "Unknown GC mode: \"%s\"", mode );
+    }
+
+  if ( interval >= 0 )
+    {
+      ps->gc_interval = interval;
+      ps->gc_macros = 0;
+    }
+}
+
+
+/**
+ * Set parallel expansion of Pstate (see :parallel).
+ *
+ * @param ps  Pstate.
+ * @param arg Number of threads ("" for all processors, "off" or 1 for none).
+ */
+void mucgly_set_parallel( pstate_t* ps, const gchar* arg )
+{
+  gint64 threads;
+
+  if ( arg == NULL || arg[0] == 0 )
+    threads = g_get_num_processors();
+  else if ( !strcmp( arg, "off" ) )
+    threads = 0;
+  else
+    threads = g_ascii_strtoll( arg, NULL, 10 );
+
+  if ( ps->pure || threads <= 1 )
+    threads = 0;
+
+  ps->parallel = threads;
+}
+
+
+/**
+ * Get memory high-water mark of the process.
+ *
+ * @return Max resident set size in kilobytes.
+ */
+gint64 mucgly_maxrss( void )
+{
+  struct rusage ru;
+
+  if ( getrusage( RUSAGE_SELF, &ru ) != 0 )
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+
+/**
+ * Get file name of compiled Ruby file in Mrbcache. Cache directory
+ * is MUCGLY_MRB_CACHE ("0" disables the cache), or "mucgly" in the
+ * user cache directory. MRuby and bytecode versions are part of the
+ * name, so that different MRuby builds do not share entries.
+ *
+ * @param sum SHA-1 of Ruby file content.
+ *
+ * @return Cache file name (or NULL if cache is disabled).
+ */
+gchar* mrbcache_path( const gchar* sum )
+{
+  const gchar* env = g_getenv( "MUCGLY_MRB_CACHE" );
+  gchar* name;
+  gchar* path;
+
+  if ( env && ( env[0] == 0 || !strcmp( env, "0" ) ) )
+    return NULL;
+
+  name = g_strconcat( sum, "-", MRUBY_VERSION, "-", RITE_BINARY_FORMAT_VER,
+                      MRBCACHE_SUFFIX, NULL );
+
+  if ( env )
+    path = g_build_filename( env, name, NULL );
+  else
+    path = g_build_filename( g_get_user_cache_dir(), "mucgly", name, NULL );
+
+  g_free( name );
+
+  return path;
+}
+
+
+/**
+ * Get compiled Ruby file. Compiled code is loaded from Mrbcache, or
+ * compiled and stored to Mrbcache. Cache entries are keyed by
+ * content, so changed files are compiled again. Failure to store is
+ * not an error.
+ *
+ * @param mrb      MRuby.
+ * @param filename Ruby file name (for error messages).
+ * @param src      Ruby file content.
+ * @param len      Content length.
+ * @param sum      SHA-1 of content.
+ *
+ * @return Compiled code (or NULL on syntax error).
+ */
+struct RProc* mrbcache_load( mrb_state* mrb, const gchar* filename,
+                             const gchar* src, gsize len, const gchar* sum )
+{
+  gchar* path;
+  GMappedFile* map;
+  struct RProc* proc = NULL;
+  uint8_t* bin = NULL;
+  size_t bin_size = 0;
+
+  path = mrbcache_path( sum );
+
+  if ( path && ( map = g_mapped_file_new( path, FALSE, NULL ) ) )
+    {
+      /* Corrupt and incompatible entries are rejected. */
+      proc = mcgc_load_irep( mrb, g_mapped_file_get_contents( map ),
+                             g_mapped_file_get_length( map ) );
+      g_mapped_file_unref( map );
+
+      if ( proc )
+        {
+          g_free( path );
+          return proc;
+        }
+    }
+
+  proc = rcache_compile_file( mrb, src, len, filename );
+
+  if ( proc && path
+       && mrb_dump_irep( mrb, (mrb_irep*) proc->body.irep, MRB_DUMP_DEBUG_INFO,
+                         &bin, &bin_size ) == MRB_DUMP_OK )
+    {
+      gchar* dir = g_path_get_dirname( path );
+
+      g_mkdir_with_parents( dir, 0755 );
+      g_file_set_contents( path, (gchar*) bin, bin_size, NULL );
+
+      g_free( dir );
+      mrb_free( mrb, bin );
+    }
+
+  g_free( path );
+
+  return proc;
+}
+
+
+/**
+ * Load file with Ruby intepreter. Compiled code is taken from
+ * Mrbcache. Preloaded files (see mucgly_preload) are already in
+ * MRuby, and they are not loaded again unless changed.
+ *
+ * @param ps       Pstate.
+ * @param filename Source file.
+ */
+void ps_load_ruby_file( pstate_t* ps, gchar* filename )
+{
+  GMappedFile* map;
+  const gchar* src;
+  gsize len;
+  gchar* sum;
+  const gchar* loaded;
+  struct RProc* proc;
+  gint64 t0;
+  int ai;
+
+  map = g_mapped_file_new( filename, FALSE, NULL );
+  if ( map == NULL )
+    return;
+
+  if ( ps->fs->deps )
+    deps_add( ps->fs->deps->sources, filename );
+
+  /* Parallel workers load the same files (see par_worker_setup). */
+  deps_add( ps->sources, filename );
+
+  src = g_mapped_file_get_contents( map );
+  len = g_mapped_file_get_length( map );
+  sum = g_compute_checksum_for_data( G_CHECKSUM_SHA1, (guchar*) src, len );
+
+  if ( ps->preload
+       && ( loaded = g_hash_table_lookup( ps->preload, filename ) )
+       && !strcmp( loaded, sum ) )
+    {
+      g_free( sum );
+      g_mapped_file_unref( map );
+      return;
+    }
+
+  t0 = ps->stats ? g_get_monotonic_time() : 0;
+
+  if ( ps->fs->rec )
+    ps->fs->rec->mute++;
+
+  ai = mrb_gc_arena_save( ps->mrb );
+
+  proc = mrbcache_load( ps->mrb, filename, src, len, sum );
+
+  if ( proc )
+    {
+      mrb_top_run( ps->mrb, proc, mrb_top_self( ps->mrb ), 0 );
+    }
+  else
+    {
+      /* Syntax errors are reported by mruby. */
+      FILE* ufh = fopen( filename, "r" );
+      if ( ufh )
+        {
+          mrb_load_file( ps->mrb, ufh );
+          fclose( ufh );
+        }
+    }
+
+  mrb_gc_arena_restore( ps->mrb, ai );
+
+  if ( ps->stats && t0 )
+    ps->stats->ruby_usecs += g_get_monotonic_time() - t0;
+
+  if ( ps->fs->rec )
+    ps->fs->rec->mute--;
+
+  g_free( sum );
+  g_mapped_file_unref( map );
+}
+
+
+/**
+ * Preload Ruby file to MRuby of Pstate. Later ":source" of the same
+ * (unchanged) file is skipped, so the library is compiled and run
+ * only once for all files processed. Preloaded files should only
+ * define helpers, since their side effects are not repeated.
+ *
+ * @param ps       Pstate.
+ * @param filename Ruby file.
+ *
+ * @return TRUE if file was loaded.
+ */
+gboolean mucgly_preload( pstate_t* ps, const gchar* filename )
+{
+  gchar* sum;
+
+  sum = mcgc_file_sha1( filename );
+  if ( sum == NULL )
+    return FALSE;
+
+  if ( ps->preload == NULL )
+    ps->preload = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+
+  /* Loaded before registration, i.e. really loaded. */
+  g_hash_table_remove( ps->preload, filename );
+  ps_load_ruby_file( ps, (gchar*) filename );
+  g_hash_table_insert( ps->preload, g_strdup( filename ), sum );
+
+  return TRUE;
+}
+
+
+/**
+ * Preload Ruby files listed in MUCGLY_PRELOAD (separated with
+ * G_SEARCHPATH_SEPARATOR).
+ *
+ * @param ps Pstate.
+ */
+void mucgly_preload_env( pstate_t* ps )
+{
+  const gchar* env = g_getenv( "MUCGLY_PRELOAD" );
+  gchar** files;
+
+  if ( env == NULL || env[0] == 0 )
+    return;
+
+  files = g_strsplit( env, G_SEARCHPATH_SEPARATOR_S, -1 );
+
+  for ( int i = 0; files[i]; i++ )
+    {
+      if ( files[i][0] && !mucgly_preload( ps, files[i] ) )
+        mucgly_warn( NULL, "Can't preload \"%s\"", files[i] );
+    }
+
+  g_strfreev( files );
+}
+
+
+/** Command :hookbeg. Set hookbeg. */
+static gboolean mucgly_cmd_hookbeg( pstate_t* ps, gchar* arg, gpointer data )
+{
+  sf_set_hook( ps_topfile(ps), hook_beg, arg );
+  return FALSE;
+}
+
+/** Command :hookend. Set hookend. */
+static gboolean mucgly_cmd_hookend( pstate_t* ps, gchar* arg, gpointer data )
+{
+  sf_set_hook( ps_topfile(ps), hook_end, arg );
+  return FALSE;
+}
+
+/** Command :hookesc. Set hookesc. */
+static gboolean mucgly_cmd_hookesc( pstate_t* ps, gchar* arg, gpointer data )
+{
+  sf_set_hook( ps_topfile(ps), hook_esc, arg );
+  return FALSE;
+}
+
+/** Command :eater. Set eater. */
+static gboolean mucgly_cmd_eater( pstate_t* ps, gchar* arg, gpointer data )
+{
+  sf_set_eater( ps_topfile(ps), arg );
+  return FALSE;
+}
+
+/** Command :hookall. Set hookbeg, hookend and hookesc to same value. */
+static gboolean mucgly_cmd_hookall( pstate_t* ps, gchar* arg, gpointer data )
+{
+  sf_set_hook( ps_topfile(ps), hook_beg, arg );
+  sf_set_hook( ps_topfile(ps), hook_end, arg );
+  sf_set_hook( ps_topfile(ps), hook_esc, arg );
+  return FALSE;
+}
+
+/** Command :hook. Set hookbeg and hookend (space separated, or same for both). */
+static gboolean mucgly_cmd_hook( pstate_t* ps, gchar* arg, gpointer data )
+{
+  gchar** pieces;
+
+  pieces = g_strsplit( arg, " ", 2 );
+  if ( g_strv_length( pieces ) == 2 )
+    {
+      /* Two hooks separated by space. */
+      sf_set_hook( ps_topfile(ps), hook_beg, pieces[0] );
+      sf_set_hook( ps_topfile(ps), hook_end, pieces[1] );
+    }
+  else
+    {
+      /* Only one hook specified. */
+      sf_set_hook( ps_topfile(ps), hook_beg, pieces[0] );
+      sf_set_hook( ps_topfile(ps), hook_end, pieces[0] );
+    }
+  g_strfreev( pieces );
+
+  return FALSE;
+}
+
+/** Command :include. Include file. */
+static gboolean mucgly_cmd_include( pstate_t* ps, gchar* arg, gpointer data )
+{
+  fs_push_file_delayed( ps->fs, arg );
+  ps->post_push = TRUE;
+  return FALSE;
+}
+
+/** Command :parallel. Expand the following pure input in parallel. */
+static gboolean mucgly_cmd_parallel( pstate_t* ps, gchar* arg, gpointer data )
+{
+  mucgly_set_parallel( ps, arg );
+  return FALSE;
+}
+
+/** Command :rawinclude. Copy file to output verbatim. */
+static gboolean mucgly_cmd_rawinclude( pstate_t* ps, gchar* arg, gpointer data )
+{
+  if ( !ps_raw_include( ps, arg ) )
+    mucgly_fatal( ps_topfile(ps), "Can't read \"%s\"", arg );
+  return FALSE;
+}
+
+/** Command :source. Load Ruby file. */
+static gboolean mucgly_cmd_source( pstate_t* ps, gchar* arg, gpointer data )
+{
+  ps_load_ruby_file( ps, arg );
+  return FALSE;
+}
+
+/** Command :block. Block output. */
+static gboolean mucgly_cmd_block( pstate_t* ps, gchar* arg, gpointer data )
+{
+  ps_block_output( ps );
+  return FALSE;
+}
+
+/** Command :unblock. Unblock output. */
+static gboolean mucgly_cmd_unblock( pstate_t* ps, gchar* arg, gpointer data )
+{
+  ps_unblock_output( ps );
+  return FALSE;
+}
+
+/** Command :comment. Comment. */
+static gboolean mucgly_cmd_comment( pstate_t* ps, gchar* arg, gpointer data )
+{
+  /* Do nothing. */
+  return FALSE;
+}
+
+/** Command :exit. Exit processing. */
+static gboolean mucgly_cmd_exit( pstate_t* ps, gchar* arg, gpointer data )
+{
+  /* Exit processing. */
+  return TRUE;
+}
+
+
+#define MUCGLY_CMD(name,rec) { # name, sizeof( # name ) - 1, mucgly_cmd_ ## name, NULL, rec }
+
+/** Built-in internal commands, in name order (see mucgly_cmd_find). */
+static mucgly_cmd_t mucgly_cmds[] = {
+  MUCGLY_CMD( block, TRUE ),    /* 0 */
+  MUCGLY_CMD( comment, FALSE ), /* 1 */
+  MUCGLY_CMD( eater, TRUE ),    /* 2 */
+  MUCGLY_CMD( exit, TRUE ),     /* 3 */
+  MUCGLY_CMD( hook, TRUE ),     /* 4 */
+  MUCGLY_CMD( hookall, TRUE ),  /* 5 */
+  MUCGLY_CMD( hookbeg, TRUE ),  /* 6 */
+  MUCGLY_CMD( hookend, TRUE ),  /* 7 */
+  MUCGLY_CMD( hookesc, TRUE ),  /* 8 */
+  MUCGLY_CMD( include, TRUE ),  /* 9 */
+  MUCGLY_CMD( parallel, FALSE ),/* 10 */
+  MUCGLY_CMD( rawinclude, TRUE ),/* 11 */
+  MUCGLY_CMD( source, TRUE ),   /* 12 */
+  MUCGLY_CMD( unblock, TRUE ),  /* 13 */
+};
+
+
+/**
+ * Find internal command. Built-in commands are selected by their
+ * distinguishing chars, and only the candidate is compared. Other
+ * names are looked up from the registered commands.
+ *
+ * @param name Command name (not terminated).
+ * @param len  Name length.
+ *
+ * @return Command (or NULL if unknown).
+ */
+mucgly_cmd_t* mucgly_cmd_find( const gchar* name, gsize len )
+{
+  mucgly_cmd_t* cmd = NULL;
+  gchar key[ CMD_NAME_MAX ];
+
+  if ( len == 0 )
+    return NULL;
+
+  switch ( name[0] )
+    {
+    case 'b': cmd = &mucgly_cmds[0]; break;
+    case 'c': cmd = &mucgly_cmds[1]; break;
+    case 'e': cmd = ( len > 1 && name[1] == 'a' ) ? &mucgly_cmds[2] : &mucgly_cmds[3]; break;
+    case 'h':
+      {
+        if ( len <= 4 )
+          cmd = &mucgly_cmds[4];
+        else if ( name[4] == 'a' )
+          cmd = &mucgly_cmds[5];
+        else if ( name[4] == 'b' )
+          cmd = &mucgly_cmds[6];
+        else if ( len > 5 && name[5] == 'n' )
+          cmd = &mucgly_cmds[7];
+        else
+          cmd = &mucgly_cmds[8];
+        break;
+      }
+    case 'i': cmd = &mucgly_cmds[9]; break;
+    case 'p': cmd = &mucgly_cmds[10]; break;
+    case 'r': cmd = &mucgly_cmds[11]; break;
+    case 's': cmd = &mucgly_cmds[12]; break;
+    case 'u': cmd = &mucgly_cmds[13]; break;
+    default: break;
+    }
+
+  if ( cmd && cmd->len == len && !memcmp( cmd->name, name, len ) )
+    return cmd;
+
+  /* Registered commands. */
+  if ( len >= CMD_NAME_MAX )
+    return NULL;
+
+  memcpy( key, name, len );
+  key[ len ] = 0;
+
+  g_mutex_lock( &mucgly_cmd_lock );
+  cmd = mucgly_cmd_table ? g_hash_table_lookup( mucgly_cmd_table, key ) : NULL;
+  g_mutex_unlock( &mucgly_cmd_lock );
+
+  return cmd;
+}
+
+
+/**
+ * Register internal command, i.e. ":name" macro calls func. Commands
+ * are process wide. Registered commands are recorded to precompiled
+ * templates and re-executed at replay, and their output is not
+ * recorded.
+ *
+ * @param name Command name (without ':').
+ * @param func Command function.
+ * @param data Data for func.
+ *
+ * @return TRUE on success (FALSE for invalid or already used name).
+ */
+gboolean mucgly_cmd_register( const gchar* name, mucgly_cmd_func_t func, gpointer data )
+{
+  mucgly_cmd_t* cmd;
+  gsize len = strlen( name );
+  gboolean ok;
+
+  if ( len == 0 || len >= CMD_NAME_MAX || strpbrk( name, " \t\n" ) )
+    return FALSE;
+
+  /* Built-ins can't be replaced. */
+  for ( gsize i = 0; i < G_N_ELEMENTS( mucgly_cmds ); i++ )
+    if ( !strcmp( mucgly_cmds[i].name, name ) )
+      return FALSE;
+
+  g_mutex_lock( &mucgly_cmd_lock );
+
+  if ( mucgly_cmd_table == NULL )
+    mucgly_cmd_table = g_hash_table_new( g_str_hash, g_str_equal );
+
+  /* Commands are never replaced, since a Pstate may be using them. */
+  ok = ( g_hash_table_lookup( mucgly_cmd_table, name ) == NULL );
+  if ( ok )
+    {
+      cmd = g_new0( mucgly_cmd_t, 1 );
+      cmd->name = g_strdup( name );
+      cmd->len = len;
+      cmd->func = func;
+      cmd->data = data;
+      cmd->record = TRUE;
+      g_hash_table_insert( mucgly_cmd_table, (gchar*) cmd->name, cmd );
+    }
+
+  g_mutex_unlock( &mucgly_cmd_lock );
+
+  return ok;
+}
+
+
+/**
+ * Execute Mucgly command/macro.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE if input processing should be aborted.
+ */
+gboolean ps_eval_cmd( pstate_t* ps )
+{
+  char* cmd;
+
+  cmd = ps_get_macro( ps );
+
+  if ( cmd[0] == ':' )
+    {
+
+      /* Mucgly internal command. */
+
+      mucgly_cmd_t* ic;
+      gchar* arg;
+      gsize len;
+      gboolean ret;
+
+      /* Name ends at separator, and argument follows the separator. */
+      len = strcspn( &cmd[1], " \t\n" );
+      arg = cmd[ len+1 ] ? &cmd[ len+2 ] : &cmd[ len+1 ];
+
+      ic = mucgly_cmd_find( &cmd[1], len );
+      if ( ic == NULL )
+        {
+          mucgly_error( ps_topfile(ps), "Unknown internal command: \"%s\"", &cmd[1] );
+          return FALSE;
+        }
+
+      /* Commands are re-executed at template replay. */
+      if ( ps->fs->rec && ic->record )
+        mcgc_rec_cmd( ps->fs->rec, ps_topfile(ps), cmd );
+
+      if ( ps->fs->rec )
+        ps->fs->rec->mute++;
+
+      ret = ic->func( ps, arg, ic->data );
+
+      if ( ps->fs->rec )
+        ps->fs->rec->mute--;
+
+      if ( ret )
+        return TRUE;
+    }
+
+  else if ( cmd[0] == '.' )
+    {
+      /* Mucgly variable output. */
+      ps_eval_ruby_str( ps, &cmd[1], TRUE, NULL );
+    }
+
+  else if ( cmd[0] == '/' )
+    {
+      /* Mucgly comment, do nothing. */
+    }
+
+  else if ( cmd[0] == '#' )
+    {
+      /* Postpone evaluation (to next round). */
+
+      ps_out_str( ps, ps_current_hookbeg( ps ) );
+
+      /* Remove one # sign. */
+      ps_out_str( ps, &cmd[1] );
+
+      ps_out_str( ps, ps_current_hookend( ps ) );
+    }
+
+  else
+    {
+      /* Ruby code execution. */
+      ps_eval_ruby_str( ps, cmd, FALSE, NULL );
+    }
+
+  return FALSE;
+}
+
+
+/**
+ * Apply input stack changes requested within macro.
+ *
+ * @param ps Pstate.
+ */
+void ps_post_macro( pstate_t* ps )
+{
+  if ( ps->post_push == TRUE )
+    {
+      ps->post_push = FALSE;
+      ps->fs->file = ps->fs->file->prev;
+    }
+
+  if ( ps->post_pop )
+    {
+      ps->post_pop = FALSE;
+      fs_pop_file( ps->fs );
+    }
+}
+
+
+/**
+ * Processing routine for hookend phase.
+ *
+ * @param ps       Pstate.
+ * @param do_break True if current processing phase is over.
+ */
+void ps_process_hook_end_seq( pstate_t* ps, gboolean* do_break )
+{
+  ps->in_macro--;
+
+  if ( ps->in_macro < 0 )
+    {
+      mucgly_fatal( ps_topfile(ps), "Internal error in macro status..." );
+    }
+  else if ( ps->in_macro )
+    {
+      /* Multilevel macro decrement. */
+      /* Output the consumed hookend. */
+      ps_out_str( ps, ps_current_hookend( ps ) );
+      ps_pop_curhook( ps_topfile(ps) );
+      *do_break = FALSE;
+    }
+  else
+    {
+      /* Back to base level from macro, eval the macro. */
+      ps_end_collect( ps );
+
+      if ( G_UNLIKELY( ps->stats != NULL || trace_fh != NULL ) )
+        {
+          stats_macro_t type = stats_macro_type( ps->macro_buf->str );
+          gchar body[ TRACE_BODY_MAX + 1 ];
+          gboolean trace = ( trace_fh != NULL );
+          gint64 t0;
+
+          /* Macro buffer is reused in evaluation. */
+          if ( trace )
+            trace_body( body, ps->macro_buf->str );
+
+          t0 = g_get_monotonic_time();
+
+          *do_break = ps_eval_cmd( ps );
+
+          /* Macro may disable stats. */
+          if ( ps->stats )
+            stats_macro( ps->stats, ps_topfile( ps ), type, g_get_monotonic_time() - t0 );
+
+          if ( trace )
+            trace_macro( ps_topfile( ps ), type, body, t0 );
+        }
+      else
+        {
+          *do_break = ps_eval_cmd( ps );
+        }
+      sf_unmark_macro( ps_topfile( ps ) );
+      ps_pop_curhook( ps_topfile(ps) );
+      ps_post_macro( ps );
+
+      /* Macro boundary completes output in streaming. */
+      if ( ps->flush == flush_stream
+           && ( (outfile_t*) ps->output->data )->wlen > 0 )
+        outfile_flush( ps->output->data, TRUE );
+    }
+}
+
+
+/**
+ * Processing routine for non-hook chars.
+ *
+ * @param ps        Pstate.
+ * @param c         Current char input.
+ * @param do_break  True if should break from current phase.
+ */
+void ps_process_non_hook_seq( pstate_t* ps, int c, gboolean* do_break )
+{
+  /* Non-hook input. */
+  if ( ps->in_macro )
+    {
+      *do_break = FALSE;
+
+      if ( c == EOF )
+        mucgly_error( ps_current_file(ps), "Got EOF within macro!" );
+
+      /* Add content to macro. */
+      ps_collect( ps, c );
+    }
+  else
+    {
+      if ( c == EOF )
+        {
+          *do_break = TRUE;
+        }
+      else
+        {
+          *do_break = FALSE;
+
+          /* Output to current output file. */
+          ps_out( ps, c );
+        }
+    }
+}
+
+
+/**
+ * Process input file (or stack of files).
+ *
+ * @param ps      Pstate.
+ * @param infile  Input file name.
+ * @param outfile Output file name (or NULL). Outfile string is freed.
+ */
+void ps_process_file( pstate_t* ps, gchar* infile, gchar* outfile )
+{
+  if ( ps_deps_begin( ps, infile, outfile ) )
+    {
+      /* Incremental mode, outputs are up to date. */
+      g_free( outfile );
+      return;
+    }
+
+  if ( ps->mcgc && infile )
+    {
+      /* Replay unchanged input, otherwise record it. */
+      if ( ps_replay_file( ps, infile, outfile ) )
+        {
+          ps_deps_end( ps );
+          return;
+        }
+      ps->fs->rec = mcgc_new( infile );
+    }
+
+  fs_push_file( ps->fs, infile );
+
+  if ( outfile )
+    {
+      ps_push_file( ps, outfile );
+      g_free( outfile );
+    }
+
+  ps_process( ps );
+
+  if ( ps->fs->rec )
+    {
+      mcgc_save( ps->fs->rec );
+      mcgc_rem( ps->fs->rec );
+      ps->fs->rec = NULL;
+    }
+
+  if ( outfile )
+    ps_pop_file( ps );
+  else
+    outfile_flush( ps->output->data, FALSE );
+
+  ps_deps_end( ps );
+}
+
+
+/**
+ * Process Ruby String as input, and collect output to Ruby String.
+ * Input is copied, since macros may modify or release the String
+ * during processing.
+ *
+ * @param ps  Pstate.
+ * @param src Input.
+ * @param len Input length.
+ *
+ * @return Output (Ruby String).
+ */
+mrb_value ps_process_str( pstate_t* ps, const gchar* src, gsize len )
+{
+  stackfile_t* sf;
+  outfile_t* of;
+  gchar* data;
+  mrb_value ret;
+
+  /* Input may contain NUL chars. */
+  data = g_malloc( len + 1 );
+  memcpy( data, src, len );
+  data[ len ] = 0;
+
+  sf = sf_new_data( "<STRING>", data, len,
+                    ps->fs->file ? fs_topfile(ps->fs) : ps->fs->base );
+  sf->data_own = TRUE;
+  fs_push_stackfile( ps->fs, sf );
+
+  of = outfile_new_str( ps->mrb );
+  ps_push_outfile( ps, of );
+
+  ps_process( ps );
+
+  /* Output stays alive as return value. */
+  ret = of->rstr;
+  mrb_gc_protect( ps->mrb, ret );
+  ps_pop_file( ps );
+
+  return ret;
+}
+
+
+/**
+ * Process input until EOF of the input stack (or until exit
+ * command). Input and output files are setup by the caller.
+ *
+ * @param ps Pstate.
+ */
+void ps_process( pstate_t* ps )
+{
+  int c;
+  gboolean do_break = FALSE;
+  gchar* run;
+  gsize len;
+  gint64 t0 = ps->stats ? g_get_monotonic_time() : 0;
+  gboolean nested = FALSE;
+
+  /* Nested processing (from a macro) is part of Ruby time. */
+  if ( ps->stats )
+    {
+      nested = ps->stats->in_process;
+      ps->stats->in_process = TRUE;
+    }
+
+  /* ------------------------------------------------------------
+   * Process input:
+   * ------------------------------------------------------------ */
+
+  for (;;)
+    {
+
+      /* Pure input is expanded in parallel (see :parallel). */
+      if ( G_UNLIKELY( ps->parallel > 0 )
+           && ps_par_ready( ps )
+           && ps_par_region( ps ) )
+        continue;
+
+      /* Fast path: chars that can't start a hook are passed in bulk,
+         either to output or to macro content. */
+      if ( ps_has_file(ps)
+           && ( run = sf_get_plain( ps_topfile(ps), &len ) ) )
+        {
+          if ( G_UNLIKELY( ps->stats != NULL ) )
+            ps->stats->bytes_in += len;
+
+          if ( ps->in_macro )
+            ps_collect_span( ps, ps_topfile(ps), run, len );
+          else
+            ps_out_n( ps, run, len );
+          continue;
+        }
+
+      /* Peek the next char, so that hooks can be matched in
+         place. Files are popped automatically after EOF. */
+
+      c = fs_peek_one( ps->fs );
+
+      /* Check if next char starts one of the hooks. */
+      if ( ps_check_hook( ps, c ) )
+        {
+
+          /* Escape is always checked before other hooks. */
+          if ( ps_check_hookesc( ps ) )
+            {
+              /* Handle ESCAPEs depending whether in macro or not. */
+
+              if ( ps->in_macro )
+                {
+
+                  /* Escape in macro. */
+
+                  /* Just transfer the following char to output. */
+                  c = fs_peek_one( ps->fs );
+
+                  /* Error, if EOF in macro. */
+                  if ( c == EOF )
+                    {
+                      mucgly_error( ps_current_file(ps), "Got EOF within macro!" );
+                    }
+                  else
+                    {
+                      if ( ( c == ' ' || c == '\n' ) &&
+                           ps_topfile(ps)->cfg->hook_esc_eq_end )
+                        {
+                          /* Space/newline and hookesc is same as hookbeg. */
+                          ps_in( ps );
+                          ps_process_hook_end_seq( ps, &do_break );
+                          if ( do_break )
+                            break;
+                        }
+                      else if ( ps_topfile(ps)->eater
+                                && ps_topfile(ps)->eater[0] == c )
+                        {
+                          if ( ps_check_eater( ps ) )
+                            {
+                              /* Eater and the char after it. */
+                              ps_in( ps );
+                            }
+                          else
+                            {
+                              ps_in( ps );
+                              ps_collect( ps, c );
+                            }
+                        }
+                      else
+                        {
+                          ps_in( ps );
+                          ps_collect( ps, c );
+                        }
+                    }
+                }
+              else
+                {
+
+                  /* Escape outside macro. */
+
+                  /* Map next char according to escape rules. */
+                  c = fs_peek_one( ps->fs );
+
+                  if ( c == EOF )
+                    {
                       /* EOF */
                       break;
                     }
                   else if ( ps_topfile(ps)->eater
                             && ps_topfile(ps)->eater[0] == c )
                     {
-                      fs_put( ps->fs, c );
                       if ( ps_check_eater( ps ) )
-                        ps_in( ps );
+                        {
+                          /* Eater and the char after it. */
+                          ps_in( ps );
+                        }
                       else
-                        ps_out( ps, c );
+                        {
+                          ps_in( ps );
+                          ps_out( ps, c );
+                        }
                     }
                   else
                     {
 
-                      switch ( (char)c )
-                        {
+                      /* Consume the char, unless it starts a macro
+                         (see below). */
+                      if ( !ps_topfile(ps)->cfg->hook_esc_eq_beg
+                           || c == '\n' || c == ' '
+                           || ( ps_topfile(ps)->cfg->hookesc[1] == 0
+                                && c == ps_topfile(ps)->cfg->hookesc[0] ) )
+                        ps_in( ps );
+
+                      switch ( (char)c )
+                        {
+
+                        case '\n':
+                          /* Eat newlines. */
+                          break;
+
+                        case ' ':
+                          /* Eat spaces. */
+                          break;
+
+                        default:
+
+                          if ( ps_topfile(ps)->cfg->hook_esc_eq_beg )
+                            {
+
+                              if ( ps_topfile(ps)->cfg->hookesc[1] == 0
+                                   && c == ps_topfile(ps)->cfg->hookesc[0] )
+                                {
+                                  /* Escape is one char long and following
+                                     char was ESC (i.e. escaped escape). */
+                                  ps_out( ps, c );
+                                }
+                              else
+                                {
+                                  /* Escape is same as hookbeg and escape is
+                                     not used to eat out spaces. The
+                                     extra char is left in input. */
+
+                                  /* Push hook here. For non-esc hooks
+                                     this is done while matching for
+                                     hook. */
+                                  ps_push_curhook( ps_topfile(ps), ps_topfile(ps)->cfg->hook );
+
+                                  /* Start to collect the macro content. */
+                                  ps_enter_macro( ps );
+                                }
+                            }
+                          else
+                            {
+                              /* Literal output. */
+                              ps_out( ps, c );
+                            }
+                        }
+                    }
+
+                }
+            }
+          else if ( ps->in_macro && ps_check_hooksusp( ps ) )
+            {
+              ps->suspension++;
+              ps_collect_str( ps, ps_current_hooksusp( ps ) );
+            }
+          else if ( ps->in_macro && ps_check_hookend( ps ) )
+            {
+              /* Hookend has priority over hookbeg if we are in
+                 macro. Also hookend is ignored when outside macro. */
+              if ( ps->suspension == 0 )
+                {
+                  ps_process_hook_end_seq( ps, &do_break );
+                  if ( do_break )
+                    break;
+                }
+              else
+                {
+                  ps->suspension--;
+                  ps_collect_str( ps, ps_current_hookend( ps ) );
+                }
+            }
+          else if ( ps_check_hookbeg( ps ) )
+            {
+
+              if ( ps->in_macro )
+                {
+                  /* Macro in macro. */
+
+                  /* Increase macro level. */
+                  ps->in_macro++;
+
+                  /* Output the consumed hookbeg. */
+                  ps_out_str( ps, ps_current_hookbeg( ps ) );
+                }
+              else
+                {
+                  ps_enter_macro( ps );
+                }
+            }
+          else
+            {
+              c = ps_in( ps );
+              ps_process_non_hook_seq( ps, c, &do_break );
+              if ( do_break )
+                break;
+            }
+        }
+      else
+        {
+          c = ps_in( ps );
+          ps_process_non_hook_seq( ps, c, &do_break );
+          if ( do_break )
+            break;
+        }
+    }
+
+  /* Stats may be enabled or disabled during processing. */
+  if ( ps->stats && t0 )
+    {
+      if ( nested )
+        ps->stats->nested_usecs += g_get_monotonic_time() - t0;
+      else
+        ps->stats->total_usecs += g_get_monotonic_time() - t0;
+      ps->stats->in_process = nested;
+    }
+}
+
+
+
+/**
+ * Reset Pstate after aborted processing. Input files and output
+ * files (except the base output) are closed, and the parsing state
+ * is cleared.
+ *
+ * @param ps Pstate.
+ */
+void ps_reset( pstate_t* ps )
+{
+  /* Include files pushed for later use precede the current file. */
+  while ( ps->fs->file && ps->fs->file->prev )
+    ps->fs->file = ps->fs->file->prev;
+
+  while ( ps->fs->file )
+    fs_pop_file( ps->fs );
+
+  if ( ps->fs->rec )
+    {
+      mcgc_rem( ps->fs->rec );
+      ps->fs->rec = NULL;
+    }
+  ps->fs->replay = FALSE;
+
+  if ( ps->fs->deps )
+    {
+      /* Manifest is not written for failed processing. */
+      deps_rem( ps->fs->deps );
+      ps->fs->deps = NULL;
+    }
+
+  while ( ps->output->next )
+    {
+      /* Partial output is not committed. */
+      outfile_discard( ps->output->data );
+      ps_pop_file( ps );
+    }
+  ps_unblock_output( ps );
+
+  g_string_truncate( ps->macro_buf, 0 );
+  ps->span = NULL;
+  ps->span_len = 0;
+  ps->in_macro = 0;
+  ps->suspension = 0;
+  ps->post_push = FALSE;
+  ps->post_pop = FALSE;
+  ps->par_sf = NULL;
+  ps->par_skip = 0;
+
+  if ( ps->mrb )
+    ps->mrb->exc = NULL;
+}
+
+
+/**
+ * Run function with errors trapped. Pstate is attached to its MRuby
+ * for the duration of the run, and it is reset after errors. Runs
+ * may be nested within other processing.
+ *
+ * @param ps   Pstate.
+ * @param func Function to run.
+ * @param data Function data.
+ *
+ * @return Error message (or NULL on success).
+ */
+gchar* ps_trap( pstate_t* ps, ps_func_t func, gpointer data )
+{
+  mucgly_trap_t trap;
+  mucgly_trap_t* prev;
+  void* ud;
+  gchar* msg = NULL;
+
+  prev = g_private_get( &mucgly_trap_key );
+  ud = ps->mrb->ud;
+
+  trap.msg = g_string_sized_new( 0 );
+  mucgly_set_trap( &trap );
+  ps->mrb->ud = ps;
+
+  if ( setjmp( trap.env ) == 0 )
+    {
+      func( ps, data );
+    }
+  else
+    {
+      mucgly_set_trap( prev );
+      msg = g_strdup( trap.msg->str );
+      ps_reset( ps );
+    }
+
+  ps->mrb->ud = ud;
+  mucgly_set_trap( prev );
+  g_string_free( trap.msg, TRUE );
+
+  return msg;
+}
+
+
+/**
+ * ps_trap function for file processing.
+ *
+ * @param ps   Pstate.
+ * @param data Arguments.
+ */
+void ps_process_file_func( pstate_t* ps, gpointer data )
+{
+  ps_trap_args_t* args = data;
+  ps_process_file( ps, args->infile, g_strdup( args->outfile ) );
+}
+
+
+/**
+ * ps_trap function for String processing.
+ *
+ * @param ps   Pstate.
+ * @param data Arguments.
+ */
+void ps_process_str_func( pstate_t* ps, gpointer data )
+{
+  ps_trap_args_t* args = data;
+  args->ret = ps_process_str( ps, args->src, args->len );
+}
+
+
+/**
+ * Process input file with errors trapped (see ps_trap).
+ *
+ * @param ps      Pstate.
+ * @param infile  Input file name.
+ * @param outfile Output file name (or NULL).
+ *
+ * @return Error message (or NULL on success).
+ */
+gchar* ps_process_trap( pstate_t* ps, gchar* infile, gchar* outfile )
+{
+  ps_trap_args_t args;
+
+  args.infile = infile;
+  args.outfile = outfile;
+
+  return ps_trap( ps, ps_process_file_func, &args );
+}
+
+
+/**
+ * Process Ruby String with errors trapped (see ps_trap).
+ *
+ * @param ps  Pstate.
+ * @param src Input.
+ * @param len Input length.
+ * @param ret Output (Ruby String).
+ *
+ * @return Error message (or NULL on success).
+ */
+gchar* ps_process_str_trap( pstate_t* ps, const gchar* src, gsize len, mrb_value* ret )
+{
+  ps_trap_args_t args;
+  gchar* msg;
+
+  args.src = src;
+  args.len = len;
+  args.ret = mrb_nil_value();
+
+  msg = ps_trap( ps, ps_process_str_func, &args );
+  *ret = args.ret;
+
+  return msg;
+}
+
+
+/* ------------------------------------------------------------
+ * Mucgly statistics:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Free call site stats.
+ *
+ * @param data Call site.
+ */
+static void stats_site_rem( gpointer data )
+{
+  stats_site_t* site = data;
+  g_free( site->filename );
+  g_free( site );
+}
+
+
+/**
+ * Create new Stats with zero counters.
+ *
+ * @return Stats.
+ */
+stats_t* stats_new( void )
+{
+  stats_t* st;
+
+  st = g_new0( stats_t, 1 );
+  st->sites = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, stats_site_rem );
+  st->key = g_string_sized_new( 0 );
+
+  return st;
+}
+
+
+/**
+ * Free Stats.
+ *
+ * @param st Stats.
+ */
+void stats_rem( stats_t* st )
+{
+  g_hash_table_destroy( st->sites );
+  g_string_free( st->key, TRUE );
+  g_free( st );
+}
+
+
+/**
+ * Return type of macro.
+ *
+ * @param cmd Macro content.
+ *
+ * @return Macro type.
+ */
+stats_macro_t stats_macro_type( const gchar* cmd )
+{
+  if ( cmd[0] == '+' )
+    cmd++;
+
+  switch ( cmd[0] )
+    {
+    case ':': return stats_cmd;
+    case '.': return stats_var;
+    case '#': return stats_postpone;
+    case '/': return stats_comment;
+    default: return stats_ruby;
+    }
+}
+
+
+/**
+ * Account evaluated macro to its type and call site.
+ *
+ * @param st    Stats.
+ * @param sf    Stackfile of macro.
+ * @param type  Macro type.
+ * @param usecs Evaluation time.
+ */
+void stats_macro( stats_t* st, stackfile_t* sf, stats_macro_t type, gint64 usecs )
+{
+  stats_site_t* site;
+
+  st->macros[ type ]++;
+
+  g_string_printf( st->key, "%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                   sf->filename, sf->macro_line+1, sf->macro_col+1 );
+  site = g_hash_table_lookup( st->sites, st->key->str );
+
+  if ( site == NULL )
+    {
+      site = g_new0( stats_site_t, 1 );
+      site->filename = g_strdup( sf->filename );
+      site->line = sf->macro_line;
+      site->col = sf->macro_col;
+      g_hash_table_insert( st->sites, g_strdup( st->key->str ), site );
+    }
+
+  site->count++;
+  site->usecs += usecs;
+}
+
+
+/**
+ * Append string to JSON as JSON string.
+ *
+ * @param json JSON.
+ * @param str  String.
+ */
+void stats_json_str( GString* json, const gchar* str )
+{
+  g_string_append_c( json, '"' );
+
+  for ( const guchar* c = (const guchar*) str; *c; c++ )
+    {
+      if ( *c == '"' || *c == '\\' )
+        {
+          g_string_append_c( json, '\\' );
+          g_string_append_c( json, *c );
+        }
+      else if ( *c < 0x20 )
+        g_string_append_printf( json, "\\u%04x", *c );
+      else
+        g_string_append_c( json, *c );
+    }
+
+  g_string_append_c( json, '"' );
+}
+
+
+/**
+ * Order call sites by total time, slowest first.
+ *
+ * @param a Call site pointer.
+ * @param b Call site pointer.
+ *
+ * @return Sort order.
+ */
+gint stats_site_cmp( gconstpointer a, gconstpointer b )
+{
+  const stats_site_t* sa = *(stats_site_t* const*) a;
+  const stats_site_t* sb = *(stats_site_t* const*) b;
+
+  if ( sa->usecs != sb->usecs )
+    return ( sa->usecs > sb->usecs ) ? -1 : 1;
+  else
+    return ( sa->count > sb->count ) ? -1 : ( sa->count < sb->count );
+}
+
+
+/**
+ * Format Pstate stats as JSON (one line). Ruby time excludes nested
+ * processing, which is reported separately. Process-wide counters
+ * are reported in the global summary (see stats_report_global).
+ *
+ * @param ps Pstate (with stats enabled).
+ *
+ * @return JSON (to be freed by caller).
+ */
+gchar* stats_json( pstate_t* ps )
+{
+  stats_t* st = ps->stats;
+  GString* json;
+  GPtrArray* sites;
+  GHashTableIter iter;
+  gpointer site;
+  gint64 ruby;
+
+  json = g_string_sized_new( 1024 );
+
+  g_string_append_printf( json,
+                          "{\"bytes_in\":%" G_GINT64_FORMAT
+                          ",\"bytes_out\":%" G_GINT64_FORMAT
+                          ",\"hook_checks\":%" G_GINT64_FORMAT
+                          ",\"hook_misses\":%" G_GINT64_FORMAT,
+                          st->bytes_in, st->bytes_out,
+                          st->hook_checks, st->hook_misses );
+
+  g_string_append( json, ",\"macros\":{" );
+  for ( int i = 0; i < stats_macro_cnt; i++ )
+    g_string_append_printf( json, "%s\"%s\":%" G_GINT64_FORMAT,
+                            i ? "," : "", stats_macro_names[i], st->macros[i] );
+  g_string_append_c( json, '}' );
+
+  ruby = st->ruby_usecs - st->nested_usecs;
+  g_string_append_printf( json,
+                          ",\"time_us\":{\"total\":%" G_GINT64_FORMAT
+                          ",\"ruby\":%" G_GINT64_FORMAT
+                          ",\"nested\":%" G_GINT64_FORMAT
+                          ",\"scan\":%" G_GINT64_FORMAT "}",
+                          st->total_usecs, ruby, st->nested_usecs,
+                          st->total_usecs - ruby );
+
+  g_string_append_printf( json,
+                          ",\"memory\":{\"maxrss_kb\":%" G_GINT64_FORMAT
+                          ",\"full_gcs\":%" G_GINT64_FORMAT "}",
+                          mucgly_maxrss(), st->full_gcs );
+
+  g_string_append_printf( json,
+                          ",\"rcache\":{\"hits\":%" G_GINT64_FORMAT
+                          ",\"misses\":%" G_GINT64_FORMAT "}",
+                          (gint64) ps->rcache->hits, (gint64) ps->rcache->misses );
+
+  /* Slowest macro call sites. */
+  sites = g_ptr_array_new();
+  g_hash_table_iter_init( &iter, st->sites );
+  while ( g_hash_table_iter_next( &iter, NULL, &site ) )
+    g_ptr_array_add( sites, site );
+  g_ptr_array_sort( sites, stats_site_cmp );
+
+  g_string_append( json, ",\"top\":[" );
+  for ( guint i = 0; i < sites->len && i < STATS_TOP; i++ )
+    {
+      stats_site_t* s = g_ptr_array_index( sites, i );
+
+      g_string_append( json, i ? ",{\"file\":" : "{\"file\":" );
+      stats_json_str( json, s->filename );
+      g_string_append_printf( json,
+                              ",\"line\":%" G_GINT64_FORMAT ",\"col\":%" G_GINT64_FORMAT
+                              ",\"count\":%" G_GINT64_FORMAT
+                              ",\"time_us\":%" G_GINT64_FORMAT "}",
+                              s->line+1, s->col+1, s->count, s->usecs );
+    }
+  g_string_append( json, "]}" );
+
+  g_ptr_array_free( sites, TRUE );
+
+  return g_string_free( json, FALSE );
+}
+
+
+/**
+ * Write stats report line. Destination "-" is stderr, otherwise the
+ * report is appended to the file.
+ *
+ * @param dest Destination (MUCGLY_STATS value).
+ * @param json Report.
+ */
+void stats_write( const gchar* dest, const gchar* json )
+{
+  g_mutex_lock( &stats_lock );
+
+  if ( !strcmp( dest, "-" ) )
+    {
+      fprintf( stderr, "%s\n", json );
+    }
+  else
+    {
+      FILE* fh = fopen( dest, "a" );
+      if ( fh )
+        {
+          fprintf( fh, "%s\n", json );
+          fclose( fh );
+        }
+      else
+        {
+          mucgly_warn( NULL, "Could not open stats file \"%s\"...", dest );
+        }
+    }
+
+  g_mutex_unlock( &stats_lock );
+}
+
+
+/**
+ * Report process-wide stats at exit, after all Pstate reports.
+ */
+void stats_report_global( void )
+{
+  const gchar* env = g_getenv( "MUCGLY_STATS" );
+  gint64 fhits, fmisses;
+  int fsize;
+  gchar* json;
+
+  if ( !env || !env[0] || !strcmp( env, "0" ) )
+    return;
+
+  fcache_stats( &fhits, &fmisses, &fsize );
+  json = g_strdup_printf( "{\"global\":{\"fcache\":{\"hits\":%" G_GINT64_FORMAT
+                          ",\"misses\":%" G_GINT64_FORMAT
+                          ",\"size\":%d}}}",
+                          fhits, fmisses, fsize );
+  stats_write( env, json );
+  g_free( json );
+}
+
+
+/**
+ * Report Pstate stats as requested by MUCGLY_STATS. Value "-" reports
+ * to stderr, otherwise the value is a file where the report is
+ * appended as one line. Global summary is reported at exit.
+ *
+ * @param ps Pstate.
+ */
+void stats_report( pstate_t* ps )
+{
+  static gboolean at_exit = FALSE;
+  const gchar* env = g_getenv( "MUCGLY_STATS" );
+  gchar* json;
+
+  if ( !ps->stats || !env || !env[0] || !strcmp( env, "0" ) )
+    return;
+
+  g_mutex_lock( &stats_lock );
+  if ( !at_exit )
+    {
+      at_exit = TRUE;
+      atexit( stats_report_global );
+    }
+  g_mutex_unlock( &stats_lock );
+
+  json = stats_json( ps );
+  stats_write( env, json );
+  g_free( json );
+}
+
+
+/* ------------------------------------------------------------
+ * Mucgly tracing:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Get trace thread id of current thread. Threads are numbered in the
+ * order of their first event.
+ *
+ * @return Thread id.
+ */
+int trace_tid( void )
+{
+  int tid = GPOINTER_TO_INT( g_private_get( &trace_tid_key ) );
+
+  if ( tid == 0 )
+    {
+      tid = g_atomic_int_add( &trace_tids, 1 ) + 1;
+      g_private_set( &trace_tid_key, GINT_TO_POINTER( tid ) );
+    }
+
+  return tid;
+}
+
+
+/**
+ * Open trace file. Events are written in Chrome trace-event format
+ * (JSON array), which is viewed with Perfetto or chrome://tracing.
+ * Previous trace file is closed.
+ *
+ * @param filename Trace file (or NULL to disable tracing).
+ *
+ * @return TRUE if tracing is enabled.
+ */
+gboolean trace_open( const gchar* filename )
+{
+  static gboolean at_exit = FALSE;
+  FILE* fh = NULL;
+
+  trace_close();
+
+  if ( filename == NULL )
+    return FALSE;
+
+  fh = fopen( filename, "w" );
+  if ( fh == NULL )
+    {
+      mucgly_warn( NULL, "Could not open trace file \"%s\"...", filename );
+      return FALSE;
+    }
+
+  g_mutex_lock( &trace_lock );
+
+  if ( !at_exit )
+    {
+      at_exit = TRUE;
+      atexit( trace_close );
+    }
+
+  fputs( "[\n", fh );
+  trace_t0 = g_get_monotonic_time();
+  trace_first = TRUE;
+  trace_fh = fh;
+
+  g_mutex_unlock( &trace_lock );
+
+  return TRUE;
+}
+
+
+/**
+ * Complete and close trace file (if any).
+ */
+void trace_close( void )
+{
+  g_mutex_lock( &trace_lock );
+
+  if ( trace_fh )
+    {
+      fputs( "\n]\n", trace_fh );
+      fclose( trace_fh );
+      trace_fh = NULL;
+    }
+
+  g_mutex_unlock( &trace_lock );
+}
+
+
+/**
+ * Start trace event with the common fields.
+ *
+ * @param ev   Event buffer.
+ * @param ph   Event phase.
+ * @param cat  Event category.
+ * @param name Event name.
+ * @param ts   Event time (monotonic usecs).
+ */
+void trace_begin( GString* ev, const gchar* ph, const gchar* cat,
+                  const gchar* name, gint64 ts )
+{
+  g_string_append( ev, "{\"name\":" );
+  stats_json_str( ev, name );
+  g_string_append_printf( ev,
+                          ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+                          ",\"pid\":%d,\"tid\":%d",
+                          cat, ph, ts - trace_t0, (int) getpid(), trace_tid() );
+}
+
+
+/**
+ * Complete trace event and write it to trace file.
+ *
+ * @param ev Event buffer (freed).
+ */
+void trace_write( GString* ev )
+{
+  g_string_append_c( ev, '}' );
+
+  g_mutex_lock( &trace_lock );
+
+  /* Tracing may be disabled meanwhile. */
+  if ( trace_fh )
+    {
+      if ( !trace_first )
+        fputs( ",\n", trace_fh );
+      trace_first = FALSE;
+      fputs( ev->str, trace_fh );
+    }
+
+  g_mutex_unlock( &trace_lock );
+
+  g_string_free( ev, TRUE );
+}
+
+
+/**
+ * Copy beginning of macro content for trace event. Copy is cut at
+ * UTF-8 char boundary.
+ *
+ * @param body Copy (TRACE_BODY_MAX+1 chars).
+ * @param str  Macro content.
+ */
+void trace_body( gchar* body, const gchar* str )
+{
+  gsize len = strlen( str );
+
+  if ( len > TRACE_BODY_MAX )
+    {
+      len = TRACE_BODY_MAX;
+      while ( len > 0 && ( (guchar) str[ len ] & 0xC0 ) == 0x80 )
+        len--;
+    }
+
+  memcpy( body, str, len );
+  body[ len ] = 0;
+}
+
+
+/**
+ * Trace evaluated macro as complete event. Event is named by macro
+ * type, and it has the macro position and content start as args.
+ *
+ * @param sf   Stackfile of macro.
+ * @param type Macro type.
+ * @param body Macro content start (see trace_body).
+ * @param t0   Evaluation start time.
+ */
+void trace_macro( stackfile_t* sf, stats_macro_t type, const gchar* body, gint64 t0 )
+{
+  GString* ev = g_string_sized_new( 256 );
+
+  trace_begin( ev, "X", "macro", stats_macro_names[ type ], t0 );
+  g_string_append_printf( ev, ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{\"file\":",
+                          g_get_monotonic_time() - t0 );
+  stats_json_str( ev, sf->filename ? sf->filename : "<STRING>" );
+  g_string_append_printf( ev, ",\"line\":%" G_GINT64_FORMAT ",\"col\":%" G_GINT64_FORMAT ",\"body\":",
+                          sf->macro_line+1, sf->macro_col+1 );
+  stats_json_str( ev, body );
+  g_string_append_c( ev, '}' );
+
+  trace_write( ev );
+}
+
+
+/**
+ * Trace input or output stream push or pop as async event, so that
+ * the stream lifetime is shown as a span.
+ *
+ * @param ph   "b" for push, "e" for pop.
+ * @param cat  "input" or "output".
+ * @param name Stream name.
+ * @param id   Stream.
+ */
+void trace_stream( const gchar* ph, const gchar* cat, const gchar* name, gconstpointer id )
+{
+  GString* ev = g_string_sized_new( 128 );
+
+  trace_begin( ev, ph, cat, name, g_get_monotonic_time() );
+  g_string_append_printf( ev, ",\"id\":\"%p\"", id );
+
+  trace_write( ev );
+}
+
+
+
+/* ------------------------------------------------------------
+ * Mucgly precompiled templates:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Create Mcgc recorder.
+ *
+ * @param filename Input file name.
+ *
+ * @return Mcgc.
+ */
+mcgc_t* mcgc_new( const gchar* filename )
+{
+  mcgc_t* mc;
+
+  mc = g_new0( mcgc_t, 1 );
+  mc->filename = g_strdup( filename );
+  mc->deps = g_ptr_array_new_with_free_func( g_free );
+  mc->ev = g_string_sized_new( 0 );
+  mc->lit = 0;
+  mc->mute = 0;
+
+  return mc;
+}
+
+
+/**
+ * Free Mcgc recorder.
+ *
+ * @param mc Mcgc.
+ */
+void mcgc_rem( mcgc_t* mc )
+{
+  g_free( mc->filename );
+  g_ptr_array_free( mc->deps, TRUE );
+  g_string_free( mc->ev, TRUE );
+  g_free( mc );
+}
+
+
+/**
+ * Append byte to template data.
+ *
+ * @param buf Template data.
+ * @param val Value.
+ */
+void mcgc_put_u8( GString* buf, guint8 val )
+{
+  g_string_append_c( buf, (gchar) val );
+}
+
+
+/**
+ * Append 64-bit value to template data. Native byte order is used,
+ * i.e. templates are not portable between hosts.
+ *
+ * @param buf Template data.
+ * @param val Value.
+ */
+void mcgc_put_u64( GString* buf, guint64 val )
+{
+  g_string_append_len( buf, (gchar*) &val, sizeof( val ) );
+}
+
+
+/**
+ * Append length prefixed string to template data.
+ *
+ * @param buf Template data.
+ * @param str String.
+ * @param len String length (including possible terminator).
+ */
+void mcgc_put_str( GString* buf, const gchar* str, gsize len )
+{
+  mcgc_put_u64( buf, len );
+  g_string_append_len( buf, str, len );
+}
+
+
+/**
+ * Record literal output. Consecutive literals are joined to one
+ * event.
+ *
+ * @param mc  Mcgc.
+ * @param str Output.
+ * @param len Output length.
+ */
+void mcgc_rec_lit( mcgc_t* mc, const gchar* str, gsize len )
+{
+  guint64 cnt;
+
+  if ( mc->mute || len == 0 )
+    return;
+
+  if ( mc->lit == 0 )
+    {
+      /* Open new literal event. */
+      mcgc_put_u8( mc->ev, mcgc_lit );
+      mc->lit = mc->ev->len;
+      mcgc_put_u64( mc->ev, 0 );
+    }
+
+  g_string_append_len( mc->ev, str, len );
+
+  memcpy( &cnt, &mc->ev->str[ mc->lit ], sizeof( cnt ) );
+  cnt += len;
+  memcpy( &mc->ev->str[ mc->lit ], &cnt, sizeof( cnt ) );
+}
+
+
+/**
+ * Record event type with macro position.
+ *
+ * @param mc Mcgc.
+ * @param ev Event type.
+ * @param sf Current Stackfile.
+ */
+void mcgc_rec_pos( mcgc_t* mc, mcgc_ev_t ev, stackfile_t* sf )
+{
+  mc->lit = 0;
+  mcgc_put_u8( mc->ev, ev );
+  mcgc_put_u64( mc->ev, sf_line( sf ) );
+  mcgc_put_u64( mc->ev, sf->macro_line );
+  mcgc_put_u64( mc->ev, sf->macro_col );
+}
+
+
+/**
+ * Record Ruby macro. Compiled code is stored as mruby bytecode, so
+ * that replay doesn't need to parse the macro body.
+ *
+ * @param mc     Mcgc.
+ * @param mrb    MRuby.
+ * @param sf     Current Stackfile.
+ * @param body   Macro body.
+ * @param to_str Macro result is output.
+ * @param proc   Compiled macro (or NULL if not available).
+ */
+void mcgc_rec_ruby( mcgc_t* mc, mrb_state* mrb, stackfile_t* sf, const gchar* body,
+                    gboolean to_str, struct RProc* proc )
+{
+  uint8_t* bin = NULL;
+  size_t bin_size = 0;
+
+  if ( proc == NULL )
+    /* Not cached. */
+    proc = rcache_compile( mrb, body );
+
+  if ( proc
+       && mrb_dump_irep( mrb, (mrb_irep*) proc->body.irep, MRB_DUMP_DEBUG_INFO,
+                         &bin, &bin_size ) != MRB_DUMP_OK )
+    {
+      bin = NULL;
+      bin_size = 0;
+    }
+
+  mcgc_rec_pos( mc, mcgc_ruby, sf );
+  mcgc_put_u8( mc->ev, to_str );
+  mcgc_put_str( mc->ev, body, strlen( body ) + 1 );
+
+  /* Empty code for syntax errors, reported again at replay. */
+  mcgc_put_str( mc->ev, (gchar*) bin, bin_size );
+
+  if ( bin )
+    mrb_free( mrb, bin );
+}
+
+
+/**
+ * Record internal command.
+ *
+ * @param mc  Mcgc.
+ * @param sf  Current Stackfile.
+ * @param cmd Command (with leading colon).
+ */
+void mcgc_rec_cmd( mcgc_t* mc, stackfile_t* sf, const gchar* cmd )
+{
+  mcgc_rec_pos( mc, mcgc_cmd, sf );
+  mcgc_put_str( mc->ev, cmd, strlen( cmd ) + 1 );
+}
+
+
+/**
+ * Record end of current input file.
+ *
+ * @param mc Mcgc.
+ */
+void mcgc_rec_pop( mcgc_t* mc )
+{
+  mc->lit = 0;
+  mcgc_put_u8( mc->ev, mcgc_pop );
+}
+
+
+/**
+ * Record input file as dependency of template.
+ *
+ * @param mc       Mcgc.
+ * @param filename Input file name.
+ */
+void mcgc_rec_dep( mcgc_t* mc, const gchar* filename )
+{
+  for ( guint i = 0; i < mc->deps->len; i++ )
+    {
+      if ( !strcmp( g_ptr_array_index( mc->deps, i ), filename ) )
+        return;
+    }
+
+  g_ptr_array_add( mc->deps, g_strdup( filename ) );
+}
+
+
+/**
+ * Calculate SHA-1 of file content.
+ *
+ * @param filename File name.
+ *
+ * @return Checksum as hex string (or NULL if file is not readable).
+ */
+gchar* mcgc_file_sha1( const gchar* filename )
+{
+  GMappedFile* map;
+  gchar* sum;
+
+  map = g_mapped_file_new( filename, FALSE, NULL );
+  if ( map == NULL )
+    return NULL;
+
+  sum = g_compute_checksum_for_data( G_CHECKSUM_SHA1,
+                                     (guchar*) g_mapped_file_get_contents( map ),
+                                     g_mapped_file_get_length( map ) );
+  g_mapped_file_unref( map );
+
+  return sum;
+}
+
+
+/**
+ * Save recorded template next to the input file. Template is
+ * replaced atomically. Failure to save is not an error, the input is
+ * just processed again next time.
+ *
+ * @param mc Mcgc.
+ */
+void mcgc_save( mcgc_t* mc )
+{
+  GString* buf;
+  gchar* name;
+
+  buf = g_string_sized_new( mc->ev->len + 1024 );
+
+  g_string_append_len( buf, MCGC_MAGIC, strlen( MCGC_MAGIC ) );
+  mcgc_put_u64( buf, MCGC_VERSION );
+
+  /* Dependencies with signatures. */
+  mcgc_put_u64( buf, mc->deps->len );
+  for ( guint i = 0; i < mc->deps->len; i++ )
+    {
+      gchar* dep = g_ptr_array_index( mc->deps, i );
+      GStatBuf st;
+      gchar* sum;
+
+      if ( g_stat( dep, &st ) != 0
+           || ( sum = mcgc_file_sha1( dep ) ) == NULL )
+        {
+          g_string_free( buf, TRUE );
+          return;
+        }
+
+      mcgc_put_str( buf, dep, strlen( dep ) + 1 );
+      mcgc_put_u64( buf, st.st_size );
+      mcgc_put_u64( buf, mucgly_mtime_ns( &st ) );
+      mcgc_put_str( buf, sum, strlen( sum ) + 1 );
+      g_free( sum );
+    }
+
+  g_string_append_len( buf, mc->ev->str, mc->ev->len );
+  mcgc_put_u8( buf, mcgc_end );
+
+  name = g_strconcat( mc->filename, MCGC_SUFFIX, NULL );
+  g_file_set_contents( name, buf->str, buf->len, NULL );
+  g_free( name );
+
+  g_string_free( buf, TRUE );
+}
+
+
+/**
+ * Read byte from template.
+ *
+ * @param rd Template reader.
+ *
+ * @return Value (0 at data end).
+ */
+guint8 mcgc_get_u8( mcgc_rd_t* rd )
+{
+  if ( rd->pos >= rd->end )
+    {
+      rd->err = TRUE;
+      return 0;
+    }
+
+  return (guint8) *rd->pos++;
+}
+
+
+/**
+ * Read 64-bit value from template.
+ *
+ * @param rd Template reader.
+ *
+ * @return Value (0 at data end).
+ */
+guint64 mcgc_get_u64( mcgc_rd_t* rd )
+{
+  guint64 val;
+
+  if ( rd->end - rd->pos < (gssize) sizeof( val ) )
+    {
+      rd->err = TRUE;
+      rd->pos = rd->end;
+      return 0;
+    }
+
+  memcpy( &val, rd->pos, sizeof( val ) );
+  rd->pos += sizeof( val );
+
+  return val;
+}
+
+
+/**
+ * Read length prefixed string from template. String is referenced in
+ * place.
+ *
+ * @param rd  Template reader.
+ * @param len String length (including terminator if stored).
+ *
+ * @return String (or NULL at data end).
+ */
+const gchar* mcgc_get_str( mcgc_rd_t* rd, gsize* len )
+{
+  const gchar* str;
+  guint64 n;
+
+  n = mcgc_get_u64( rd );
+
+  if ( rd->err || n > (guint64) ( rd->end - rd->pos ) )
+    {
+      rd->err = TRUE;
+      rd->pos = rd->end;
+      *len = 0;
+      return NULL;
+    }
+
+  str = rd->pos;
+  rd->pos += n;
+  *len = n;
+
+  return str;
+}
+
+
+/**
+ * Read macro position and restore it to Stackfile.
+ *
+ * @param rd Template reader.
+ * @param sf Current Stackfile.
+ */
+void mcgc_get_pos( mcgc_rd_t* rd, stackfile_t* sf )
+{
+  sf_set_position( sf, mcgc_get_u64( rd ), 0 );
+  sf->macro_line = mcgc_get_u64( rd );
+  sf->macro_col = mcgc_get_u64( rd );
+  sf->macro = TRUE;
+}
+
+
+/**
+ * Get modification time of file with nanosecond resolution.
+ *
+ * @param st File status.
+ *
+ * @return Modification time in nanoseconds.
+ */
+gint64 mucgly_mtime_ns( const GStatBuf* st )
+{
+  return (gint64) st->st_mtim.tv_sec * G_GINT64_CONSTANT( 1000000000 ) + st->st_mtim.tv_nsec;
+}
+
+
+/**
+ * Check that dependency is unchanged. Modification time is trusted
+ * only if it is older than the record, since a file may be rewritten
+ * within the same timestamp tick (same size, same mtime). Otherwise
+ * content checksum is compared.
+ *
+ * @param filename File name.
+ * @param size     Recorded size.
+ * @param mtime    Recorded modification time (ns).
+ * @param sha1     Recorded checksum.
+ * @param stamp    Modification time of the record (ns).
+ *
+ * @return TRUE if unchanged.
+ */
+gboolean mcgc_check_dep( const gchar* filename, guint64 size, gint64 mtime,
+                         const gchar* sha1, gint64 stamp )
+{
+  GStatBuf st;
+  gchar* sum;
+  gboolean ok;
+
+  if ( g_stat( filename, &st ) != 0 )
+    return FALSE;
+
+  if ( (guint64) st.st_size != size )
+    return FALSE;
+
+  if ( mucgly_mtime_ns( &st ) == mtime && mtime < stamp )
+    return TRUE;
+
+  sum = mcgc_file_sha1( filename );
+  ok = ( sum && !strcmp( sum, sha1 ) );
+  g_free( sum );
+
+  return ok;
+}
+
+
+/**
+ * Read template header and check its validity. Reader is left at the
+ * first event.
+ *
+ * @param rd       Template reader.
+ * @param filename Input file name.
+ * @param stamp    Modification time of template (ns).
+ *
+ * @return TRUE if template is valid for input.
+ */
+gboolean mcgc_check( mcgc_rd_t* rd, const gchar* filename, gint64 stamp )
+{
+  gsize len;
+  guint64 cnt;
+
+  len = strlen( MCGC_MAGIC );
+  if ( (gsize) ( rd->end - rd->pos ) < len
+       || memcmp( rd->pos, MCGC_MAGIC, len ) )
+    return FALSE;
+  rd->pos += len;
+
+  /* Version mismatch includes byte order mismatch. */
+  if ( mcgc_get_u64( rd ) != MCGC_VERSION )
+    return FALSE;
+
+  cnt = mcgc_get_u64( rd );
+
+  for ( guint64 i = 0; i < cnt; i++ )
+    {
+      const gchar* dep;
+      const gchar* sum;
+      gsize dep_len, sum_len;
+      guint64 size;
+      gint64 mtime;
+
+      dep = mcgc_get_str( rd, &dep_len );
+      size = mcgc_get_u64( rd );
+      mtime = mcgc_get_u64( rd );
+      sum = mcgc_get_str( rd, &sum_len );
+
+      /* Strings are stored with terminator. */
+      if ( rd->err
+           || dep_len == 0 || dep[ dep_len - 1 ] != 0
+           || sum_len == 0 || sum[ sum_len - 1 ] != 0 )
+        return FALSE;
+
+      /* First dependency is the input itself. */
+      if ( i == 0 && strcmp( dep, filename ) )
+        return FALSE;
+
+      if ( !mcgc_check_dep( dep, size, mtime, sum, stamp ) )
+        return FALSE;
+    }
+
+  return ( cnt > 0 && !rd->err );
+}
+
+
+/**
+ * Check that template events are complete and well formed, before
+ * any output is produced from them. Reader is not advanced.
+ *
+ * @param rd Template reader (at the first event).
+ *
+ * @return TRUE if events are valid.
+ */
+gboolean mcgc_validate( mcgc_rd_t* rd )
+{
+  mcgc_rd_t chk;
+  const gchar* str;
+  gsize len;
+  guint8 ev;
+
+  chk = *rd;
+
+  while ( ( ev = mcgc_get_u8( &chk ) ) != mcgc_end && !chk.err )
+    {
+      switch ( ev )
+        {
+
+        case mcgc_lit:
+          mcgc_get_str( &chk, &len );
+          break;
+
+        case mcgc_ruby:
+        case mcgc_cmd:
+          /* Position: offset, line, column. */
+          for ( int i = 0; i < 3; i++ )
+            mcgc_get_u64( &chk );
+          if ( ev == mcgc_ruby )
+            mcgc_get_u8( &chk );
+          str = mcgc_get_str( &chk, &len );
+          if ( !chk.err && ( len == 0 || str[ len - 1 ] != 0 ) )
+            chk.err = TRUE;
+          if ( ev == mcgc_ruby )
+            mcgc_get_str( &chk, &len );
+          break;
+
+        case mcgc_pop:
+          break;
+
+        default:
+          chk.err = TRUE;
+          break;
+        }
+    }
+
+  return !chk.err;
+}
+
+
+/**
+ * Load compiled macro from mruby bytecode. Bytecode size in header
+ * is checked against the data length, and reading is bounded by the
+ * length.
+ *
+ * @param mrb MRuby.
+ * @param bin Bytecode.
+ * @param len Bytecode length.
+ *
+ * @return Compiled macro (or NULL on failure).
+ */
+struct RProc* mcgc_load_irep( mrb_state* mrb, const gchar* bin, gsize len )
+{
+  const struct rite_binary_header* hdr;
+  mrb_irep* irep;
+  struct RProc* proc;
+
+  hdr = (const struct rite_binary_header*) bin;
+  if ( len < sizeof( *hdr )
+       || bin_to_uint32( hdr->binary_size ) < sizeof( *hdr )
+       || bin_to_uint32( hdr->binary_size ) > len )
+    return NULL;
+
+  irep = mrb_read_irep_buf( mrb, bin, len );
+  if ( irep == NULL )
+    return NULL;
+
+  proc = mrb_proc_new( mrb, irep );
+  mrb_irep_decref( mrb, irep );
+#ifdef MRB_PROC_SET_TARGET_CLASS
+  MRB_PROC_SET_TARGET_CLASS( proc, mrb->object_class );
+#endif
+
+  return proc;
+}
+
+
+/**
+ * Replay precompiled template of input file, if template exists and
+ * none of its input files have changed. Ruby macros and internal
+ * commands are re-executed, but input files are not read. Corrupted
+ * template is removed and input is processed normally.
+ *
+ * @param ps      Pstate.
+ * @param infile  Input file name.
+ * @param outfile Output file name (or NULL). Outfile string is freed
+ *                if template is replayed.
+ *
+ * @return TRUE if template was replayed.
+ */
+gboolean ps_replay_file( pstate_t* ps, gchar* infile, gchar* outfile )
+{
+  GMappedFile* map;
+  mcgc_rd_t rd;
+  gchar* name;
+  GStatBuf st;
+  gboolean do_break = FALSE;
+  guint8 ev;
+
+  name = g_strconcat( infile, MCGC_SUFFIX, NULL );
+  map = NULL;
+  if ( g_stat( name, &st ) == 0 )
+    map = g_mapped_file_new( name, FALSE, NULL );
+
+  if ( map == NULL )
+    {
+      g_free( name );
+      return FALSE;
+    }
+
+  rd.pos = g_mapped_file_get_contents( map );
+  rd.end = rd.pos + g_mapped_file_get_length( map );
+  rd.err = FALSE;
+
+  if ( !mcgc_check( &rd, infile, mucgly_mtime_ns( &st ) ) )
+    {
+      g_mapped_file_unref( map );
+      g_free( name );
+      return FALSE;
+    }
+
+  if ( !mcgc_validate( &rd ) )
+    {
+      /* Drop corrupted template, input is processed (and recorded)
+         normally instead. */
+      g_mapped_file_unref( map );
+      g_unlink( name );
+      g_free( name );
+      return FALSE;
+    }
+
+  ps->fs->replay = TRUE;
+  fs_push_file( ps->fs, infile );
+
+  if ( outfile )
+    {
+      ps_push_file( ps, outfile );
+      g_free( outfile );
+    }
+
+  while ( !do_break
+          && ( ev = mcgc_get_u8( &rd ) ) != mcgc_end
+          && !rd.err )
+    {
+      const gchar* str;
+      const gchar* bin;
+      gsize len, bin_len;
+      gboolean to_str;
+      struct RProc* proc;
+      mrb_value val;
+      int ai;
+
+      if ( !ps_has_file( ps ) )
+        {
+          rd.err = TRUE;
+          break;
+        }
+
+      switch ( ev )
+        {
+
+        case mcgc_lit:
+          str = mcgc_get_str( &rd, &len );
+          if ( !rd.err )
+            ps_out_n( ps, str, len );
+          break;
+
+        case mcgc_ruby:
+          mcgc_get_pos( &rd, ps_topfile( ps ) );
+          to_str = mcgc_get_u8( &rd );
+          str = mcgc_get_str( &rd, &len );
+          bin = mcgc_get_str( &rd, &bin_len );
+          if ( rd.err || len == 0 )
+            break;
+
+          proc = rcache_find( ps->rcache, str );
+          if ( proc == NULL && bin_len > 0 )
+            {
+              proc = mcgc_load_irep( ps->mrb, bin, bin_len );
+              if ( proc )
+                rcache_insert( ps->rcache, ps->mrb, str, proc );
+            }
+
+          ai = mrb_gc_arena_save( ps->mrb );
+          if ( !( proc == NULL && to_str && ps_eval_var( ps, str, &val ) ) )
+            val = ps_eval_ruby_proc( ps, str, proc );
+          if ( to_str )
+            ps_out_value( ps, val );
+          mrb_gc_arena_restore( ps->mrb, ai );
+          ps_gc_macro( ps );
+
+          sf_unmark_macro( ps_topfile( ps ) );
+          ps_post_macro( ps );
+          break;
+
+        case mcgc_cmd:
+          mcgc_get_pos( &rd, ps_topfile( ps ) );
+          str = mcgc_get_str( &rd, &len );
+          if ( rd.err || len == 0 )
+            break;
+
+          g_string_assign( ps->macro_buf, str );
+          do_break = ps_eval_cmd( ps );
+
+          sf_unmark_macro( ps_topfile( ps ) );
+          ps_post_macro( ps );
+          break;
+
+        case mcgc_pop:
+          fs_pop_file( ps->fs );
+          break;
+
+        default:
+          rd.err = TRUE;
+          break;
+        }
+    }
+
+  ps->fs->replay = FALSE;
+
+  if ( rd.err )
+    {
+      /* Events are valid, but do not match the file stack. Output
+         is already partial, hence template is dropped for next run. */
+      g_unlink( name );
+      mucgly_error( NULL, "Inconsistent template \"%s\"", name );
+    }
+
+  if ( outfile )
+    ps_pop_file( ps );
+  else
+    outfile_flush( ps->output->data, FALSE );
+
+  g_mapped_file_unref( map );
+  g_free( name );
+
+  return TRUE;
+}
+
+
+
+/* ------------------------------------------------------------
+ * Mucgly dependency tracking:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Create Deps recorder.
+ *
+ * @param infile   Input file name.
+ * @param outfile  Output file name (or NULL).
+ * @param depfile  Makefile dependency file name (or NULL).
+ * @param manifest JSON manifest file name (or NULL).
+ *
+ * @return Deps.
+ */
+deps_t* deps_new( const gchar* infile, const gchar* outfile,
+                  const gchar* depfile, const gchar* manifest )
+{
+  deps_t* dp;
+
+  dp = g_new0( deps_t, 1 );
+  dp->infile = g_strdup( infile );
+  dp->depfile = g_strdup( depfile );
+  dp->manifest = g_strdup( manifest );
+  dp->inputs = g_ptr_array_new_with_free_func( g_free );
+  dp->sources = g_ptr_array_new_with_free_func( g_free );
+  dp->outputs = g_ptr_array_new_with_free_func( g_free );
+
+  /* Main files first. */
+  deps_add( dp->inputs, infile );
+  deps_add( dp->outputs, outfile );
+
+  return dp;
+}
+
+
+/**
+ * Free Deps recorder.
+ *
+ * @param dp Deps.
+ */
+void deps_rem( deps_t* dp )
+{
+  g_free( dp->infile );
+  g_free( dp->depfile );
+  g_free( dp->manifest );
+  g_ptr_array_free( dp->inputs, TRUE );
+  g_ptr_array_free( dp->sources, TRUE );
+  g_ptr_array_free( dp->outputs, TRUE );
+  g_free( dp );
+}
+
+
+/**
+ * Add file to dependency list (unless already listed).
+ *
+ * @param files    File list.
+ * @param filename File name (or NULL for none).
+ */
+void deps_add( GPtrArray* files, const gchar* filename )
+{
+  if ( filename == NULL )
+    return;
+
+  for ( guint i = 0; i < files->len; i++ )
+    {
+      if ( !strcmp( g_ptr_array_index( files, i ), filename ) )
+        return;
+    }
+
+  g_ptr_array_add( files, g_strdup( filename ) );
+}
+
+
+/**
+ * Append file name to Makefile rule. Spaces, '#' and '$' are
+ * escaped.
+ *
+ * @param buf  Rule.
+ * @param name File name.
+ */
+void deps_make_name( GString* buf, const gchar* name )
+{
+  g_string_append_c( buf, ' ' );
+
+  for ( const gchar* c = name; *c; c++ )
+    {
+      if ( *c == '$' )
+        g_string_append_c( buf, '$' );
+      else if ( *c == ' ' || *c == '\t' || *c == '#' )
+        g_string_append_c( buf, '\\' );
+      g_string_append_c( buf, *c );
+    }
+}
+
+
+/**
+ * Write Makefile dependency file. All outputs depend on all inputs
+ * and sourced Ruby files. Dependencies also get empty rules, so that
+ * removed files don't break make.
+ *
+ * @param dp Deps.
+ */
+void deps_write_depfile( deps_t* dp )
+{
+  GString* buf;
+  GPtrArray* lists[2] = { dp->inputs, dp->sources };
+
+  if ( dp->outputs->len == 0 )
+    return;
+
+  buf = g_string_sized_new( 1024 );
+
+  for ( guint i = 0; i < dp->outputs->len; i++ )
+    deps_make_name( buf, g_ptr_array_index( dp->outputs, i ) );
+  /* Drop the leading space. */
+  g_string_erase( buf, 0, 1 );
+  g_string_append_c( buf, ':' );
+
+  for ( int l = 0; l < 2; l++ )
+    for ( guint i = 0; i < lists[l]->len; i++ )
+      {
+        g_string_append( buf, " \\\n" );
+        deps_make_name( buf, g_ptr_array_index( lists[l], i ) );
+      }
+  g_string_append_c( buf, '\n' );
+
+  for ( int l = 0; l < 2; l++ )
+    for ( guint i = 0; i < lists[l]->len; i++ )
+      {
+        g_string_append_c( buf, '\n' );
+        deps_make_name( buf, g_ptr_array_index( lists[l], i ) );
+        g_string_append( buf, ":\n" );
+      }
+
+  if ( !g_file_set_contents( dp->depfile, buf->str, buf->len, NULL ) )
+    mucgly_warn( NULL, "Can't write dependency file \"%s\"", dp->depfile );
+
+  g_string_free( buf, TRUE );
+}
+
+
+/**
+ * Append file list with signatures to JSON manifest.
+ *
+ * @param json  Manifest.
+ * @param key   List name.
+ * @param files File list.
+ *
+ * @return TRUE if all files were readable.
+ */
+gboolean deps_json_files( GString* json, const gchar* key, GPtrArray* files )
+{
+  g_string_append_printf( json, ",\n  \"%s\": [", key );
+
+  for ( guint i = 0; i < files->len; i++ )
+    {
+      gchar* dep = g_ptr_array_index( files, i );
+      GStatBuf st;
+      gchar* sum;
+
+      if ( g_stat( dep, &st ) != 0
+           || ( sum = mcgc_file_sha1( dep ) ) == NULL )
+        return FALSE;
+
+      g_string_append( json, i ? ",\n    { \"file\": " : "\n    { \"file\": " );
+      stats_json_str( json, dep );
+      g_string_append_printf( json, ", \"size\": %" G_GINT64_FORMAT
+                              ", \"mtime\": %" G_GINT64_FORMAT ", \"sha1\": \"%s\" }",
+                              (gint64) st.st_size, mucgly_mtime_ns( &st ), sum );
+      g_free( sum );
+    }
+
+  g_string_append( json, files->len ? "\n  ]" : "]" );
+
+  return TRUE;
+}
+
+
+/**
+ * Save JSON manifest. Manifest is written only if all dependencies
+ * are readable, otherwise the next incremental run just processes
+ * the input again.
+ *
+ * @param dp Deps.
+ */
+void deps_save( deps_t* dp )
+{
+  GString* json;
+
+  json = g_string_sized_new( 1024 );
+
+  g_string_append( json, "{\n  \"infile\": " );
+  stats_json_str( json, dp->infile );
+
+  if ( deps_json_files( json, "inputs", dp->inputs )
+       && deps_json_files( json, "sources", dp->sources )
+       && deps_json_files( json, "outputs", dp->outputs ) )
+    {
+      g_string_append( json, "\n}\n" );
+
+      if ( !g_file_set_contents( dp->manifest, json->str, json->len, NULL ) )
+        mucgly_warn( NULL, "Can't write dependency manifest \"%s\"", dp->manifest );
+    }
+
+  g_string_free( json, TRUE );
+}
+
+
+/**
+ * Skip white space and consume expected char from JSON manifest.
+ *
+ * @param rd Manifest reader.
+ * @param c  Expected char.
+ *
+ * @return TRUE if char was found.
+ */
+gboolean deps_json_next( mcgc_rd_t* rd, gchar c )
+{
+  while ( rd->pos < rd->end && g_ascii_isspace( *rd->pos ) )
+    rd->pos++;
+
+  if ( rd->pos < rd->end && *rd->pos == c )
+    {
+      rd->pos++;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+
+/**
+ * Read JSON string from manifest.
+ *
+ * @param rd Manifest reader.
+ *
+ * @return String (or NULL on syntax error).
+ */
+gchar* deps_json_get_str( mcgc_rd_t* rd )
+{
+  GString* str;
+
+  if ( !deps_json_next( rd, '"' ) )
+    return NULL;
+
+  str = g_string_sized_new( 0 );
+
+  while ( rd->pos < rd->end && *rd->pos != '"' )
+    {
+      if ( *rd->pos == '\\' && rd->pos + 1 < rd->end )
+        {
+          rd->pos++;
+          if ( *rd->pos == 'u' && rd->pos + 4 < rd->end )
+            {
+              gchar hex[5] = { rd->pos[1], rd->pos[2], rd->pos[3], rd->pos[4], 0 };
+              g_string_append_unichar( str, strtoul( hex, NULL, 16 ) );
+              rd->pos += 5;
+              continue;
+            }
+          else if ( *rd->pos == 'n' )
+            g_string_append_c( str, '\n' );
+          else if ( *rd->pos == 't' )
+            g_string_append_c( str, '\t' );
+          else
+            g_string_append_c( str, *rd->pos );
+        }
+      else
+        {
+          g_string_append_c( str, *rd->pos );
+        }
+      rd->pos++;
+    }
+
+  if ( rd->pos >= rd->end )
+    {
+      g_string_free( str, TRUE );
+      return NULL;
+    }
+
+  rd->pos++;
+
+  return g_string_free( str, FALSE );
+}
+
+
+/**
+ * Read JSON integer from manifest.
+ *
+ * @param rd Manifest reader.
+ *
+ * @return Value (reader error is set on syntax error).
+ */
+gint64 deps_json_get_int( mcgc_rd_t* rd )
+{
+  gint64 val = 0;
+  gboolean neg;
+  const gchar* beg;
+
+  while ( rd->pos < rd->end && g_ascii_isspace( *rd->pos ) )
+    rd->pos++;
+  neg = deps_json_next( rd, '-' );
+  beg = rd->pos;
+
+  while ( rd->pos < rd->end && g_ascii_isdigit( *rd->pos ) )
+    val = val * 10 + ( *rd->pos++ - '0' );
+
+  if ( rd->pos == beg )
+    rd->err = TRUE;
+
+  return neg ? -val : val;
+}
+
+
+/**
+ * Check file list of JSON manifest. Each file must be unchanged (see
+ * mcgc_check_dep).
+ *
+ * @param rd    Manifest reader.
+ * @param first Expected first file (or NULL).
+ * @param stamp Modification time of manifest (ns).
+ *
+ * @return TRUE if list is valid and files are unchanged.
+ */
+gboolean deps_check_files( mcgc_rd_t* rd, const gchar* first, gint64 stamp )
+{
+  gboolean ok = TRUE;
+
+  if ( !deps_json_next( rd, '[' ) )
+    return FALSE;
+
+  if ( deps_json_next( rd, ']' ) )
+    return ( first == NULL );
+
+  do
+    {
+      gchar* file = NULL;
+      gchar* sha1 = NULL;
+      gint64 size = -1;
+      gint64 mtime = 0;
+
+      if ( !deps_json_next( rd, '{' ) )
+        return FALSE;
+
+      do
+        {
+          gchar* key = deps_json_get_str( rd );
+
+          if ( key == NULL || !deps_json_next( rd, ':' ) )
+            rd->err = TRUE;
+          else if ( !strcmp( key, "file" ) && file == NULL )
+            file = deps_json_get_str( rd );
+          else if ( !strcmp( key, "sha1" ) && sha1 == NULL )
+            sha1 = deps_json_get_str( rd );
+          else if ( !strcmp( key, "size" ) )
+            size = deps_json_get_int( rd );
+          else if ( !strcmp( key, "mtime" ) )
+            mtime = deps_json_get_int( rd );
+          else
+            rd->err = TRUE;
+
+          g_free( key );
+        }
+      while ( !rd->err && deps_json_next( rd, ',' ) );
+
+      if ( rd->err || !deps_json_next( rd, '}' )
+           || file == NULL || sha1 == NULL || size < 0 )
+        ok = FALSE;
+      else if ( first && strcmp( file, first ) )
+        ok = FALSE;
+      else
+        ok = mcgc_check_dep( file, size, mtime, sha1, stamp );
+
+      first = NULL;
+      g_free( file );
+      g_free( sha1 );
+    }
+  while ( ok && deps_json_next( rd, ',' ) );
+
+  return ok && deps_json_next( rd, ']' );
+}
+
+
+/**
+ * Check if outputs of previous run are up to date. Manifest must be
+ * for the same input and output, and all listed inputs, sourced Ruby
+ * files and outputs must be unchanged.
+ *
+ * @param manifest JSON manifest file name.
+ * @param infile   Input file name.
+ * @param outfile  Output file name.
+ *
+ * @return TRUE if up to date.
+ */
+gboolean deps_check( const gchar* manifest, const gchar* infile, const gchar* outfile )
+{
+  GMappedFile* map;
+  mcgc_rd_t rd;
+  GStatBuf st;
+  gint64 stamp;
+  gboolean ok;
+  int lists = 0;
+
+  if ( g_stat( manifest, &st ) != 0 )
+    return FALSE;
+  stamp = mucgly_mtime_ns( &st );
+
+  map = g_mapped_file_new( manifest, FALSE, NULL );
+  if ( map == NULL )
+    return FALSE;
+
+  rd.pos = g_mapped_file_get_contents( map );
+  rd.end = rd.pos + g_mapped_file_get_length( map );
+  rd.err = FALSE;
+
+  ok = deps_json_next( &rd, '{' );
+
+  while ( ok )
+    {
+      gchar* key = deps_json_get_str( &rd );
+
+      if ( key == NULL || !deps_json_next( &rd, ':' ) )
+        {
+          ok = FALSE;
+        }
+      else if ( !strcmp( key, "infile" ) )
+        {
+          gchar* name = deps_json_get_str( &rd );
+          ok = ( name && !strcmp( name, infile ) );
+          g_free( name );
+        }
+      else if ( !strcmp( key, "inputs" ) )
+        {
+          ok = deps_check_files( &rd, infile, stamp );
+          lists++;
+        }
+      else if ( !strcmp( key, "sources" ) )
+        {
+          ok = deps_check_files( &rd, NULL, stamp );
+          lists++;
+        }
+      else if ( !strcmp( key, "outputs" ) )
+        {
+          ok = deps_check_files( &rd, outfile, stamp );
+          lists++;
+        }
+      else
+        {
+          ok = FALSE;
+        }
+
+      g_free( key );
+
+      if ( ok && !deps_json_next( &rd, ',' ) )
+        break;
+    }
+
+  ok = ok && !rd.err && lists == 3 && deps_json_next( &rd, '}' );
+
+  g_mapped_file_unref( map );
+
+  return ok;
+}
+
+
+/**
+ * Start dependency tracking for input file processing. In
+ * incremental mode the processing is skipped, if the previous run is
+ * up to date (see deps_check). Otherwise the old manifest is removed,
+ * since it's not valid until the processing completes.
+ *
+ * @param ps      Pstate.
+ * @param infile  Input file name (or NULL).
+ * @param outfile Output file name (or NULL).
+ *
+ * @return TRUE if processing is skipped.
+ */
+gboolean ps_deps_begin( pstate_t* ps, const gchar* infile, const gchar* outfile )
+{
+  gchar* manifest = NULL;
+
+  if ( infile == NULL )
+    return FALSE;
+
+  if ( ps->manifest )
+    manifest = g_strdup( ps->manifest );
+  else if ( ps->incremental && outfile )
+    manifest = g_strconcat( outfile, DEPS_SUFFIX, NULL );
+
+  if ( ps->incremental && outfile && manifest )
+    {
+      if ( deps_check( manifest, infile, outfile ) )
+        {
+          g_free( manifest );
+          return TRUE;
+        }
+      g_unlink( manifest );
+    }
+
+  if ( manifest || ps->depfile )
+    ps->fs->deps = deps_new( infile, outfile, ps->depfile, manifest );
+
+  g_free( manifest );
+
+  return FALSE;
+}
+
+
+/**
+ * Complete dependency tracking and write dependency files. Pending
+ * output is flushed for the output signatures.
+ *
+ * @param ps Pstate.
+ */
+void ps_deps_end( pstate_t* ps )
+{
+  deps_t* dp = ps->fs->deps;
+
+  if ( dp == NULL )
+    return;
+
+  ps->fs->deps = NULL;
+
+  for ( GList* of = ps->output; of; of = of->next )
+    outfile_flush( (outfile_t*) of->data, FALSE );
+
+  if ( dp->depfile )
+    deps_write_depfile( dp );
+
+  if ( dp->manifest )
+    deps_save( dp );
+
+  deps_rem( dp );
+}
+
+
+
+/* ------------------------------------------------------------
+ * Mucgly batch processing:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Create Batch job.
+ *
+ * @param infile  Input file name.
+ * @param outfile Output file name.
+ *
+ * @return Batch job.
+ */
+batch_job_t* batch_job_new( const gchar* infile, const gchar* outfile )
+{
+  batch_job_t* job;
+
+  job = g_new0( batch_job_t, 1 );
+  job->infile = g_strdup( infile );
+  job->outfile = g_strdup( outfile );
+  job->ok = FALSE;
+  job->msg = NULL;
+  job->usecs = 0;
+
+  return job;
+}
+
+
+/**
+ * Free Batch job.
+ *
+ * @param job Batch job.
+ */
+void batch_job_rem( batch_job_t* job )
+{
+  g_free( job->infile );
+  g_free( job->outfile );
+  g_free( job->msg );
+  g_free( job );
+}
+
+
+/**
+ * Read batch manifest. Each manifest line has input and output file
+ * names separated by white space. Empty lines and lines starting with
+ * "#" are skipped.
+ *
+ * @param manifest Manifest file name.
+ *
+ * @return Batch jobs (or NULL if manifest is not readable).
+ */
+GPtrArray* batch_read( const gchar* manifest )
+{
+  gchar* text;
+  gchar** lines;
+  GPtrArray* jobs;
+
+  if ( !g_file_get_contents( manifest, &text, NULL, NULL ) )
+    return NULL;
+
+  jobs = g_ptr_array_new_with_free_func( (GDestroyNotify) batch_job_rem );
+
+  lines = g_strsplit( text, "\n", -1 );
+
+  for ( int i = 0; lines[i]; i++ )
+    {
+      gchar** words;
+      gchar* name[2];
+      int cnt = 0;
+
+      if ( lines[i][0] == '#' )
+        continue;
+
+      words = g_strsplit_set( lines[i], " \t\r", -1 );
+
+      for ( int j = 0; words[j]; j++ )
+        {
+          if ( words[j][0] == 0 )
+            continue;
+
+          if ( cnt < 2 )
+            name[ cnt ] = words[j];
+          cnt++;
+        }
+
+      if ( cnt == 2 )
+        g_ptr_array_add( jobs, batch_job_new( name[0], name[1] ) );
+      else if ( cnt != 0 )
+        mucgly_warn( NULL, "Invalid batch manifest line %d in \"%s\"", i+1, manifest );
+
+      g_strfreev( words );
+    }
+
+  g_strfreev( lines );
+  g_free( text );
+
+  return jobs;
+}
+
+
+/**
+ * Create Pstate for batch worker.
+ *
+ * @return Pstate with own MRuby.
+ */
+pstate_t* batch_ps_new( void )
+{
+  pstate_t* ps;
+  mrb_state* mrb;
+  const gchar* env;
+
+  mrb = mrb_open();
+  if ( mrb == NULL )
+    mucgly_fatal( NULL, "Can't create MRuby for batch worker" );
+
+  ps = ps_new( NULL );
+  ps_set_mrb( ps, mrb );
+
+  env = g_getenv( "MUCGLY_GC" );
+  if ( env && !strcmp( env, "generational" ) )
+    mucgly_gc_mode( mrb, TRUE );
+  else if ( env && !strcmp( env, "incremental" ) )
+    mucgly_gc_mode( mrb, FALSE );
+
+  /* Helper libraries are loaded once per worker MRuby. */
+  mucgly_preload_env( ps );
+
+  return ps;
+}
+
+
+/**
+ * Free Batch worker (at worker thread exit).
+ *
+ * @param data Batch worker.
+ */
+void batch_worker_rem( gpointer data )
+{
+  batch_worker_t* w = data;
+
+  if ( w->ps )
+    ps_rem( w->ps );
+
+  g_free( w );
+}
+
+
+/**
+ * Expand one Batch job in worker thread. Errors are trapped, and the
+ * worker Pstate is recreated after an error, since its state is
+ * undefined. Pstate is also recreated periodically to keep worker
+ * memory bounded.
+ *
+ * @param data      Batch job.
+ * @param user_data Not used.
+ */
+void batch_run_job( gpointer data, gpointer user_data )
+{
+  batch_job_t* job = data;
+  batch_worker_t* w;
+  mucgly_trap_t trap;
+  gint64 start;
+
+  w = g_private_get( &batch_worker_key );
+  if ( w == NULL )
+    {
+      w = g_new0( batch_worker_t, 1 );
+      g_private_set( &batch_worker_key, w );
+    }
+
+  if ( w->ps == NULL )
+    {
+      w->ps = batch_ps_new();
+      w->jobs = 0;
+    }
+
+  start = g_get_monotonic_time();
+
+  trap.msg = g_string_sized_new( 0 );
+  mucgly_set_trap( &trap );
+
+  if ( setjmp( trap.env ) == 0 )
+    {
+      ps_process_file( w->ps, job->infile, g_strdup( job->outfile ) );
+      job->ok = TRUE;
+    }
+  else
+    {
+      job->ok = FALSE;
+      job->msg = g_strdup( trap.msg->str );
+    }
+
+  /* Cleanup errors are not trapped. */
+  mucgly_set_trap( NULL );
+  g_string_free( trap.msg, TRUE );
+
+  w->jobs++;
+
+  if ( !job->ok || w->jobs >= BATCH_RECYCLE )
+    {
+      /* Aborted MRuby execution is not resumed. */
+      w->ps->mrb->jmp = NULL;
+      if ( !job->ok )
+        ps_reset( w->ps );
+      ps_rem( w->ps );
+      w->ps = NULL;
+    }
+  else
+    {
+      mrb_full_gc( w->ps->mrb );
+    }
+
+  job->usecs = g_get_monotonic_time() - start;
+}
+
+
+/**
+ * Expand Batch jobs with a pool of worker threads. Idle workers take
+ * the next job from the shared queue, so that long jobs don't stall
+ * the others.
+ *
+ * @param jobs    Batch jobs.
+ * @param threads Number of workers (0 for number of processors).
+ *
+ * @return Number of failed jobs.
+ */
+int batch_run( GPtrArray* jobs, int threads )
+{
+  GThreadPool* pool;
+  int failed = 0;
+
+  if ( threads <= 0 )
+    threads = g_get_num_processors();
+
+  if ( threads > (int) jobs->len )
+    threads = jobs->len;
+
+  if ( threads > 0 )
+    {
+      pool = g_thread_pool_new( batch_run_job, NULL, threads, TRUE, NULL );
+
+      if ( pool == NULL )
+        mucgly_fatal( NULL, "Can't create batch workers" );
+
+      for ( guint i = 0; i < jobs->len; i++ )
+        g_thread_pool_push( pool, g_ptr_array_index( jobs, i ), NULL );
+
+      /* Wait for completion. Workers exit and free their Pstates. */
+      g_thread_pool_free( pool, FALSE, TRUE );
+    }
+
+  for ( guint i = 0; i < jobs->len; i++ )
+    {
+      if ( !( (batch_job_t*) g_ptr_array_index( jobs, i ) )->ok )
+        failed++;
+    }
+
+  return failed;
+}
+
+
+/**
+ * Expand all files in batch manifest. Failed files are reported to
+ * stderr in manifest order.
+ *
+ * @param manifest Manifest file name.
+ * @param threads  Number of workers (0 for number of processors).
+ *
+ * @return Number of failed files (or -1 if manifest is not readable).
+ */
+int mucgly_batch( const gchar* manifest, int threads )
+{
+  GPtrArray* jobs;
+  int failed;
+
+  jobs = batch_read( manifest );
+  if ( jobs == NULL )
+    {
+      mucgly_warn( NULL, "Can't read batch manifest \"%s\"", manifest );
+      return -1;
+    }
+
+  failed = batch_run( jobs, threads );
+
+  for ( guint i = 0; i < jobs->len; i++ )
+    {
+      batch_job_t* job = g_ptr_array_index( jobs, i );
+
+      if ( !job->ok )
+        {
+          fputs( job->msg, stderr );
+          fputc( '\n', stderr );
+        }
+    }
+  fflush( stderr );
+
+  g_ptr_array_free( jobs, TRUE );
+
+  return failed;
+}
+
+
+
+/* ------------------------------------------------------------
+ * Mucgly parallel expansion:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Find the next segment boundary of pure input. Segments end after a
+ * newline outside macros, once PAR_SEGMENT_SIZE chars are
+ * collected. Internal commands outside macros are barriers, and end
+ * the parallel region (as does the end of input).
+ *
+ * @param sf  Stackfile.
+ * @param pos Segment start.
+ * @param end Region end reached.
+ *
+ * @return Segment end (region end at barrier).
+ */
+gsize ps_par_next( stackfile_t* sf, gsize pos, gboolean* end )
+{
+  hookcfg_t* hc = sf->cfg;
+  const gchar* d = sf->data;
+  gsize n = sf->data_len;
+  gsize beg_len = strlen( hc->hook->beg );
+  gsize end_len = strlen( hc->hook->end );
+  gsize esc_len = strlen( hc->hookesc );
+  gsize i = pos;
+  int depth = 0;
+
+  *end = FALSE;
+
+  while ( i < n )
+    {
+      if ( !hc->hook_1st_chars[ (guchar) d[i] ] )
+        {
+          if ( d[i] == '\n' && depth == 0 && i + 1 - pos >= PAR_SEGMENT_SIZE )
+            return i + 1;
+          i++;
+        }
+      else if ( esc_len && i + esc_len <= n && !memcmp( &d[i], hc->hookesc, esc_len ) )
+        {
+          /* Escaped char is never a boundary. */
+          i += esc_len + 1;
+        }
+      else if ( depth > 0 && i + end_len <= n && !memcmp( &d[i], hc->hook->end, end_len ) )
+        {
+          depth--;
+          i += end_len;
+        }
+      else if ( i + beg_len <= n && !memcmp( &d[i], hc->hook->beg, beg_len ) )
+        {
+          if ( depth == 0 )
+            {
+              gsize j = i + beg_len;
+
+              if ( j < n && d[j] == '+' )
+                j++;
+
+              if ( j < n && d[j] == ':' )
+                {
+                  *end = TRUE;
+                  return i;
+                }
+            }
+
+          depth++;
+          i += beg_len;
+        }
+      else
+        {
+          i++;
+        }
+    }
+
+  *end = TRUE;
+
+  return n;
+}
+
+
+/**
+ * Check if parallel expansion can start at the current input
+ * position. Input must be the stable (mapped or memory) base file,
+ * outside macros, with a plain hook pair and no template recording.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE if ready.
+ */
+gboolean ps_par_ready( pstate_t* ps )
+{
+  stackfile_t* sf;
+
+  if ( ps->in_macro || !ps_has_file( ps ) || ps->fs->file->next
+       || ps->post_push || ps->post_pop
+       || ps->fs->rec || ps->fs->replay )
+    return FALSE;
+
+  sf = ps_topfile( ps );
+
+  if ( sf == ps->par_sf && sf->data_pos < ps->par_skip )
+    return FALSE;
+
+  if ( sf != ps->par_sf )
+    {
+      ps->par_sf = sf;
+      ps->par_skip = 0;
+    }
+
+  return ( sf->fh == NULL
+           && !sf->eat_tail
+           && sf->eater == NULL
+           && sf->cfg->multi == NULL
+           && !sf->cfg->hook_esc_eq_beg
+           && !sf->cfg->hook_esc_eq_end );
+}
+
+
+/**
+ * ps_trap function for expanding segment in worker.
+ *
+ * @param ps   Worker Pstate.
+ * @param data Segment.
+ */
+void par_seg_func( pstate_t* ps, gpointer data )
+{
+  par_seg_t* seg = data;
+  stackfile_t* sf;
+  outfile_t* of;
+
+  int ai;
+
+  par_worker_setup( seg->par, seg->worker );
+  ai = mrb_gc_arena_save( ps->mrb );
+
+  sf = sf_new_data( (gchar*) seg->filename, (gchar*) seg->data, seg->len, ps->fs->base );
+  sf_set_position( sf, seg->lineno, seg->column );
+  fs_push_stackfile( ps->fs, sf );
+
+  of = outfile_new_str( ps->mrb );
+  ps_push_outfile( ps, of );
+
+  ps_process( ps );
+
+  seg->out = g_string_new_len( RSTRING_PTR( of->rstr ), RSTRING_LEN( of->rstr ) );
+  ps_pop_file( ps );
+
+  mrb_gc_arena_restore( ps->mrb, ai );
+}
+
+
+/**
+ * Free Parallel worker.
+ *
+ * @param w Worker.
+ */
+void par_worker_rem( par_worker_t* w )
+{
+  if ( w->ps )
+    {
+      if ( w->ps->fs->base )
+        sf_rem( w->ps->fs->base );
+      w->ps->fs->base = NULL;
+      ps_rem( w->ps );
+      w->ps = NULL;
+    }
+}
+
+
+/**
+ * Create Pstate for Parallel worker.
+ *
+ * @param w Worker.
+ */
+void par_worker_new( par_worker_t* w )
+{
+  w->ps = batch_ps_new();
+  w->ps->pure = TRUE;
+  w->region = -1;
+  w->sources = 0;
+
+  if ( w->ps->stats )
+    {
+      /* Stats are collected by the main Pstate. */
+      stats_rem( w->ps->stats );
+      w->ps->stats = NULL;
+    }
+}
+
+
+/**
+ * Setup Parallel worker for the current region. Worker MRuby gets the
+ * Ruby files loaded by the main Pstate, and the hooks of the region.
+ *
+ * @param par Parallel state.
+ * @param w   Worker.
+ */
+void par_worker_setup( par_t* par, par_worker_t* w )
+{
+  while ( w->sources < par->sources->len )
+    mucgly_preload( w->ps, g_ptr_array_index( par->sources, w->sources++ ) );
+
+  if ( w->region != par->region )
+    {
+      stackfile_t* base;
+
+      base = sf_new_data( NULL, NULL, 0, NULL );
+      hookcfg_unref( base->cfg );
+      base->cfg = hookcfg_copy( par->cfg );
+
+      if ( w->ps->fs->base )
+        sf_rem( w->ps->fs->base );
+      w->ps->fs->base = base;
+      w->region = par->region;
+    }
+}
+
+
+/**
+ * Expand segment in worker thread. Thread takes an idle worker, and
+ * the worker is recreated after errors.
+ *
+ * @param data      Segment.
+ * @param user_data Parallel state.
+ */
+void par_run_seg( gpointer data, gpointer user_data )
+{
+  par_seg_t* seg = data;
+  par_t* par = user_data;
+  par_worker_t* w;
+
+  w = g_async_queue_pop( par->idle );
+
+  if ( w->ps == NULL )
+    par_worker_new( w );
+
+  seg->par = par;
+  seg->worker = w;
+  seg->msg = ps_trap( w->ps, par_seg_func, seg );
+
+  if ( seg->msg )
+    {
+      /* Aborted MRuby execution is not resumed. */
+      w->ps->mrb->jmp = NULL;
+      par_worker_rem( w );
+    }
+
+  g_async_queue_push( par->idle, w );
+
+  g_mutex_lock( &par->lock );
+  seg->done = TRUE;
+  g_cond_broadcast( &par->cond );
+  g_mutex_unlock( &par->lock );
+}
+
+
+/**
+ * Create Parallel state with worker pool.
+ *
+ * @param threads Number of workers.
+ * @param sources Ruby files loaded by main Pstate.
+ *
+ * @return Parallel state.
+ */
+par_t* par_new( int threads, GPtrArray* sources )
+{
+  par_t* par;
+
+  par = g_new0( par_t, 1 );
+  par->threads = threads;
+  par->sources = sources;
+  par->region = 0;
+  g_mutex_init( &par->lock );
+  g_cond_init( &par->cond );
+
+  par->workers = g_new0( par_worker_t, threads );
+  par->idle = g_async_queue_new();
+  for ( int i = 0; i < threads; i++ )
+    g_async_queue_push( par->idle, &par->workers[i] );
+
+  par->pool = g_thread_pool_new( par_run_seg, par, threads, TRUE, NULL );
+  if ( par->pool == NULL )
+    mucgly_fatal( NULL, "Can't create parallel workers" );
+
+  return par;
+}
+
+
+/**
+ * Free Parallel state and its workers.
+ *
+ * @param par Parallel state.
+ */
+void par_rem( par_t* par )
+{
+  g_thread_pool_free( par->pool, FALSE, TRUE );
+
+  for ( int i = 0; i < par->threads; i++ )
+    par_worker_rem( &par->workers[i] );
+  g_free( par->workers );
+
+  g_async_queue_unref( par->idle );
+  if ( par->cfg )
+    hookcfg_unref( par->cfg );
+
+  g_mutex_clear( &par->lock );
+  g_cond_clear( &par->cond );
+  g_free( par );
+}
+
+
+/**
+ * Wait for segment completion.
+ *
+ * @param par Parallel state.
+ * @param seg Segment.
+ */
+void par_wait( par_t* par, par_seg_t* seg )
+{
+  g_mutex_lock( &par->lock );
+  while ( !seg->done )
+    g_cond_wait( &par->cond, &par->lock );
+  g_mutex_unlock( &par->lock );
+}
+
+
+/**
+ * Expand pure region of input in parallel (see :parallel). Region
+ * is split to segments (see ps_par_next), which are expanded by
+ * workers with their own MRubys, and the outputs are joined in
+ * order. Only a window of segments is pending at a time, so that
+ * memory use is bounded for large inputs. Short regions are left for
+ * sequential processing.
+ *
+ * @param ps Pstate.
+ *
+ * @return TRUE if region was expanded.
+ */
+gboolean ps_par_region( pstate_t* ps )
+{
+  stackfile_t* sf = ps_topfile( ps );
+  GQueue pending = G_QUEUE_INIT;
+  par_t* par;
+  par_seg_t* seg;
+  gsize pos = sf->data_pos;
+  gsize next;
+  gboolean end;
+  gint64 line;
+  gint64 col;
+  gchar* msg = NULL;
+
+  next = ps_par_next( sf, pos, &end );
+  if ( end )
+    {
+      /* Single segment up to barrier or input end. */
+      ps->par_skip = next + 1;
+      return FALSE;
+    }
+
+  if ( ps->par && ps->par->threads != ps->parallel )
+    {
+      par_rem( ps->par );
+      ps->par = NULL;
+    }
+
+  if ( ps->par == NULL )
+    ps->par = par_new( ps->parallel, ps->sources );
+  par = ps->par;
+
+  /* Hooks are fixed within region. */
+  if ( par->cfg )
+    hookcfg_unref( par->cfg );
+  par->cfg = hookcfg_copy( sf->cfg );
+  par->region++;
+
+  sf_position( sf, &line, &col );
+
+  for (;;)
+    {
+      while ( pos < next && (int) g_queue_get_length( &pending ) < 2 * par->threads )
+        {
+          const gchar* nl;
+          gsize lines;
+
+          seg = g_new0( par_seg_t, 1 );
+          seg->filename = sf->filename;
+          seg->data = &sf->data[ pos ];
+          seg->len = next - pos;
+          seg->lineno = line;
+          seg->column = col;
+
+          lines = mucgly_count_lines( seg->data, seg->len, &nl );
+          if ( lines )
+            {
+              line += lines;
+              col = seg->len - ( nl - seg->data ) - 1;
+            }
+          else
+            {
+              col += seg->len;
+            }
+
+          g_queue_push_tail( &pending, seg );
+          g_thread_pool_push( par->pool, seg, NULL );
+
+          pos = next;
+          if ( !end )
+            next = ps_par_next( sf, pos, &end );
+        }
+
+      seg = g_queue_pop_head( &pending );
+      if ( seg == NULL )
+        break;
+
+      par_wait( par, seg );
+
+      if ( msg == NULL && seg->msg == NULL )
+        {
+          if ( G_UNLIKELY( ps->stats != NULL ) )
+            ps->stats->bytes_in += seg->len;
+
+          ps_out_n( ps, seg->out->str, seg->out->len );
+          sf_skip( sf, seg->len );
+        }
+      else if ( msg == NULL )
+        {
+          /* Stop at first error, and wait for pending segments. */
+          msg = seg->msg;
+          seg->msg = NULL;
+          next = pos;
+        }
+
+      if ( seg->out )
+        g_string_free( seg->out, TRUE );
+      g_free( seg->msg );
+      g_free( seg );
+    }
+
+  /* Barrier is processed sequentially. */
+  ps->par_skip = sf->data_pos + 1;
+
+  if ( msg )
+    mucgly_rethrow( msg );
+
+  return TRUE;
+}
+
+
+
+/* ------------------------------------------------------------
+ * Mucgly MRuby-functions:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Get the Pstate of MRuby. Raise exception if MRuby is not attached
+ * to any Pstate.
+ *
+ * @param mrb MRuby.
+ *
+ * @return Pstate.
+ */
+pstate_t* mucgly_ps( mrb_state* mrb )
+{
+  if ( mrb->ud == NULL )
+    mrb_raise( mrb, E_RUNTIME_ERROR, "Mucgly: no active processor!" );
+
+  return (pstate_t*) mrb->ud;
+}
+
+
+/**
+ * Get the Pstate of MRuby for changing hooks or streams. Raise
+ * exception in parallel workers, since the changes would apply only
+ * to one segment.
+ *
+ * @param mrb MRuby.
+ *
+ * @return Pstate.
+ */
+pstate_t* mucgly_ps_impure( mrb_state* mrb )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+
+  if ( ps->pure )
+    mucgly_raise( ps, "error", "Hooks and streams can't be changed in parallel input" );
+
+  return ps;
+}
+
+
+/**
+ * Mucgly.write method. Write output current output without NL.
+ *
+ * @param obj  Not used.
+ * @param rstr Written string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_write( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  mrb_value obj;
+
+  mrb_get_args( mrb, "o", &obj );
+  ps_out_value( ps, obj );
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.puts method. Write output current output with NL.
+ *
+ * @param obj  Not used.
+ * @param rstr Written string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_puts( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  mrb_value obj;
+
+  mrb_get_args( mrb, "o", &obj );
+  ps_out_value( ps, obj );
+  ps_out( ps, '\n' );
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.hookbeg method. Get hookbeg.
+ *
+ * @param obj  Not used.
+ *
+ * @return Hookbeg as Ruby String.
+ */
+static mrb_value
+mrb_mucgly_hookbeg( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  return mrb_str_new_cstr( mrb, ps_current_file( ps )->cfg->hook->beg );
+}
+
+
+/**
+ * Mucgly.hookend method. Get hookend.
+ *
+ * @param obj  Not used.
+ *
+ * @return Hookend as Ruby String.
+ */
+static mrb_value
+mrb_mucgly_hookend( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  return mrb_str_new_cstr( mrb, ps_current_file( ps )->cfg->hook->end );
+}
+
+
+/**
+ * Mucgly.hookesc method. Get hookesc.
+ *
+ * @param obj  Not used.
+ *
+ * @return Hookesc as Ruby String.
+ */
+static mrb_value
+mrb_mucgly_hookesc( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  return mrb_str_new_cstr( mrb, ps_current_file( ps )->cfg->hookesc );
+}
+
+
+/**
+ * Mucgly.sethook method. Set both hookben and hookend.
+ *
+ * @param obj  Not used.
+ * @param ary  Array of hookpairs.
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_sethook( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* beg, *end;
+
+  mrb_get_args( mrb, "zz", &beg, &end );
 
-                        case '\n':
-                          /* Eat newlines. */
-                          break;
+  sf_set_hook( ps_topfile( ps ), hook_beg, beg );
+  sf_set_hook( ps_topfile( ps ), hook_end, end );
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.sethookbeg method. Set hookbeg.
+ *
+ * @param obj  Not used.
+ * @param rstr Hookbeg string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_sethookbeg( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* str;
+  mrb_get_args( mrb, "z", &str );
+  sf_set_hook( ps_topfile( ps ), hook_beg, str );
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.sethookend method. Set hookend.
+ *
+ * @param obj  Not used.
+ * @param rstr Hookend string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_sethookend( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* str;
+  mrb_get_args( mrb, "z", &str );
+  sf_set_hook( ps_topfile( ps ), hook_end, str );
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.sethookesc method. Set hookesc.
+ *
+ * @param obj  Not used.
+ * @param rstr Hookesc string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_sethookesc( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* str;
+  mrb_get_args( mrb, "z", &str );
+  sf_set_hook( ps_topfile( ps ), hook_esc, str );
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.seteater method. Set eater.
+ *
+ * @param obj  Not used.
+ * @param rstr Eater string (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_seteater( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  mrb_value tmp;
+  char* str;
+
+  mrb_get_args( mrb, "o", &tmp );
+
+  if ( mrb_obj_is_kind_of( mrb, tmp, mrb->nil_class ) )
+    {
+      sf_set_eater( ps_topfile( ps ), NULL );
+    }
+  else if ( mrb_obj_is_kind_of( mrb, tmp, mrb->string_class ) )
+    {
+      str = RSTRING_PTR( tmp );
+      sf_set_eater( ps_topfile( ps ), str );
+    }
+  else
+    {
+      mucgly_raise( ps, "error", "Eater must be a string or nil!" );
+   }
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Add multi-hook pair to current input, and raise exception if the
+ * hooks match escape.
+ *
+ * @param ps   Pstate.
+ * @param beg  Hookbeg of pair.
+ * @param end  Hookend of pair.
+ * @param susp Suspension (or NULL).
+ */
+static void mucgly_multi_hook( pstate_t* ps, const char* beg, const char* end, const char* susp )
+{
+  if ( !sf_multi_hook( ps_topfile( ps ), beg, end, susp ) )
+    mucgly_raise( ps, "error", "Esc hook is not allowed to match multihooks" );
+}
+
+
+/**
+ * Mucgly.multihook method. Add multihook pairs.
+ *
+ * Arg options:
+ *  [ hb1, he1, su1 ], [ hb2, he2, su2 ], [ hb3, he3 ], ...
+ *  [ hb1, he1, hb2, he2, hb3, he3 ]
+ *  hb1, he1, hb2, he2, hb3, he3, ...
+ *
+ * @param obj  Not used.
+ * @param ary  Array of hookpairs.
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_multihook( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* beg, *end, *susp;
+
+  mrb_value* argv;
+  int argc;
+  
+  mrb_get_args( mrb, "*", &argv, &argc );
+  
+  if ( mrb_obj_is_kind_of( mrb, argv[0], mrb->string_class ) )
+    {
+      /* Even (hb&be pairs) number of strings. */
+
+      if ( ( argc % 2 ) == 0 )
+        {
+          for ( int i = 0; i < argc; i += 2 )
+            {
+              beg = RSTRING_PTR( argv[i] );
+              end = RSTRING_PTR( argv[i+1] );
+              mucgly_multi_hook( ps, beg, end, NULL );
+            }
+        }
+      else
+        {
+          mucgly_raise( ps, "error", "hookbeg/hookend pairs expected for multihook!" );
+        }
+    }
+  else if ( argc == 1
+            && mrb_obj_is_kind_of( mrb, argv[0], mrb->array_class )
+            && ( RARRAY_LEN( argv[0] ) % 2 == 0 ) )
+    {
+      
+      /* Even number of strings within an array. */
+
+      for ( int i = 0; i < RARRAY_LEN( argv[0] ); i += 2 )
+        {
+          beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[0], i ) );
+          end = RSTRING_PTR( mrb_ary_ref( mrb, argv[0], i+1 ) );
+          mucgly_multi_hook( ps, beg, end, NULL );
+        }
+
+    }
+  else
+    {
+
+      /* Number of arrays with 2/3 entries each. */
+
+      for ( int i = 0; i < argc; i++ )
+        {
+          if ( mrb_ary_len( mrb, argv[i] ) == 2 )
+            {
+              beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 0 ) );
+              end = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 1 ) );
+              mucgly_multi_hook( ps, beg, end, NULL );
+            }
+          else if ( mrb_ary_len( mrb, argv[i] ) == 3 )
+            {
+              beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 0 ) );
+              end = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 1 ) );
+              susp = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 2 ) );
+              mucgly_multi_hook( ps, beg, end, susp );
+            }
+          else
+            {
+              mucgly_raise( ps, "error", "Array argument must hold either hookbeg/hookend pairs or triplets including suspension!" );
+            }
+        }
+
+    }
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.ifilename method. Gets current input file name.
+ *
+ * @param obj  Not used.
+ *
+ * @return Input file name (Ruby String).
+ */
+static mrb_value
+mrb_mucgly_ifilename( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  return mrb_str_new_cstr( mrb, ps_topfile(ps)->filename );
+}
+
+
+/**
+ * Mucgly.ilinenumber method. Gets current input file line.
+ *
+ * @param obj  Not used.
+ *
+ * @return Input file line number (Ruby Fixnum).
+ */
+static mrb_value
+mrb_mucgly_ilinenumber( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  return mrb_fixnum_value( sf_line( ps_topfile(ps) )+1 );
+}
+
+
+/**
+ * Mucgly.ofilename method. Gets current output file name.
+ *
+ * @param obj  Not used.
+ *
+ * @return Input file name (Ruby String).
+ */
+static mrb_value
+mrb_mucgly_ofilename( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  outfile_t* of;
+  of = ps->output->data;
+  return mrb_str_new_cstr( mrb, of->filename );
+}
+
+
+/**
+ * Mucgly.olinenumber method. Gets current output file line.
+ *
+ * @param obj  Not used.
+ *
+ * @return Output file line number (Ruby Fixnum).
+ */
+static mrb_value
+mrb_mucgly_olinenumber( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  outfile_t* of;
+  of = ps->output->data;
+  return mrb_fixnum_value( (of->lineno+1) );
+}
+
+
+/**
+ * Mucgly.pushinput method. Push new input stream.
+ *
+ * @param obj  Not used.
+ * @param rstr Input file name (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_pushinput( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  char* str;
+
+  mrb_get_args( mrb, "z", &str );
 
-                        case ' ':
-                          /* Eat spaces. */
-                          break;
+  /* Report within macro, i.e. don't exit from within MRuby. */
+  if ( !ps->fs->replay && g_access( str, R_OK ) != 0 )
+    mucgly_raise( ps, "error", "Can't open \"%s\"", str );
 
-                        default:
+  fs_push_file_delayed( ps->fs, str );
+  ps->post_push = TRUE;
 
-                          if ( ps_topfile(ps)->hook_esc_eq_beg )
-                            {
+  return mrb_nil_value();
+}
 
-                              if ( ps_topfile(ps)->hookesc[1] == 0
-                                   && c == ps_topfile(ps)->hookesc[0] )
-                                {
-                                  /* Escape is one char long and following
-                                     char was ESC (i.e. escaped escape). */
-                                  ps_out( ps, c );
-                                }
-                              else
-                                {
-                                  /* Escape is same as hookbeg and escape is
-                                     not used to eat out spaces. */
 
-                                  /* Put back the extra char (for safety/clarity). */
-                                  fs_put( ps->fs, c );
+/**
+ * Mucgly.rawinclude method. Copy file to output verbatim.
+ *
+ * @param obj  Not used.
+ * @param rstr File name (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_rawinclude( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  char* str;
 
-                                  /* Push hook here. For non-esc hooks
-                                     this is done while matching for
-                                     hook. */
-                                  ps_push_curhook( ps_topfile(ps), &ps_topfile(ps)->hook );
+  mrb_get_args( mrb, "z", &str );
 
-                                  /* Start to collect the macro content. */
-                                  ps_enter_macro( ps );
-                                }
-                            }
-                          else
-                            {
-                              /* Literal output. */
-                              ps_out( ps, c );
-                            }
-                        }
-                    }
+  if ( !ps_raw_include( ps, str ) )
+    mucgly_raise( ps, "error", "Can't read \"%s\"", str );
 
-                }
-            }
-          else if ( ps->in_macro && ps_check_hooksusp( ps ) )
-            {
-              ps->suspension++;
-              ps_collect_str( ps, ps_current_hooksusp( ps ) );
-            }
-          else if ( ps->in_macro && ps_check_hookend( ps ) )
-            {
-              /* Hookend has priority over hookbeg if we are in
-                 macro. Also hookend is ignored when outside macro. */
-              if ( ps->suspension == 0 )
-                {
-                  ps_process_hook_end_seq( ps, &do_break );
-                  if ( do_break )
-                    break;
-                }
-              else
-                {
-                  ps->suspension--;
-                  ps_collect_str( ps, ps_current_hookend( ps ) );
-                }
-            }
-          else if ( ps_check_hookbeg( ps ) )
-            {
+  return mrb_nil_value();
+}
 
-              if ( ps->in_macro )
-                {
-                  /* Macro in macro. */
 
-                  /* Increase macro level. */
-                  ps->in_macro++;
+/**
+ * Mucgly.pushinputstr method. Push String as input stream. String
+ * content is copied.
+ *
+ * @param obj  Not used.
+ * @param rstr Input (Ruby String).
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_pushinputstr( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  stackfile_t* sf;
+  char* str;
+  mrb_int len;
 
-                  /* Output the consumed hookbeg. */
-                  ps_out_str( ps, ps_current_hookbeg( ps ) );
-                }
-              else
-                {
-                  ps_enter_macro( ps );
-                }
-            }
-          else
-            {
-              c = ps_in( ps );
-              ps_process_non_hook_seq( ps, c, &do_break );
-              if ( do_break )
-                break;
-            }
-        }
-      else
-        {
-          ps_process_non_hook_seq( ps, c, &do_break );
-          if ( do_break )
-            break;
-        }
+  mrb_get_args( mrb, "s", &str, &len );
+
+  if ( ps->fs->replay )
+    {
+      /* Content is part of template. */
+      sf = sf_new_data( "<STRING>", NULL, 0, ps_topfile( ps ) );
+    }
+  else
+    {
+      sf = sf_new_data( "<STRING>", g_strndup( str, len ), len, ps_topfile( ps ) );
+      sf->data_own = TRUE;
     }
 
-  if ( outfile )
-    ps_pop_file( ps );
+  fs_push_stackfile_delayed( ps->fs, sf );
+  ps->post_push = TRUE;
 
+  return mrb_nil_value();
 }
 
 
-
-/* ------------------------------------------------------------
- * Mucgly MRuby-functions:
- * ------------------------------------------------------------ */
+/**
+ * Mucgly.closeinput method. Pop input stream and close file stream.
+ *
+ * @param obj  Not used.
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_closeinput( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  ps->post_pop = TRUE;
+  return mrb_nil_value();
+}
 
 
 /**
- * Mucgly.write method. Write output current output without NL.
+ * Mucgly.pushoutput method. Push new output stream.
  *
  * @param obj  Not used.
- * @param rstr Written string (Ruby String).
+ * @param rstr Output file name (Ruby String).
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_write( mrb_state* mrb, mrb_value self )
+mrb_mucgly_pushoutput( mrb_state* mrb, mrb_value self )
 {
-  mrb_value obj;
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  outfile_t* of;
   char* str;
 
-  mrb_get_args( mrb, "o", &obj );
-  if ( !mrb_obj_is_kind_of( mrb, obj, mrb->string_class ) )
-      obj = mrb_inspect( mrb, obj );
-  str = RSTRING_PTR(obj);
+  mrb_get_args( mrb, "z", &str );
+
+  of = outfile_open( str, ps->if_changed );
+  if ( of == NULL )
+    mucgly_raise( ps, "error", "Can't open \"%s\"", str );
 
-  ps_out_str( ruby_ps, str );
+  if ( ps->fs->deps )
+    deps_add( ps->fs->deps->outputs, str );
+
+  ps_push_outfile( ps, of );
 
   return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.puts method. Write output current output with NL.
+ * Mucgly.pushoutputstr method. Push String output stream. Content is
+ * returned by Mucgly.closeoutput.
  *
  * @param obj  Not used.
- * @param rstr Written string (Ruby String).
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_puts( mrb_state* mrb, mrb_value self )
+mrb_mucgly_pushoutputstr( mrb_state* mrb, mrb_value self )
 {
-  mrb_value obj;
-  char* str;
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  ps_push_outfile( ps, outfile_new_str( mrb ) );
+  return mrb_nil_value();
+}
 
-  mrb_get_args( mrb, "o", &obj );
-  if ( !mrb_obj_is_kind_of( mrb, obj, mrb->string_class ) )
-      obj = mrb_inspect( mrb, obj );
-  str = RSTRING_PTR(obj);
 
-  ps_out_str( ruby_ps, str );
-  ps_out( ruby_ps, '\n' );
+/**
+ * Mucgly.closeoutput method. Pop output stream and close file stream.
+ *
+ * @param obj  Not used.
+ *
+ * @return Output for String output stream, otherwise nil.
+ */
+static mrb_value
+mrb_mucgly_closeoutput( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  outfile_t* of = ps->output->data;
+  mrb_value ret = mrb_nil_value();
+
+  if ( of->mrb )
+    {
+      ret = of->rstr;
+      mrb_gc_protect( mrb, ret );
+    }
 
-  return mrb_nil_value();
+  ps_pop_file( ps );
+
+  return ret;
 }
 
 
 /**
- * Mucgly.hookbeg method. Get hookbeg.
+ * Mucgly.block method. Block output.
  *
  * @param obj  Not used.
  *
- * @return Hookbeg as Ruby String.
+ * @return nil.
  */
 static mrb_value
-mrb_mucgly_hookbeg( mrb_state* mrb, mrb_value self )
+mrb_mucgly_block( mrb_state* mrb, mrb_value self )
 {
-  return mrb_str_new_cstr( mrb, ps_current_file( ruby_ps )->hook.beg );
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  ps_block_output( ps );
+  return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.hookend method. Get hookend.
+ * Mucgly.block method. Block output.
  *
  * @param obj  Not used.
  *
- * @return Hookend as Ruby String.
+ * @return nil.
  */
 static mrb_value
-mrb_mucgly_hookend( mrb_state* mrb, mrb_value self )
+mrb_mucgly_unblock( mrb_state* mrb, mrb_value self )
 {
-  return mrb_str_new_cstr( mrb, ps_current_file( ruby_ps )->hook.end );
+  pstate_t* ps = mucgly_ps_impure( mrb );
+  ps_unblock_output( ps );
+  return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.hookesc method. Get hookesc.
+ * Mucgly.setflush method. Set output flush policy.
  *
- * @param obj  Not used.
+ * Arg options:
+ *  true/false          Flush after each write, or when buffer is full.
+ *  "none"/"write"/"line"
+ *  "size", count       Flush when count chars are pending.
+ *  "stream", count, ms Flush at newlines, after macros, before input
+ *                      waits, when count chars are pending, and when
+ *                      output has been pending ms milliseconds.
+ *
+ * @param obj   Not used.
+ * @param mode  Policy.
+ * @param size  Pending chars limit (optional).
+ * @param msecs Pending time limit (optional, 0 for none).
  *
- * @return Hookesc as Ruby String.
+ * @return nil.
  */
 static mrb_value
-mrb_mucgly_hookesc( mrb_state* mrb, mrb_value self )
+mrb_mucgly_setflush( mrb_state* mrb, mrb_value self )
 {
-  return mrb_str_new_cstr( mrb, ps_current_file( ruby_ps )->hookesc );
+  pstate_t* ps = mucgly_ps( mrb );
+  mrb_value mode;
+  mrb_int size = OF_WRITE_SIZE;
+  mrb_int msecs = 0;
+
+  mrb_get_args( mrb, "o|ii", &mode, &size, &msecs );
+  mucgly_set_flush( mrb, ps, mode, size, msecs );
+
+  return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.sethook method. Set both hookben and hookend.
+ * Set output flush policy from Ruby value (see Mucgly.setflush).
  *
- * @param obj  Not used.
- * @param ary  Array of hookpairs.
+ * @param mrb   MRuby.
+ * @param ps    Pstate.
+ * @param mode  Policy.
+ * @param size  Pending chars limit.
+ * @param msecs Pending time limit (stream policy).
+ */
+void mucgly_set_flush( mrb_state* mrb, pstate_t* ps, mrb_value mode, mrb_int size, mrb_int msecs )
+{
+  if ( mrb_obj_is_kind_of( mrb, mode, mrb->string_class ) )
+    {
+      char* str = RSTRING_PTR( mode );
+
+      if ( !g_strcmp0( str, "none" ) )
+        ps->flush = flush_none;
+      else if ( !g_strcmp0( str, "write" ) )
+        ps->flush = flush_write;
+      else if ( !g_strcmp0( str, "line" ) )
+        ps->flush = flush_line;
+      else if ( !g_strcmp0( str, "size" ) && size > 0 )
+        {
+          ps->flush = flush_size;
+          ps->flush_size = size;
+        }
+      else if ( !g_strcmp0( str, "stream" ) && size > 0 && msecs >= 0 )
+        {
+          ps->flush = flush_stream;
+          ps->flush_size = size;
+          ps->flush_time = msecs * 1000;
+        }
+      else
+        mucgly_raise( ps, "error", "Unknown flush policy: \"%s\"", str );
+    }
+  else
+    {
+      ps->flush = mrb_test( mode ) ? flush_write : flush_none;
+    }
+
+  /* Policy applies from now on. */
+  outfile_flush( ps->output->data, ( ps->flush != flush_none ) );
+}
+
+
+/**
+ * Mucgly.setgc method. Set GC policy of processing.
+ *
+ * Arg options:
+ *  "generational"/"incremental"  MRuby GC mode (nil to keep).
+ *  interval                      Run full GC after every interval
+ *                                macros (0 for never).
+ *
+ * @param obj      Not used.
+ * @param mode     GC mode.
+ * @param interval Full GC interval (optional).
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_sethook( mrb_state* mrb, mrb_value self )
+mrb_mucgly_setgc( mrb_state* mrb, mrb_value self )
 {
-  char* beg, *end;
+  pstate_t* ps = mucgly_ps( mrb );
+  char* mode;
+  mrb_int interval = -1;
 
-  mrb_get_args( mrb, "zz", &beg, &end );
+  mrb_get_args( mrb, "z!|i", &mode, &interval );
+  mucgly_set_gc( ps, mode, interval );
+
+  return mrb_nil_value();
+}
+
+
+/**
+ * Mucgly.setcache method. Set the max number of compiled macro
+ * bodies kept (0 disables caching).
+ *
+ * @param obj   Not used.
+ * @param limit Number of entries.
+ *
+ * @return nil.
+ */
+static mrb_value
+mrb_mucgly_setcache( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  mrb_int limit;
 
-  sf_set_hook( ps_topfile( ruby_ps ), hook_beg, beg );
-  sf_set_hook( ps_topfile( ruby_ps ), hook_end, end );
+  mrb_get_args( mrb, "i", &limit );
+
+  if ( limit < 0 )
+    limit = 0;
+
+  ps->rcache->limit = limit;
+  rcache_evict( ps->rcache, mrb, limit );
 
   return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.sethookbeg method. Set hookbeg.
+ * Mucgly.cachestats method. Get compiled macro body cache status.
  *
  * @param obj  Not used.
- * @param rstr Hookbeg string (Ruby String).
+ *
+ * @return Hash with "hits", "misses", "size" and "limit", and
+ *         "include_hits", "include_misses" and "include_size" for
+ *         the include file cache.
+ */
+static mrb_value
+mrb_mucgly_cachestats( mrb_state* mrb, mrb_value self )
+{
+  pstate_t* ps = mucgly_ps( mrb );
+  rcache_t* rc = ps->rcache;
+  mrb_value hash;
+  gint64 fhits, fmisses;
+  int fsize;
+
+  hash = mrb_hash_new( mrb );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "hits" ), mrb_fixnum_value( rc->hits ) );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "misses" ), mrb_fixnum_value( rc->misses ) );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "size" ), mrb_fixnum_value( rc->lru.length ) );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "limit" ), mrb_fixnum_value( rc->limit ) );
+
+  fcache_stats( &fhits, &fmisses, &fsize );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "include_hits" ), mrb_fixnum_value( fhits ) );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "include_misses" ), mrb_fixnum_value( fmisses ) );
+  mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "include_size" ), mrb_fixnum_value( fsize ) );
+
+  return hash;
+}
+
+
+/**
+ * Enable (and reset) or disable Pstate stats.
+ *
+ * @param ps     Pstate.
+ * @param enable Enable stats.
+ */
+void mucgly_set_stats( pstate_t* ps, gboolean enable )
+{
+  if ( ps->stats )
+    {
+      stats_rem( ps->stats );
+      ps->stats = NULL;
+    }
+
+  if ( enable )
+    ps->stats = stats_new();
+}
+
+
+/**
+ * Mucgly.setstats method. Enable (and reset) or disable processing
+ * stats.
+ *
+ * @param obj    Not used.
+ * @param enable Enable stats.
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_sethookbeg( mrb_state* mrb, mrb_value self )
+mrb_mucgly_setstats( mrb_state* mrb, mrb_value self )
 {
-  char* str;
-  mrb_get_args( mrb, "z", &str );
-  sf_set_hook( ps_topfile( ruby_ps ), hook_beg, str );
+  pstate_t* ps = mucgly_ps( mrb );
+  mrb_bool enable;
+
+  mrb_get_args( mrb, "b", &enable );
+  mucgly_set_stats( ps, enable );
+
   return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.sethookend method. Set hookend.
+ * Mucgly.settrace method. Write trace events of all processing to
+ * file (Chrome trace-event JSON), or stop tracing.
  *
- * @param obj  Not used.
- * @param rstr Hookend string (Ruby String).
+ * @param obj      Not used.
+ * @param filename Trace file (or nil to stop).
  *
- * @return nil.
+ * @return true if tracing.
  */
 static mrb_value
-mrb_mucgly_sethookend( mrb_state* mrb, mrb_value self )
+mrb_mucgly_settrace( mrb_state* mrb, mrb_value self )
 {
-  char* str;
-  mrb_get_args( mrb, "z", &str );
-  sf_set_hook( ps_topfile( ruby_ps ), hook_end, str );
-  return mrb_nil_value();
+  char* filename;
+
+  mrb_get_args( mrb, "z!", &filename );
+
+  return mrb_bool_value( trace_open( filename ) );
 }
 
 
 /**
- * Mucgly.sethookesc method. Set hookesc.
+ * Mucgly.stats method. Get processing stats.
  *
- * @param obj  Not used.
- * @param rstr Hookesc string (Ruby String).
+ * @param obj Not used.
  *
- * @return nil.
+ * @return Stats as JSON (Ruby String), or nil if stats are disabled.
  */
 static mrb_value
-mrb_mucgly_sethookesc( mrb_state* mrb, mrb_value self )
+mrb_mucgly_stats( mrb_state* mrb, mrb_value self )
 {
-  char* str;
-  mrb_get_args( mrb, "z", &str );
-  sf_set_hook( ps_topfile( ruby_ps ), hook_esc, str );
-  return mrb_nil_value();
+  pstate_t* ps = mucgly_ps( mrb );
+  gchar* json;
+  mrb_value ret;
+
+  if ( !ps->stats )
+    return mrb_nil_value();
+
+  json = stats_json( ps );
+  ret = mrb_str_new_cstr( mrb, json );
+  g_free( json );
+
+  return ret;
 }
 
 
+
 /**
- * Mucgly.seteater method. Set eater.
+ * Mucgly.batch method. Expand all files in batch manifest with a
+ * pool of worker threads.
  *
- * @param obj  Not used.
- * @param rstr Eater string (Ruby String).
+ * @param obj      Not used.
+ * @param manifest Manifest file name (Ruby String).
+ * @param threads  Number of workers (default: number of processors).
  *
- * @return nil.
+ * @return Array of Hash with "infile", "outfile", "ok", "error" and "time".
  */
 static mrb_value
-mrb_mucgly_seteater( mrb_state* mrb, mrb_value self )
+mrb_mucgly_batch( mrb_state* mrb, mrb_value self )
 {
-  mrb_value tmp;
-  char* str;
+  char* manifest;
+  mrb_int threads = 0;
+  GPtrArray* jobs;
+  mrb_value ret;
 
-  mrb_get_args( mrb, "o", &tmp );
+  mrb_get_args( mrb, "z|i", &manifest, &threads );
 
-  if ( mrb_obj_is_kind_of( mrb, tmp, mrb->nil_class ) )
-    {
-      sf_set_eater( ps_topfile( ruby_ps ), NULL );
-    }
-  else if ( mrb_obj_is_kind_of( mrb, tmp, mrb->string_class ) )
+  jobs = batch_read( manifest );
+  if ( jobs == NULL )
+    mrb_raise( mrb, E_RUNTIME_ERROR, "Can't read batch manifest!" );
+
+  batch_run( jobs, threads );
+
+  ret = mrb_ary_new( mrb );
+
+  for ( guint i = 0; i < jobs->len; i++ )
     {
-      str = RSTRING_PTR( tmp );
-      sf_set_eater( ps_topfile( ruby_ps ), str );
+      batch_job_t* job = g_ptr_array_index( jobs, i );
+      int ai = mrb_gc_arena_save( mrb );
+      mrb_value hash;
+
+      hash = mrb_hash_new( mrb );
+      mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "infile" ), mrb_str_new_cstr( mrb, job->infile ) );
+      mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "outfile" ), mrb_str_new_cstr( mrb, job->outfile ) );
+      mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "ok" ), mrb_bool_value( job->ok ) );
+      mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "error" ),
+                    job->msg ? mrb_str_new_cstr( mrb, job->msg ) : mrb_nil_value() );
+      mrb_hash_set( mrb, hash, mrb_str_new_lit( mrb, "time" ),
+                    mrb_float_value( mrb, job->usecs / 1e6 ) );
+      mrb_ary_push( mrb, ret, hash );
+
+      mrb_gc_arena_restore( mrb, ai );
     }
-  else
-    {
-      mucgly_raise( ruby_ps, "error", "Eater must be a string or nil!" );
-   }
 
-  return mrb_nil_value();
+  g_ptr_array_free( jobs, TRUE );
+
+  return ret;
 }
 
 
 /**
- * Mucgly.multihook method. Add multihook pairs.
- *
- * Arg options:
- *  [ hb1, he1, su1 ], [ hb2, he2, su2 ], [ hb3, he3 ], ...
- *  [ hb1, he1, hb2, he2, hb3, he3 ]
- *  hb1, he1, hb2, he2, hb3, he3, ...
- *
- * @param obj  Not used.
- * @param ary  Array of hookpairs.
- *
- * @return nil.
+ * Set Pstate options from Ruby Hash. Options:
+ *  :cache       Number of compiled macro bodies kept.
+ *  :flush       Output flush policy (see Mucgly.setflush).
+ *  :flush_size  Pending chars limit for "size" and "stream" policy.
+ *  :flush_time  Pending time limit (ms) for "stream" policy.
+ *  :mcgc        Use precompiled templates.
+ *  :stats       Collect processing stats.
+ *  :depfile     Write Makefile dependencies of processed file.
+ *  :manifest    Write JSON dependency manifest of processed file.
+ *  :incremental Skip processing if outputs are up to date (manifest
+ *               defaults to output file name with DEPS_SUFFIX).
+ *  :if_changed  Replace output files atomically and only if changed.
+ *  :preload     Ruby file (or Array of files) to load once for all
+ *               processed files (see mucgly_preload).
+ *  :gc          MRuby GC mode (see Mucgly.setgc).
+ *  :gc_interval Macros between full GCs.
+ *  :parallel    Threads for parallel expansion of pure input
+ *               (true for all processors, see :parallel).
+ *  :pipelined   Read input and write output in background threads.
+ *
+ * @param mrb  MRuby.
+ * @param ps   Pstate.
+ * @param opts Options (or nil).
  */
-static mrb_value
-mrb_mucgly_multihook( mrb_state* mrb, mrb_value self )
+void mucgly_set_opts( mrb_state* mrb, pstate_t* ps, mrb_value opts )
 {
-  char* beg, *end, *susp;
+  mrb_value val;
+  mrb_int size = OF_WRITE_SIZE;
+  mrb_int msecs = 0;
 
-  mrb_value* argv;
-  int argc;
-  
-  mrb_get_args( mrb, "*", &argv, &argc );
-  
-  if ( mrb_obj_is_kind_of( mrb, argv[0], mrb->string_class ) )
+  if ( mrb_nil_p( opts ) )
+    return;
+
+  if ( !mrb_hash_p( opts ) )
+    mrb_raise( mrb, E_ARGUMENT_ERROR, "Options must be a Hash!" );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "cache" ) ) );
+  if ( mrb_fixnum_p( val ) )
     {
-      /* Even (hb&be pairs) number of strings. */
+      ps->rcache->limit = mrb_fixnum( val ) > 0 ? mrb_fixnum( val ) : 0;
+      rcache_evict( ps->rcache, mrb, ps->rcache->limit );
+    }
 
-      if ( ( argc % 2 ) == 0 )
-        {
-          for ( int i = 0; i < argc; i += 2 )
-            {
-              beg = RSTRING_PTR( argv[i] );
-              end = RSTRING_PTR( argv[i+1] );
-              sf_multi_hook( ps_topfile( ruby_ps ), beg, end, NULL );
-            }
-        }
-      else
-        {
-          mucgly_raise( ruby_ps, "error", "hookbeg/hookend pairs expected for multihook!" );
-        }
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "flush_size" ) ) );
+  if ( mrb_fixnum_p( val ) )
+    size = mrb_fixnum( val );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "flush_time" ) ) );
+  if ( mrb_fixnum_p( val ) )
+    msecs = mrb_fixnum( val );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "flush" ) ) );
+  if ( !mrb_nil_p( val ) )
+    mucgly_set_flush( mrb, ps, val, size, msecs );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "mcgc" ) ) );
+  if ( !mrb_nil_p( val ) )
+    ps->mcgc = mrb_test( val );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "stats" ) ) );
+  if ( !mrb_nil_p( val ) )
+    mucgly_set_stats( ps, mrb_test( val ) );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "depfile" ) ) );
+  if ( !mrb_nil_p( val ) )
+    {
+      g_free( ps->depfile );
+      ps->depfile = g_strdup( mrb_string_value_cstr( mrb, &val ) );
     }
-  else if ( argc == 1
-            && mrb_obj_is_kind_of( mrb, argv[0], mrb->array_class )
-            && ( RARRAY_LEN( argv[0] ) % 2 == 0 ) )
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "manifest" ) ) );
+  if ( !mrb_nil_p( val ) )
     {
-      
-      /* Even number of strings within an array. */
+      g_free( ps->manifest );
+      ps->manifest = g_strdup( mrb_string_value_cstr( mrb, &val ) );
+    }
 
-      for ( int i = 0; i < RARRAY_LEN( argv[0] ); i += 2 )
-        {
-          beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[0], i ) );
-          end = RSTRING_PTR( mrb_ary_ref( mrb, argv[0], i+1 ) );
-          sf_multi_hook( ps_topfile( ruby_ps ), beg, end, NULL );
-        }
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "incremental" ) ) );
+  if ( !mrb_nil_p( val ) )
+    ps->incremental = mrb_test( val );
 
-    }
-  else
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "if_changed" ) ) );
+  if ( !mrb_nil_p( val ) )
+    ps->if_changed = mrb_test( val );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "gc" ) ) );
+  if ( !mrb_nil_p( val ) )
+    mucgly_set_gc( ps, mrb_string_value_cstr( mrb, &val ), -1 );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "pipelined" ) ) );
+  if ( !mrb_nil_p( val ) )
+    mucgly_set_pipelined( ps, mrb_test( val ) );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "parallel" ) ) );
+  if ( mrb_fixnum_p( val ) )
+    ps->parallel = ( !ps->pure && mrb_fixnum( val ) > 1 ) ? mrb_fixnum( val ) : 0;
+  else if ( !mrb_nil_p( val ) )
+    mucgly_set_parallel( ps, mrb_test( val ) ? "" : "off" );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "gc_interval" ) ) );
+  if ( mrb_fixnum_p( val ) )
+    mucgly_set_gc( ps, NULL, mrb_fixnum( val ) > 0 ? mrb_fixnum( val ) : 0 );
+
+  val = mrb_hash_get( mrb, opts, mrb_symbol_value( mrb_intern_lit( mrb, "preload" ) ) );
+  if ( !mrb_nil_p( val ) )
     {
+      mrb_value files = val;
+      gpointer ud = mrb->ud;
 
-      /* Number of arrays with 2/3 entries each. */
+      if ( !mrb_array_p( val ) )
+        {
+          files = mrb_ary_new( mrb );
+          mrb_ary_push( mrb, files, val );
+        }
 
-      for ( int i = 0; i < argc; i++ )
+      /* Ruby methods of preloaded files use this Pstate. */
+      mrb->ud = ps;
+
+      for ( mrb_int i = 0; i < RARRAY_LEN( files ); i++ )
         {
-          if ( mrb_ary_len( mrb, argv[i] ) == 2 )
-            {
-              beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 0 ) );
-              end = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 1 ) );
-              sf_multi_hook( ps_topfile( ruby_ps ), beg, end, NULL );
-            }
-          else if ( mrb_ary_len( mrb, argv[i] ) == 3 )
-            {
-              beg = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 0 ) );
-              end = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 1 ) );
-              susp = RSTRING_PTR( mrb_ary_ref( mrb, argv[i], 2 ) );
-              sf_multi_hook( ps_topfile( ruby_ps ), beg, end, susp );
-            }
-          else
+          mrb_value file = mrb_ary_ref( mrb, files, i );
+          char* name = mrb_string_value_cstr( mrb, &file );
+
+          if ( !mucgly_preload( ps, name ) )
             {
-              mucgly_raise( ruby_ps, "error", "Array argument must hold either hookbeg/hookend pairs or triplets including suspension!" );
+              mrb->ud = ud;
+              mrb_raise( mrb, E_ARGUMENT_ERROR, "Can't preload Ruby file!" );
             }
         }
 
+      mrb->ud = ud;
     }
+}
+
 
+/**
+ * Set Pstate options (run by mrb_protect).
+ *
+ * @param mrb  MRuby.
+ * @param data Pstate and options (C pointer to array).
+ *
+ * @return nil.
+ */
+static mrb_value mucgly_set_opts_call( mrb_state* mrb, mrb_value data )
+{
+  mrb_value* args = mrb_cptr( data );
+  mucgly_set_opts( mrb, mrb_cptr( args[0] ), args[1] );
   return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.ifilename method. Gets current input file name.
+ * Create Pstate sharing the MRuby of the caller. Pstate is freed if
+ * options are invalid, and the exception is raised again.
  *
- * @param obj  Not used.
+ * @param mrb  MRuby.
+ * @param opts Options (or nil).
  *
- * @return Input file name (Ruby String).
+ * @return Pstate.
  */
-static mrb_value
-mrb_mucgly_ifilename( mrb_state* mrb, mrb_value self )
+static pstate_t*
+mucgly_processor_new( mrb_state* mrb, mrb_value opts )
 {
-  return mrb_str_new_cstr( mrb, ps_topfile(ruby_ps)->filename );
+  pstate_t* ps;
+  mrb_value args[2];
+  mrb_value exc;
+  mrb_bool err = FALSE;
+
+  ps = ps_new( NULL );
+  ps->mrb = mrb;
+  ps->own_mrb = FALSE;
+
+  args[0] = mrb_cptr_value( mrb, ps );
+  args[1] = opts;
+  exc = mrb_protect( mrb, mucgly_set_opts_call, mrb_cptr_value( mrb, args ), &err );
+
+  if ( err )
+    {
+      ps_rem( ps );
+      mrb_exc_raise( mrb, exc );
+    }
+
+  return ps;
 }
 
 
 /**
- * Mucgly.ilinenumber method. Gets current input file line.
+ * Raise processing error (if any).
  *
- * @param obj  Not used.
+ * @param mrb MRuby.
+ * @param msg Error message (or NULL). Message is freed.
+ */
+static void
+mucgly_processor_raise( mrb_state* mrb, gchar* msg )
+{
+  mrb_value err;
+
+  if ( msg )
+    {
+      err = mrb_str_new_cstr( mrb, msg );
+      g_free( msg );
+      mrb_raise( mrb, E_RUNTIME_ERROR, RSTRING_PTR( err ) );
+    }
+}
+
+
+/**
+ * Free Processor Pstate at garbage collection. Compiled macros are
+ * unregistered from GC roots of the shared MRuby (no-op when MRuby
+ * is closing, since globals are released first).
  *
- * @return Input file line number (Ruby Fixnum).
+ * @param mrb  MRuby.
+ * @param data Pstate.
  */
-static mrb_value
-mrb_mucgly_ilinenumber( mrb_state* mrb, mrb_value self )
+static void
+mucgly_processor_free( mrb_state* mrb, void* data )
 {
-  return mrb_fixnum_value( ps_topfile(ruby_ps)->lineno+1 );
+  pstate_t* ps = data;
+
+  if ( ps )
+    {
+      rcache_evict( ps->rcache, mrb, 0 );
+      ps_rem( ps );
+    }
 }
 
 
+/** Mucgly::Processor data type. */
+static const struct mrb_data_type mucgly_processor_type = {
+  "Mucgly::Processor", mucgly_processor_free
+};
+
+
 /**
- * Mucgly.ofilename method. Gets current output file name.
+ * Get Processor Pstate. Raise if Processor is closed.
  *
- * @param obj  Not used.
+ * @param mrb  MRuby.
+ * @param self Processor.
  *
- * @return Input file name (Ruby String).
+ * @return Pstate.
  */
-static mrb_value
-mrb_mucgly_ofilename( mrb_state* mrb, mrb_value self )
+static pstate_t*
+mucgly_processor_ps( mrb_state* mrb, mrb_value self )
 {
-  outfile_t* of;
-  of = ruby_ps->output->data;
-  return mrb_str_new_cstr( mrb, of->filename );
+  pstate_t* ps;
+
+  ps = mrb_data_get_ptr( mrb, self, &mucgly_processor_type );
+  if ( ps == NULL )
+    mrb_raise( mrb, E_RUNTIME_ERROR, "Mucgly::Processor is closed!" );
+
+  return ps;
 }
 
 
 /**
- * Mucgly.olinenumber method. Gets current output file line.
+ * Mucgly.process method. Process input file with new Pstate in the
+ * current MRuby.
  *
- * @param obj  Not used.
+ * @param obj     Not used.
+ * @param infile  Input file name (nil for stdin).
+ * @param outfile Output file name (nil for stdout).
+ * @param opts    Options (see Mucgly::Processor.new).
  *
- * @return Output file line number (Ruby Fixnum).
+ * @return nil.
  */
 static mrb_value
-mrb_mucgly_olinenumber( mrb_state* mrb, mrb_value self )
+mrb_mucgly_process( mrb_state* mrb, mrb_value self )
 {
-  outfile_t* of;
-  of = ruby_ps->output->data;
-  return mrb_fixnum_value( (of->lineno+1) );
+  char* infile;
+  char* outfile = NULL;
+  mrb_value opts = mrb_nil_value();
+  pstate_t* ps;
+  gchar* msg;
+
+  mrb_get_args( mrb, "z!|z!o", &infile, &outfile, &opts );
+
+  ps = mucgly_processor_new( mrb, opts );
+  msg = ps_process_trap( ps, infile, outfile );
+  ps_rem( ps );
+
+  mucgly_processor_raise( mrb, msg );
+
+  return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.pushinput method. Push new input stream.
+ * Mucgly.expand method. Process String with new Pstate in the
+ * current MRuby.
  *
  * @param obj  Not used.
- * @param rstr Input file name (Ruby String).
+ * @param src  Input (Ruby String).
+ * @param opts Options (see Mucgly::Processor.new).
  *
- * @return nil.
+ * @return Output (Ruby String).
  */
 static mrb_value
-mrb_mucgly_pushinput( mrb_state* mrb, mrb_value self )
+mrb_mucgly_expand( mrb_state* mrb, mrb_value self )
 {
-  char* str;
+  char* src;
+  mrb_int len;
+  mrb_value opts = mrb_nil_value();
+  pstate_t* ps;
+  gchar* msg;
+  mrb_value ret;
 
-  mrb_get_args( mrb, "z", &str );
+  mrb_get_args( mrb, "s|o", &src, &len, &opts );
 
-  fs_push_file_delayed( ruby_ps->fs, str );
-  ruby_ps->post_push = TRUE;
+  ps = mucgly_processor_new( mrb, opts );
+  msg = ps_process_str_trap( ps, src, len, &ret );
+  ps_rem( ps );
 
-  return mrb_nil_value();
+  mucgly_processor_raise( mrb, msg );
+
+  return ret;
 }
 
 
 /**
- * Mucgly.closeinput method. Pop input stream and close file stream.
+ * Mucgly::Processor.new method. Create Processor using the current
+ * MRuby. Compiled macros and other state persist between process
+ * calls.
  *
- * @param obj  Not used.
+ * @param self Processor.
+ * @param opts Options (optional, see mucgly_set_opts).
  *
- * @return nil.
+ * @return Processor.
  */
 static mrb_value
-mrb_mucgly_closeinput( mrb_state* mrb, mrb_value self )
+mrb_mucgly_processor_init( mrb_state* mrb, mrb_value self )
 {
-  ruby_ps->post_pop = TRUE;
-  return mrb_nil_value();
+  mrb_value opts = mrb_nil_value();
+  pstate_t* ps;
+
+  mrb_get_args( mrb, "|o", &opts );
+
+  ps = DATA_PTR( self );
+  if ( ps )
+    mucgly_processor_free( mrb, ps );
+
+  DATA_TYPE( self ) = &mucgly_processor_type;
+  DATA_PTR( self ) = NULL;
+
+  DATA_PTR( self ) = mucgly_processor_new( mrb, opts );
+
+  return self;
 }
 
 
 /**
- * Mucgly.pushoutput method. Push new output stream.
+ * Mucgly::Processor#process method. Process input file.
  *
- * @param obj  Not used.
- * @param rstr Output file name (Ruby String).
+ * @param self    Processor.
+ * @param infile  Input file name (nil for stdin).
+ * @param outfile Output file name (nil for stdout).
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_pushoutput( mrb_state* mrb, mrb_value self )
+mrb_mucgly_processor_process( mrb_state* mrb, mrb_value self )
 {
-  char* str;
+  pstate_t* ps = mucgly_processor_ps( mrb, self );
+  char* infile;
+  char* outfile = NULL;
 
-  mrb_get_args( mrb, "z", &str );
-  ps_push_file( ruby_ps, str );
+  mrb_get_args( mrb, "z!|z!", &infile, &outfile );
+
+  if ( mrb->ud == ps )
+    mrb_raise( mrb, E_RUNTIME_ERROR, "Mucgly::Processor is already processing!" );
+
+  mucgly_processor_raise( mrb, ps_process_trap( ps, infile, outfile ) );
 
   return mrb_nil_value();
 }
 
 
 /**
- * Mucgly.closeoutput method. Pop output stream and close file stream.
+ * Mucgly::Processor#expand method. Process String.
  *
- * @param obj  Not used.
+ * @param self Processor.
+ * @param src  Input (Ruby String).
  *
- * @return nil.
+ * @return Output (Ruby String).
  */
 static mrb_value
-mrb_mucgly_closeoutput( mrb_state* mrb, mrb_value self )
+mrb_mucgly_processor_expand( mrb_state* mrb, mrb_value self )
 {
-  ps_pop_file( ruby_ps );
-  return mrb_nil_value();
+  pstate_t* ps = mucgly_processor_ps( mrb, self );
+  char* src;
+  mrb_int len;
+  mrb_value ret;
+
+  mrb_get_args( mrb, "s", &src, &len );
+
+  if ( mrb->ud == ps )
+    mrb_raise( mrb, E_RUNTIME_ERROR, "Mucgly::Processor is already processing!" );
+
+  mucgly_processor_raise( mrb, ps_process_str_trap( ps, src, len, &ret ) );
+
+  return ret;
 }
 
 
 /**
- * Mucgly.block method. Block output.
+ * Mucgly::Processor#stats method. Get processing stats of all
+ * process calls.
  *
- * @param obj  Not used.
+ * @param self Processor.
  *
- * @return nil.
+ * @return Stats as JSON (Ruby String), or nil if stats are disabled.
  */
 static mrb_value
-mrb_mucgly_block( mrb_state* mrb, mrb_value self )
+mrb_mucgly_processor_stats( mrb_state* mrb, mrb_value self )
 {
-  ps_block_output( ruby_ps );
-  return mrb_nil_value();
+  pstate_t* ps = mucgly_processor_ps( mrb, self );
+  gchar* json;
+  mrb_value ret;
+
+  if ( !ps->stats )
+    return mrb_nil_value();
+
+  json = stats_json( ps );
+  ret = mrb_str_new_cstr( mrb, json );
+  g_free( json );
+
+  return ret;
 }
 
 
 /**
- * Mucgly.block method. Block output.
+ * Mucgly::Processor#close method. Free Processor resources.
  *
- * @param obj  Not used.
+ * @param self Processor.
  *
  * @return nil.
  */
 static mrb_value
-mrb_mucgly_unblock( mrb_state* mrb, mrb_value self )
+mrb_mucgly_processor_close( mrb_state* mrb, mrb_value self )
 {
-  ps_unblock_output( ruby_ps );
+  pstate_t* ps = DATA_PTR( self );
+
+  if ( ps )
+    {
+      if ( mrb->ud == ps )
+        mrb_raise( mrb, E_RUNTIME_ERROR, "Mucgly::Processor is processing!" );
+
+      ps_rem( ps );
+      DATA_PTR( self ) = NULL;
+    }
+
   return mrb_nil_value();
 }
 
 
-
 #define mrb_func_reg_none(klass,name) mrb_define_module_function( mrb, mrb_ ## klass, # name, mrb_  ## klass ## _ ## name, MRB_ARGS_NONE() );
 #define mrb_func_reg_req(klass,name,args) mrb_define_module_function( mrb, mrb_ ## klass, # name, mrb_ ## klass ## _ ## name, MRB_ARGS_REQ(args) );
 #define mrb_func_reg_any(klass,name) mrb_define_module_function( mrb, mrb_ ## klass, # name, mrb_  ## klass ## _ ## name, MRB_ARGS_ANY() );
+#define mrb_func_reg_opt(klass,name,req,opt) mrb_define_module_function( mrb, mrb_ ## klass, # name, mrb_ ## klass ## _ ## name, MRB_ARGS_ARG(req,opt) );
 
 
 void
 mrb_mruby_mucgly_gem_init( mrb_state* mrb )
 {
+  static gsize trace_init = 0;
   struct RClass *mrb_mucgly;
+  struct RClass *mrb_processor;
+
+  /* Tracing is enabled from environment, and umask is read (once
+     per process). */
+  if ( g_once_init_enter( &trace_init ) )
+    {
+      const gchar* env = g_getenv( "MUCGLY_TRACE" );
+      if ( env && env[0] && strcmp( env, "0" ) )
+        trace_open( env );
+      outfile_init_umask();
+      g_once_init_leave( &trace_init, 1 );
+    }
 
   mrb_mucgly = mrb_define_module( mrb, "Mucgly" );
 
@@ -2445,11 +9693,34 @@ mrb_mruby_mucgly_gem_init( mrb_state* mrb )
 
   mrb_func_reg_req(  mucgly, pushinput, 1 );
   mrb_func_reg_none( mucgly, closeinput );
+  mrb_func_reg_req(  mucgly, pushinputstr, 1 );
+  mrb_func_reg_req(  mucgly, rawinclude, 1 );
   mrb_func_reg_req(  mucgly, pushoutput, 1 );
+  mrb_func_reg_none( mucgly, pushoutputstr );
   mrb_func_reg_none( mucgly, closeoutput );
 
   mrb_func_reg_none( mucgly, block );
   mrb_func_reg_none( mucgly, unblock );
+  mrb_func_reg_opt(  mucgly, setflush, 1, 2 );
+  mrb_func_reg_opt(  mucgly, setgc, 1, 1 );
+
+  mrb_func_reg_req(  mucgly, setcache, 1 );
+  mrb_func_reg_none( mucgly, cachestats );
+  mrb_func_reg_req(  mucgly, setstats, 1 );
+  mrb_func_reg_none( mucgly, stats );
+  mrb_func_reg_req(  mucgly, settrace, 1 );
+
+  mrb_func_reg_opt(  mucgly, batch, 1, 1 );
+  mrb_func_reg_opt(  mucgly, process, 1, 2 );
+  mrb_func_reg_opt(  mucgly, expand, 1, 1 );
+
+  mrb_processor = mrb_define_class_under( mrb, mrb_mucgly, "Processor", mrb->object_class );
+  MRB_SET_INSTANCE_TT( mrb_processor, MRB_TT_DATA );
+  mrb_define_method( mrb, mrb_processor, "initialize", mrb_mucgly_processor_init, MRB_ARGS_OPT(1) );
+  mrb_define_method( mrb, mrb_processor, "process", mrb_mucgly_processor_process, MRB_ARGS_ARG(1,1) );
+  mrb_define_method( mrb, mrb_processor, "expand", mrb_mucgly_processor_expand, MRB_ARGS_REQ(1) );
+  mrb_define_method( mrb, mrb_processor, "stats", mrb_mucgly_processor_stats, MRB_ARGS_NONE() );
+  mrb_define_method( mrb, mrb_processor, "close", mrb_mucgly_processor_close, MRB_ARGS_NONE() );
 }
 
 
@@ -20,10 +20,35 @@
  * of an input file. It contains character position information for
  * error reporting.
  *
+ * Pstate is attached to its MRuby through the MRuby user data
+ * (mrb->ud). There is no global state, hence independent Pstates
+ * (each with own MRuby) may be processed in parallel. Pstate may
+ * also share the MRuby of its host (Mucgly::Processor), and it is
+ * attached to MRuby only for the duration of processing.
+ *
  * Outfile is part of the Pstate output file stack. Each Outfile
  * represents the output file state. Outfile stack is needed to
  * implement redirection of output stream to different files. Output
- * files has to be controlled explicitly from Mucgly files.
+ * files has to be controlled explicitly from Mucgly files. Input and
+ * output may also be memory (Ruby Strings) instead of files.
+ *
+ * Rcache is part of the Pstate. It keeps compiled Ruby code of macro
+ * bodies, so that repeated macros are not re-parsed and re-compiled.
+ *
+ * Batch expands a list of input files with a pool of worker
+ * threads. Each worker has its own Pstate (and MRuby). Errors in one
+ * input file are trapped, and reported as status of the file.
+ *
+ * Fcache is a process wide cache of input file content. Repeatedly
+ * included files are mapped only once, and Stackfiles share the
+ * read-only content.
+ *
+ * Mcgc records the processing of an input file as a precompiled
+ * template (".mcgc" file). The template is replayed instead of
+ * processing the input, if none of the input files have changed.
+ *
+ * Stats is an optional part of the Pstate. It collects counters and
+ * timing of processing, and it is reported as JSON.
  */
 
 
@@ -36,13 +61,65 @@
 /** Default value for hookesc. */
 #define HOOKESC_DEFAULT "\\"
 
-/** Multihook count limit, also array size. */
-#define MULTI_LIMIT 128
+/** Initial multihook array size (grows as needed). */
+#define MULTI_INIT 16
+
+/** Initial curhook stack size (grows as needed). */
+#define CURHOOK_INIT 8
+
+/** Arena block size for per-file allocations. */
+#define ARENA_BLOCK 4096
+
+/** Read block size for streaming (non-mappable) input. */
+#define SF_READ_SIZE (64*1024)
+
+/** Write buffer size for output files. */
+#define OF_WRITE_SIZE (64*1024)
+
+/** Number of blocks in pipelined I/O ring (see :pipelined). */
+#define IOPIPE_BLOCKS 8
+
+/** Default number of compiled macro bodies in Rcache. */
+#define RCACHE_LIMIT 1024
+
+/** Max number of files in include file cache. */
+#define FCACHE_LIMIT 256
+
+/** File name suffix of compiled Ruby files in Mrbcache. */
+#define MRBCACHE_SUFFIX ".mrb"
+
+/** File name suffix of precompiled templates. */
+#define MCGC_SUFFIX ".mcgc"
+
+/** Precompiled template file identification. */
+#define MCGC_MAGIC "MCGC"
+
+/** Precompiled template format version. */
+#define MCGC_VERSION 2
+
+/** File name suffix of dependency manifest (next to output file) in incremental mode. */
+#define DEPS_SUFFIX ".deps.json"
+
+/** Number of files expanded by batch worker before its MRuby is recreated. */
+#define BATCH_RECYCLE 256
+
+/** Min size of input segment in parallel expansion (see :parallel). */
+#define PAR_SEGMENT_SIZE (1024*1024)
+
+/** Max length of macro content in trace events. */
+#define TRACE_BODY_MAX 40
+
+/** Max length of internal command name. */
+#define CMD_NAME_MAX 64
+
+/** Number of slowest macro call sites in stats report. */
+#define STATS_TOP 10
 
 
 /**
  * Pair of hooks for macro beginning and end. Plus optional suspension
- * marker.
+ * marker. Pairs are interned in the Stackfile arena and never
+ * modified, hence they are shared by pointer.
  */
 typedef struct hookpair_s {
   gchar* beg;                   /**< Hookbeg for macro. */
@@ -52,33 +129,50 @@ typedef struct hookpair_s {
 
 
 /**
- * Stackfile is an entry in the Filestack. Stackfile is the input file
- * for Mucgly.
+ * Bump allocator for per-file allocations. Blocks are chained through
+ * their first word and released all at once with the arena. Strings
+ * and hookpairs are interned, i.e. equal content is stored once.
  */
-typedef struct stackfile_s {
+typedef struct arena_s {
+  gpointer blocks;              /**< Latest block (chain head). */
+  gchar* pos;                   /**< Next free byte in latest block. */
+  gsize left;                   /**< Free bytes in latest block. */
+  GHashTable* strs;             /**< Interned strings. */
+  GHashTable* pairs;            /**< Interned hookpairs. */
+} arena_t;
 
-  gchar* filename;     /**< Filename. */
-  FILE* fh;            /**< IO stream handle. */
-  GString* buf;        /**< Put-back buffer (oldest-is-last). */
 
-  int lineno;          /**< Line number (0->). */
-  int column;          /**< Line column (0->). */
-  int old_column;      /**< Prev column (used with putback). */
+/**
+ * Trie node for multihook hookbeg matching. Nodes are stored in an
+ * array, and node 0 is the root.
+ */
+typedef struct hooknode_s {
+  guchar c;                     /**< Node char. */
+  int child;                    /**< First child (0 for none). */
+  int sibling;                  /**< Next sibling (0 for none). */
+  int pair;                     /**< Pair with hookbeg ending here (-1 for none). */
+} hooknode_t;
 
-  gboolean macro;      /**< Macro active. */
-  int macro_line;      /**< Macro start line. */
-  int macro_col;       /**< Macro start column. */
-  gboolean eat_tail;   /**< Eat the char after macro (if not EOF). */
 
-  hookpair_t hook;     /**< Pair of hooks for macro boundary. */
+/**
+ * Hook configuration. Stackfiles share the configuration of the
+ * parent file by reference, and copy it on first modification (see
+ * sf_own_hooks). Storage is released with the last reference.
+ */
+typedef struct hookcfg_s {
+  int refcnt;          /**< Number of Stackfiles referring (Pstate local). */
+  arena_t* arena;      /**< Storage for hookpairs and hookesc. */
+
+  hookpair_t* hook;    /**< Pair of hooks for macro boundary. */
   gchar* hookesc;      /**< Hookesc for input file. */
-  gchar* eater;        /**< Eater. */
 
-  hookpair_t* multi;   /**< Pairs of hooks for multi-hooking. */
+  hookpair_t** multi;  /**< Pairs of hooks for multi-hooking. */
   int     multi_cnt;   /**< Number of pairs in multi-hooking. */
+  int     multi_size;  /**< Allocated number of pairs. */
 
-  /** Current hook, as stack to support nesting macros. */
-  GList* curhook;
+  hooknode_t* trie;    /**< Hookbeg matcher for multi-hooking. */
+  int     trie_cnt;    /**< Number of trie nodes. */
+  int     trie_size;   /**< Allocated number of trie nodes. */
 
   /** Hookesc is same as hookbeg. Speed-up for input processing. */
   gboolean hook_esc_eq_beg;
@@ -89,10 +183,155 @@ typedef struct stackfile_s {
   /** Lookup-table for the first chars of hooks. Speeds up input processing. */
   guchar hook_1st_chars[ 256 ];
 
+  /** Distinct first chars of hooks (first 4, padded). Used for scanning. */
+  guchar hook_1st_list[ 4 ];
+
+  /** Number of distinct first chars of hooks. */
+  int hook_1st_cnt;
+
+} hookcfg_t;
+
+
+/** Include file cache entry. */
+typedef struct fcache_entry_s {
+  gchar* path;                  /**< File name (key). */
+  GMappedFile* map;             /**< File content. */
+  gint64 mtime;                 /**< Modification time at mapping (ns). */
+  gint64 size;                  /**< Size at mapping. */
+  guint64 ino;                  /**< Inode at mapping. */
+  guint64 dev;                  /**< Device at mapping. */
+  GList link;                   /**< Link in LRU queue. */
+} fcache_entry_t;
+
+
+/** Block in pipelined I/O ring. */
+typedef struct iopipe_block_s {
+  gchar* data;        /**< Block data. */
+  gsize len;          /**< Number of valid chars. */
+  gsize pos;          /**< Consumed chars. */
+} iopipe_block_t;
+
+
+/**
+ * Iopipe is a bounded single-producer single-consumer ring of blocks
+ * between the expansion thread and an I/O thread (reader or
+ * writer). Ring indeces are updated with atomics, and the lock is
+ * used only for sleeping when the ring is full or empty.
+ */
+typedef struct iopipe_s {
+  iopipe_block_t block[ IOPIPE_BLOCKS ]; /**< Ring. */
+  gint head;          /**< Blocks produced. */
+  gint tail;          /**< Blocks consumed. */
+  gint waiting;       /**< Number of sleeping sides. */
+  gint eof;           /**< Producer done. */
+  gint stop;          /**< Consumer done (reader only). */
+  gboolean reader;    /**< Reader (otherwise writer). */
+  gboolean err;       /**< Write failed. */
+  int fd;             /**< File descriptor. */
+  int wake[2];        /**< Stop wakeup pipe of reader (or -1). */
+  gsize size;         /**< Block size. */
+  GThread* thread;    /**< I/O thread. */
+  GMutex lock;        /**< Sleep lock. */
+  GCond cond;         /**< Ring index change. */
+} iopipe_t;
+
+
+struct stackfile_s;
+
+/**
+ * Input wait callback. Called before reading more streaming input.
+ *
+ * @param sf   Stackfile.
+ * @param data Callback data.
+ */
+typedef void (*sf_wait_t)( struct stackfile_s* sf, gpointer data );
+
+
+/**
+ * Stackfile is an entry in the Filestack. Stackfile is the input file
+ * for Mucgly.
+ */
+typedef struct stackfile_s {
+
+  gchar* filename;     /**< Filename. */
+  FILE* fh;            /**< IO stream handle (streaming input only). */
+  GMappedFile* map;    /**< Mapped file (regular file input only). */
+  gchar* data;         /**< Input data, mapped file or read block. */
+  gsize data_len;      /**< Number of valid bytes in data. */
+  gsize data_pos;      /**< Read cursor within data. */
+  gsize data_size;     /**< Allocated data size (streaming input only). */
+  gboolean data_eof;   /**< EOF reached (streaming input only). */
+  gboolean data_own;   /**< Memory data is freed with Stackfile. */
+  sf_wait_t wait;      /**< Input wait callback (or NULL). */
+  gpointer wait_data;  /**< Input wait callback data. */
+  iopipe_t* iop;       /**< Reader thread (pipelined streaming input, or NULL). */
+
+  gint64 data_off;     /**< Input offset of data (streaming drops consumed data). */
+  gint64 nl_off;       /**< Input offset up to which newlines are counted. */
+  gint64 nl_cnt;       /**< Newlines counted before nl_off. */
+  gint64 nl_line;      /**< Input offset of the line start before nl_off. */
+  gint64 line_base;    /**< Line number at position base (0->). */
+  gint64 col_base;     /**< Line column at position base (0->). */
+
+  gboolean macro;      /**< Macro active. */
+  gint64 macro_line;   /**< Macro start line. */
+  gint64 macro_col;    /**< Macro start column. */
+  gboolean eat_tail;   /**< Eat the char after macro (if not EOF). */
+
+  hookcfg_t* cfg;      /**< Hooks (shared with parent until modified). */
+  gchar* eater;        /**< Eater. */
+
+  /** Current hook, as stack to support nesting macros. */
+  hookpair_t** curhook;
+  int curhook_cnt;     /**< Depth of curhook stack. */
+  int curhook_size;    /**< Allocated curhook stack size. */
 } stackfile_t;
 
 
 
+/** Precompiled template event types. */
+typedef enum mcgc_ev_e { mcgc_end, mcgc_lit, mcgc_ruby, mcgc_cmd, mcgc_pop } mcgc_ev_t;
+
+
+/**
+ * Mcgc is the recorder of a precompiled template. Processing is
+ * recorded as events: literal output, Ruby macros (with compiled
+ * code), internal commands and input file ends. Output from Ruby is
+ * not recorded, since Ruby is re-executed at replay.
+ */
+typedef struct mcgc_s {
+  gchar* filename;     /**< Input file name. */
+  GPtrArray* deps;     /**< Input files read (input file first). */
+  GString* ev;         /**< Encoded events. */
+  gsize lit;           /**< Length position of open literal event (0 for none). */
+  int mute;            /**< Output recording disabled (within Ruby). */
+} mcgc_t;
+
+
+/**
+ * Deps is the dependency recorder of input file processing. All
+ * files read as input, sourced Ruby files and output files are
+ * recorded for the dependency files (see ps_deps_end).
+ */
+typedef struct deps_s {
+  gchar* infile;       /**< Input file name. */
+  gchar* depfile;      /**< Makefile dependency file name (or NULL). */
+  gchar* manifest;     /**< JSON manifest file name (or NULL). */
+  GPtrArray* inputs;   /**< Input files (input file first). */
+  GPtrArray* sources;  /**< Sourced Ruby files. */
+  GPtrArray* outputs;  /**< Output files (output file first). */
+} deps_t;
+
+
+/** Read cursor for precompiled template. */
+typedef struct mcgc_rd_s {
+  const gchar* pos;    /**< Read position. */
+  const gchar* end;    /**< End of data. */
+  gboolean err;        /**< Read beyond data end. */
+} mcgc_rd_t;
+
+
+
 /**
  * Filestack is a stack of files (stackfile_t). Macro processing
  * starts at base file. The base file is allowed to include other
@@ -103,6 +342,14 @@ typedef struct stackfile_s {
  */
 typedef struct filestack_s {
   GList* file;           /**< Stack of files. */
+  stackfile_t* base;     /**< Hooks for base file (or NULL for defaults). */
+  mcgc_t* rec;           /**< Template recorder (or NULL). */
+  deps_t* deps;          /**< Dependency recorder (or NULL). */
+  gboolean replay;       /**< Template replay, files are not read. */
+  sf_wait_t wait;        /**< Input wait callback for pushed files. */
+  gpointer wait_data;    /**< Input wait callback data. */
+  sf_wait_t pop;         /**< Pop callback (with wait_data), before file is freed. */
+  gboolean pipelined;    /**< Pipelined I/O for pushed files (see :pipelined). */
 } filestack_t;
 
 
@@ -114,12 +361,92 @@ typedef struct filestack_s {
  */
 typedef struct outfile_s {
   gchar* filename;  /**< Filename. */
+  gchar* tmpname;   /**< Temporary file until commit (or NULL). */
   FILE* fh;         /**< Stream handle. */
   int lineno;       /**< Line number (0->). */
   gboolean blocked; /**< Blocked output for IO stream. */
+  gchar* wbuf;      /**< Write buffer. */
+  gsize wlen;       /**< Number of pending chars in write buffer. */
+  gint64 wtime;     /**< Time of oldest pending write (0 for none). */
+  mrb_state* mrb;   /**< MRuby of memory output (or NULL for stream). */
+  mrb_value rstr;   /**< Memory output (Ruby String). */
+  iopipe_t* iop;    /**< Writer thread (pipelined stream, or NULL). */
 } outfile_t;
 
 
+/** Output flush policy. */
+typedef enum flush_e {
+  flush_none = 0,   /**< Flush when write buffer is full. */
+  flush_write = 1,  /**< Flush after each write (same as TRUE). */
+  flush_line,       /**< Flush after writes that complete a line. */
+  flush_size,       /**< Flush when flush_size chars are pending. */
+  flush_stream,     /**< Flush for prompt streaming (see ps_apply_flush). */
+} flush_t;
+
+
+
+/**
+ * Rcache entry, i.e. compiled macro body.
+ */
+typedef struct rcache_entry_s {
+  gchar* body;          /**< Macro body (also the key). */
+  struct RProc* proc;   /**< Compiled body (GC registered). */
+  GList link;           /**< Link in LRU queue (data is entry). */
+} rcache_entry_t;
+
+
+/**
+ * Rcache is a cache of compiled macro bodies with LRU replacement.
+ */
+typedef struct rcache_s {
+  GHashTable* table;    /**< Entries by body text. */
+  GQueue lru;           /**< Entries, most recently used first. */
+  int limit;            /**< Max number of entries (0 disables cache). */
+  gint64 hits;          /**< Lookups with compiled body available. */
+  gint64 misses;        /**< Lookups that needed compilation. */
+} rcache_t;
+
+
+/** Macro types for stats. */
+typedef enum stats_macro_e {
+  stats_cmd,                    /**< Internal command (":"). */
+  stats_var,                    /**< Variable output ("."). */
+  stats_postpone,               /**< Postponed macro ("#"). */
+  stats_comment,                /**< Comment ("/"). */
+  stats_ruby,                   /**< Ruby code. */
+  stats_macro_cnt               /**< Number of macro types. */
+} stats_macro_t;
+
+
+/** Stats of macro call site. */
+typedef struct stats_site_s {
+  gchar* filename;              /**< File of macro. */
+  gint64 line;                  /**< Macro start line (0->). */
+  gint64 col;                   /**< Macro start column (0->). */
+  gint64 count;                 /**< Number of evaluations. */
+  gint64 usecs;                 /**< Total evaluation time. */
+} stats_site_t;
+
+
+/**
+ * Processing stats of Pstate. Enabled with MUCGLY_STATS environment
+ * variable or from Ruby (Mucgly.setstats).
+ */
+typedef struct stats_s {
+  gint64 bytes_in;              /**< Input chars consumed. */
+  gint64 bytes_out;             /**< Output chars written. */
+  gint64 hook_checks;           /**< Hook match attempts. */
+  gint64 hook_misses;           /**< Failed hook match attempts. */
+  gint64 macros[ stats_macro_cnt ]; /**< Evaluated macros by type. */
+  gint64 total_usecs;           /**< Time in processing. */
+  gint64 ruby_usecs;            /**< Time in Ruby execution. */
+  gint64 nested_usecs;          /**< Time in processing nested in Ruby. */
+  gboolean in_process;          /**< Processing is active. */
+  gint64 full_gcs;              /**< Periodic full GCs run. */
+  GHashTable* sites;            /**< Macro call sites by "file:line:col". */
+  GString* key;                 /**< Call site key buffer. */
+} stats_t;
+
 
 /**
  * Parser state for Mucgly.
@@ -127,25 +454,146 @@ typedef struct outfile_s {
 typedef struct pstate_s {
   filestack_t* fs;    /**< Stack of input streams. */
 
-  GString* check_buf; /**< Preview buffer. */
   GString* macro_buf; /**< Macro content buffer. */
-  GString* match_buf; /**< Match str buffer. */
+  const gchar* span;  /**< Macro content in input after macro_buf (or NULL). */
+  gsize span_len;     /**< Span length. */
+  stackfile_t* span_sf; /**< Input of span. */
 
   int in_macro;       /**< Processing within macro. */
   int suspension;     /**< Suspension level. */
 
   GList* output;      /**< Stack of output streams. */
 
-  gboolean flush;     /**< Flush out-stream immediately. */
+  flush_t flush;      /**< Out-stream flush policy. */
+  gsize flush_size;   /**< Pending chars limit for flush_size/stream policy. */
+  gint64 flush_time;  /**< Pending time limit (usecs) for flush_stream policy. */
 
   gboolean post_push; /**< Move up in fs after macro processing. */
   gboolean post_pop;  /**< Move down in fs after macro processing. */
 
   mrb_state* mrb;               /**< MRuby. */
+  gboolean own_mrb;             /**< MRuby is closed with Pstate. */
+  rcache_t* rcache;             /**< Compiled macro bodies. */
+  gboolean mcgc;                /**< Use precompiled templates. */
+  stats_t* stats;               /**< Processing stats (or NULL). */
+  gboolean incremental;         /**< Skip processing of up to date outputs. */
+  gchar* depfile;               /**< Makefile dependency file name (or NULL). */
+  gchar* manifest;              /**< JSON manifest file name (or NULL). */
+  gboolean if_changed;          /**< Commit output files only if changed. */
+  GHashTable* preload;          /**< Preloaded Ruby files to SHA-1 (or NULL). */
+  gint64 gc_interval;           /**< Macros between full GCs (0 for none). */
+  gint64 gc_macros;             /**< Macros since last full GC. */
+  int parallel;                 /**< Threads for parallel expansion (0 for none). */
+  struct par_s* par;            /**< Parallel workers (or NULL). */
+  stackfile_t* par_sf;          /**< Input of last parallel region. */
+  gsize par_skip;               /**< Input position to resume parallel check. */
+  GPtrArray* sources;           /**< Loaded Ruby files. */
+  gboolean pure;                /**< Parallel worker, i.e. streams are fixed. */
 
 } pstate_t;
 
 
+/**
+ * Error trap. Errors exit the process, unless a trap is set for the
+ * current thread. With a trap, the error message is stored and
+ * control returns to the trap point.
+ */
+typedef struct mucgly_trap_s {
+  jmp_buf env;        /**< Return point. */
+  GString* msg;       /**< Error message. */
+} mucgly_trap_t;
+
+
+/** Batch job, i.e. expansion of one input file. */
+typedef struct batch_job_s {
+  gchar* infile;      /**< Input file name. */
+  gchar* outfile;     /**< Output file name. */
+  gboolean ok;        /**< Expansion succeeded. */
+  gchar* msg;         /**< Error message (or NULL). */
+  gint64 usecs;       /**< Expansion time in microseconds. */
+} batch_job_t;
+
+
+/** Batch worker state, one per worker thread. */
+typedef struct batch_worker_s {
+  pstate_t* ps;       /**< Worker Pstate (with own MRuby). */
+  int jobs;           /**< Jobs processed with current Pstate. */
+} batch_worker_t;
+
+
+/** Parallel worker state. */
+typedef struct par_worker_s {
+  pstate_t* ps;       /**< Worker Pstate (with own MRuby, or NULL). */
+  int region;         /**< Region of worker hooks. */
+  guint sources;      /**< Ruby files loaded from main Pstate. */
+} par_worker_t;
+
+
+/** Parallel expansion state of Pstate. */
+typedef struct par_s {
+  int threads;        /**< Number of workers. */
+  GThreadPool* pool;  /**< Segment expansion threads. */
+  par_worker_t* workers; /**< Workers. */
+  GAsyncQueue* idle;  /**< Idle workers. */
+  GPtrArray* sources; /**< Ruby files loaded by main Pstate. */
+  hookcfg_t* cfg;     /**< Hooks of current region. */
+  int region;         /**< Current region. */
+  GMutex lock;        /**< Segment completion lock. */
+  GCond cond;         /**< Segment completion signal. */
+} par_t;
+
+
+/** Input segment in parallel expansion. */
+typedef struct par_seg_s {
+  const gchar* filename; /**< Input name. */
+  const gchar* data;  /**< Segment data (in input). */
+  gsize len;          /**< Segment length. */
+  gint64 lineno;      /**< Line at segment start. */
+  gint64 column;      /**< Column at segment start. */
+  par_t* par;         /**< Parallel state. */
+  par_worker_t* worker; /**< Expanding worker. */
+  GString* out;       /**< Output (or NULL). */
+  gchar* msg;         /**< Error message (or NULL). */
+  gboolean done;      /**< Expansion completed. */
+} par_seg_t;
+
+
+/**
+ * Internal command function, called for ":name arg" macro.
+ *
+ * @param ps   Pstate.
+ * @param arg  Command argument.
+ * @param data Command data.
+ *
+ * @return TRUE if input processing should be aborted.
+ */
+typedef gboolean (*mucgly_cmd_func_t)( pstate_t* ps, gchar* arg, gpointer data );
+
+
+/** Internal command. */
+typedef struct mucgly_cmd_s {
+  const gchar* name;            /**< Command name (without ':'). */
+  gsize len;                    /**< Name length. */
+  mucgly_cmd_func_t func;       /**< Command function. */
+  gpointer data;                /**< Data for function. */
+  gboolean record;              /**< Record to template (re-execute at replay). */
+} mucgly_cmd_t;
+
+
+/** Function run with errors trapped (see ps_trap). */
+typedef void (*ps_func_t)( pstate_t* ps, gpointer data );
+
+
+/** Arguments for trapped processing (see ps_process_trap). */
+typedef struct ps_trap_args_s {
+  gchar* infile;      /**< Input file name. */
+  gchar* outfile;     /**< Output file name (or NULL). */
+  const gchar* src;   /**< Input String. */
+  gsize len;          /**< Input String length. */
+  mrb_value ret;      /**< Output String. */
+} ps_trap_args_t;
+
+
 /** Hook type enum. */
 typedef enum hook_e { hook_none, hook_end, hook_beg, hook_esc } hook_t;
 
@@ -156,49 +604,120 @@ typedef enum hook_e { hook_none, hook_end, hook_beg, hook_esc } hook_t;
 /** Current stackfile from pstate_t (for convenience). */
 #define ps_topfile(ps)   ((stackfile_t*)(ps)->fs->file->data)
 
+/** Input offset of Stackfile read cursor. */
+#define sf_offset(sf)    ((sf)->data_off + (gint64)(sf)->data_pos)
+
 /** Current stackfile from filestack_t (for convenience). */
 #define fs_topfile(fs) ((stackfile_t*)(fs)->file->data)
 
 
-extern stackfile_t* stack_default;
-
-/** Pointer to current file. Useful for debugging. */
-extern stackfile_t* csf;
-
-/** Ruby side reference to parser. */
-extern pstate_t* ruby_ps;
-
 
 int len_str_cmp( char* str1, char* str2 );
+gsize mucgly_count_lines( const gchar* str, gsize len, const gchar** last );
 void mucgly_user_info( stackfile_t* sf, char* infotype, char* format, va_list ap );
 void mucgly_warn( stackfile_t* sf, char* format, ... );
 void mucgly_error( stackfile_t* sf, char* format, ... );
 void mucgly_fatal( stackfile_t* sf, char* format, ... );
-hookpair_t* hookpair_cpy( hookpair_t* from, hookpair_t* to );
-void hookpair_del( hookpair_t* pair );
+void mucgly_exit( stackfile_t* sf, char* infotype, char* format, va_list ap );
+void mucgly_set_trap( mucgly_trap_t* trap );
+void mucgly_rethrow( gchar* msg );
+arena_t* arena_new( void );
+void arena_rem( arena_t* arena );
+gpointer arena_alloc( arena_t* arena, gsize size );
+gchar* arena_strdup( arena_t* arena, const gchar* str );
+guint hookpair_hash( gconstpointer key );
+gboolean hookpair_equal( gconstpointer a, gconstpointer b );
+hookpair_t* arena_pair( arena_t* arena, const gchar* beg, const gchar* end, const gchar* susp );
+hookcfg_t* hookcfg_new( void );
+hookcfg_t* hookcfg_ref( hookcfg_t* hc );
+void hookcfg_unref( hookcfg_t* hc );
+hookcfg_t* hookcfg_copy( hookcfg_t* from );
+void hookcfg_update_cache( hookcfg_t* hc );
+void hookcfg_clear_multi( hookcfg_t* hc );
+void hookcfg_trie_add( hookcfg_t* hc, const char* beg, int pair );
+gboolean fcache_match( fcache_entry_t* e, GStatBuf* st );
+GMappedFile* fcache_get( const gchar* path, GStatBuf* st );
+void fcache_evict( int limit );
+void fcache_stats( gint64* hits, gint64* misses, int* size );
 stackfile_t* sf_new( gchar* filename, stackfile_t* inherit );
+stackfile_t* sf_new_data( gchar* name, gchar* data, gsize len, stackfile_t* inherit );
+void sf_init_hooks( stackfile_t* sf, stackfile_t* inherit );
 void sf_mark_macro( stackfile_t* sf );
 void sf_unmark_macro( stackfile_t* sf );
 void sf_rem( stackfile_t* sf );
+gboolean sf_ready( stackfile_t* sf );
+gsize sf_fill( stackfile_t* sf, gsize n );
+void sf_count_lines( stackfile_t* sf, gint64 off );
+void sf_position( stackfile_t* sf, gint64* line, gint64* col );
+gint64 sf_line( stackfile_t* sf );
+void sf_set_position( stackfile_t* sf, gint64 line, gint64 col );
+void sf_eat_tail( stackfile_t* sf );
 int sf_get( stackfile_t* sf );
-gboolean sf_put( stackfile_t* sf, char c );
+int sf_peek( stackfile_t* sf, gsize off );
+gboolean sf_match( stackfile_t* sf, const gchar* str, gsize len );
+void sf_skip( stackfile_t* sf, gsize n );
+gsize sf_scan_plain( stackfile_t* sf );
+gchar* sf_get_plain( stackfile_t* sf, gsize* len );
+hookcfg_t* sf_own_hooks( stackfile_t* sf );
 void sf_set_hook( stackfile_t* sf, hook_t hook, char* value );
 void sf_set_eater( stackfile_t* sf, char* value );
-void sf_multi_hook( stackfile_t* sf, const char* beg, const char* end, const char* susp );
+int sf_match_multi( stackfile_t* sf, gsize* len );
+gboolean sf_multi_hook( stackfile_t* sf, const char* beg, const char* end, const char* susp );
 filestack_t* fs_new( void );
 filestack_t* fs_rem( filestack_t* fs );
+void fs_push_stackfile( filestack_t* fs, stackfile_t* sf );
 void fs_push_file( filestack_t* fs, gchar* filename );
 void fs_push_file_delayed( filestack_t* fs, gchar* filename );
+void fs_push_stackfile_delayed( filestack_t* fs, stackfile_t* sf );
 void fs_pop_file( filestack_t* fs );
 int fs_get( filestack_t* fs );
 int fs_get_one( filestack_t* fs );
-gboolean fs_put( filestack_t* fs, char c );
-GString* fs_get_n( filestack_t* fs, int n, GString* ret );
-gboolean fs_put_n( filestack_t* fs, gchar* str, int n );
-outfile_t* outfile_new( gchar* filename );
+int fs_peek_one( filestack_t* fs );
+FILE* outfile_open_tmp( const gchar* filename, gchar** tmpname );
+outfile_t* outfile_open( gchar* filename, gboolean if_changed );
+outfile_t* outfile_new( gchar* filename, gboolean if_changed, stackfile_t* err_sf );
+outfile_t* outfile_new_str( mrb_state* mrb );
+gboolean outfile_same( const gchar* a, const gchar* b );
+void outfile_commit( outfile_t* of );
+void outfile_discard( outfile_t* of );
 void outfile_rem( outfile_t* of );
+void outfile_write( outfile_t* of, const gchar* str, gsize len );
+void outfile_flush( outfile_t* of, gboolean sync );
+gsize outfile_copy_fd( outfile_t* of, int fd, gsize len );
+void iopipe_wait( iopipe_t* iop, gint* idx, gint val );
+void iopipe_wake( iopipe_t* iop );
+iopipe_block_t* iopipe_put_begin( iopipe_t* iop );
+void iopipe_put_end( iopipe_t* iop );
+iopipe_block_t* iopipe_get_begin( iopipe_t* iop );
+void iopipe_get_end( iopipe_t* iop );
+gpointer iopipe_reader( gpointer data );
+gpointer iopipe_writer( gpointer data );
+iopipe_t* iopipe_new( int fd, gsize size, gboolean reader );
+gboolean iopipe_rem( iopipe_t* iop );
+void iopipe_drain( iopipe_t* iop );
+gsize iopipe_read( iopipe_t* iop, gchar* buf, gsize size );
+gboolean iopipe_ready( iopipe_t* iop );
+void sf_start_pipe( stackfile_t* sf );
+void outfile_start_pipe( outfile_t* of );
+gboolean outfile_stop_pipe( outfile_t* of );
+void mucgly_set_pipelined( pstate_t* ps, gboolean on );
+rcache_t* rcache_new( int limit );
+void rcache_rem( rcache_t* rc, mrb_state* mrb );
+struct RProc* rcache_compile( mrb_state* mrb, const gchar* body );
+struct RProc* rcache_compile_file( mrb_state* mrb, const gchar* src, gsize len,
+                                   const gchar* filename );
+void rcache_evict( rcache_t* rc, mrb_state* mrb, int limit );
+struct RProc* rcache_find( rcache_t* rc, const gchar* body );
+void rcache_insert( rcache_t* rc, mrb_state* mrb, const gchar* body, struct RProc* proc );
+struct RProc* rcache_lookup( rcache_t* rc, mrb_state* mrb, const gchar* body );
 pstate_t* ps_new( gchar* outfile );
 void ps_rem( pstate_t* ps );
+void ps_set_mrb( pstate_t* ps, mrb_state* mrb );
+pstate_t* mucgly_ps( mrb_state* mrb );
+pstate_t* mucgly_ps_impure( mrb_state* mrb );
+void mucgly_set_flush( mrb_state* mrb, pstate_t* ps, mrb_value mode, mrb_int size, mrb_int msecs );
+void mucgly_set_stats( pstate_t* ps, gboolean enable );
+void mucgly_set_opts( mrb_state* mrb, pstate_t* ps, mrb_value opts );
 gboolean ps_check_hook( pstate_t* ps, int c );
 gboolean ps_check( pstate_t* ps, gchar* match, gboolean erase );
 gboolean ps_check_hookesc( pstate_t* ps );
@@ -209,24 +728,138 @@ gboolean ps_check_hookend( pstate_t* ps );
 gboolean ps_check_hooksusp( pstate_t* ps );
 gboolean ps_check_eater( pstate_t* ps );
 int ps_in( pstate_t* ps );
+void ps_input_wait( stackfile_t* sf, gpointer data );
+void ps_input_pop( stackfile_t* sf, gpointer data );
+void ps_apply_flush( pstate_t* ps, outfile_t* of, gsize len, gsize lines );
 void ps_out( pstate_t* ps, int c );
+void ps_out_n( pstate_t* ps, const gchar* str, gsize len );
+gboolean ps_raw_include( pstate_t* ps, const gchar* filename );
 void ps_out_str( pstate_t* ps, gchar* str );
 void ps_block_output( pstate_t* ps );
 void ps_unblock_output( pstate_t* ps );
+void ps_push_outfile( pstate_t* ps, outfile_t* of );
 void ps_push_file( pstate_t* ps, gchar* filename );
 void ps_pop_file( pstate_t* ps );
 stackfile_t* ps_current_file( pstate_t* ps );
 void ps_start_collect( pstate_t* ps );
+void ps_flush_span( pstate_t* ps );
+void ps_collect_span( pstate_t* ps, stackfile_t* sf, const gchar* str, gsize len );
 void ps_collect( pstate_t* ps, int c );
+void ps_collect_n( pstate_t* ps, const gchar* str, gsize len );
 void ps_collect_str( pstate_t* ps, gchar* str );
+void ps_end_collect( pstate_t* ps );
 void ps_enter_macro( pstate_t* ps );
 char* ps_get_macro( pstate_t* ps );
-gchar* ps_eval_ruby_str( pstate_t* ps, gchar* str, gboolean to_str, char* ctxt );
+void ps_ruby_error( pstate_t* ps );
+const gchar* mucgly_scan_ident( const gchar* p, const gchar* end, gboolean method );
+gboolean mucgly_var_simple( const gchar* str, const gchar** beg, const gchar** end );
+gboolean ps_eval_var( pstate_t* ps, const gchar* str, mrb_value* val );
+mrb_value ps_eval_ruby_proc( pstate_t* ps, const gchar* str, struct RProc* proc );
+void ps_out_value( pstate_t* ps, mrb_value val );
+void ps_eval_ruby_str( pstate_t* ps, gchar* str, gboolean to_str, char* ctxt );
+void ps_gc_macro( pstate_t* ps );
+void mucgly_gc_mode( mrb_state* mrb, gboolean generational );
+void mucgly_set_gc( pstate_t* ps, const gchar* mode, mrb_int interval );
+void mucgly_set_parallel( pstate_t* ps, const gchar* arg );
+gint64 mucgly_maxrss( void );
+gchar* mrbcache_path( const gchar* sum );
+struct RProc* mrbcache_load( mrb_state* mrb, const gchar* filename,
+                             const gchar* src, gsize len, const gchar* sum );
 void ps_load_ruby_file( pstate_t* ps, gchar* filename );
+gboolean mucgly_preload( pstate_t* ps, const gchar* filename );
+void mucgly_preload_env( pstate_t* ps );
+mucgly_cmd_t* mucgly_cmd_find( const gchar* name, gsize len );
+gboolean mucgly_cmd_register( const gchar* name, mucgly_cmd_func_t func, gpointer data );
 gboolean ps_eval_cmd( pstate_t* ps );
+void ps_post_macro( pstate_t* ps );
 void ps_process_hook_end_seq( pstate_t* ps, gboolean* do_break );
 void ps_process_non_hook_seq( pstate_t* ps, int c, gboolean* do_break );
+void ps_process( pstate_t* ps );
 void ps_process_file( pstate_t* ps, gchar* infile, gchar* outfile );
+mrb_value ps_process_str( pstate_t* ps, const gchar* src, gsize len );
+void ps_reset( pstate_t* ps );
+gchar* ps_trap( pstate_t* ps, ps_func_t func, gpointer data );
+void ps_process_file_func( pstate_t* ps, gpointer data );
+void ps_process_str_func( pstate_t* ps, gpointer data );
+gchar* ps_process_trap( pstate_t* ps, gchar* infile, gchar* outfile );
+gchar* ps_process_str_trap( pstate_t* ps, const gchar* src, gsize len, mrb_value* ret );
+stats_t* stats_new( void );
+void stats_rem( stats_t* st );
+stats_macro_t stats_macro_type( const gchar* cmd );
+void stats_macro( stats_t* st, stackfile_t* sf, stats_macro_t type, gint64 usecs );
+void stats_json_str( GString* json, const gchar* str );
+gint stats_site_cmp( gconstpointer a, gconstpointer b );
+gchar* stats_json( pstate_t* ps );
+void stats_write( const gchar* dest, const gchar* json );
+void stats_report_global( void );
+void stats_report( pstate_t* ps );
+int trace_tid( void );
+gboolean trace_open( const gchar* filename );
+void trace_close( void );
+void trace_begin( GString* ev, const gchar* ph, const gchar* cat,
+                  const gchar* name, gint64 ts );
+void trace_write( GString* ev );
+void trace_body( gchar* body, const gchar* str );
+void trace_macro( stackfile_t* sf, stats_macro_t type, const gchar* body, gint64 t0 );
+void trace_stream( const gchar* ph, const gchar* cat, const gchar* name, gconstpointer id );
+mcgc_t* mcgc_new( const gchar* filename );
+void mcgc_rem( mcgc_t* mc );
+void mcgc_put_u8( GString* buf, guint8 val );
+void mcgc_put_u64( GString* buf, guint64 val );
+void mcgc_put_str( GString* buf, const gchar* str, gsize len );
+void mcgc_rec_lit( mcgc_t* mc, const gchar* str, gsize len );
+void mcgc_rec_pos( mcgc_t* mc, mcgc_ev_t ev, stackfile_t* sf );
+void mcgc_rec_ruby( mcgc_t* mc, mrb_state* mrb, stackfile_t* sf, const gchar* body, gboolean to_str, struct RProc* proc );
+void mcgc_rec_cmd( mcgc_t* mc, stackfile_t* sf, const gchar* cmd );
+void mcgc_rec_pop( mcgc_t* mc );
+void mcgc_rec_dep( mcgc_t* mc, const gchar* filename );
+gchar* mcgc_file_sha1( const gchar* filename );
+void mcgc_save( mcgc_t* mc );
+guint8 mcgc_get_u8( mcgc_rd_t* rd );
+guint64 mcgc_get_u64( mcgc_rd_t* rd );
+const gchar* mcgc_get_str( mcgc_rd_t* rd, gsize* len );
+void mcgc_get_pos( mcgc_rd_t* rd, stackfile_t* sf );
+gint64 mucgly_mtime_ns( const GStatBuf* st );
+gboolean mcgc_check_dep( const gchar* filename, guint64 size, gint64 mtime,
+                         const gchar* sha1, gint64 stamp );
+gboolean mcgc_check( mcgc_rd_t* rd, const gchar* filename, gint64 stamp );
+gboolean mcgc_validate( mcgc_rd_t* rd );
+struct RProc* mcgc_load_irep( mrb_state* mrb, const gchar* bin, gsize len );
+gboolean ps_replay_file( pstate_t* ps, gchar* infile, gchar* outfile );
+deps_t* deps_new( const gchar* infile, const gchar* outfile,
+                  const gchar* depfile, const gchar* manifest );
+void deps_rem( deps_t* dp );
+void deps_add( GPtrArray* files, const gchar* filename );
+void deps_make_name( GString* buf, const gchar* name );
+void deps_write_depfile( deps_t* dp );
+gboolean deps_json_files( GString* json, const gchar* key, GPtrArray* files );
+void deps_save( deps_t* dp );
+gboolean deps_json_next( mcgc_rd_t* rd, gchar c );
+gchar* deps_json_get_str( mcgc_rd_t* rd );
+gint64 deps_json_get_int( mcgc_rd_t* rd );
+gboolean deps_check_files( mcgc_rd_t* rd, const gchar* first, gint64 stamp );
+gboolean deps_check( const gchar* manifest, const gchar* infile, const gchar* outfile );
+gboolean ps_deps_begin( pstate_t* ps, const gchar* infile, const gchar* outfile );
+void ps_deps_end( pstate_t* ps );
+batch_job_t* batch_job_new( const gchar* infile, const gchar* outfile );
+void batch_job_rem( batch_job_t* job );
+GPtrArray* batch_read( const gchar* manifest );
+pstate_t* batch_ps_new( void );
+void batch_worker_rem( gpointer data );
+void batch_run_job( gpointer data, gpointer user_data );
+int batch_run( GPtrArray* jobs, int threads );
+int mucgly_batch( const gchar* manifest, int threads );
+gsize ps_par_next( stackfile_t* sf, gsize pos, gboolean* end );
+gboolean ps_par_ready( pstate_t* ps );
+void par_seg_func( pstate_t* ps, gpointer data );
+void par_worker_rem( par_worker_t* w );
+void par_worker_new( par_worker_t* w );
+void par_worker_setup( par_t* par, par_worker_t* w );
+void par_run_seg( gpointer data, gpointer user_data );
+par_t* par_new( int threads, GPtrArray* sources );
+void par_rem( par_t* par );
+void par_wait( par_t* par, par_seg_t* seg );
+gboolean ps_par_region( pstate_t* ps );
 
 
 
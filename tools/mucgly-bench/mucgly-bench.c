@@ -0,0 +1,435 @@
+/**
+ * @file   mucgly-bench.c
+ * @author Tero Isannainen <tero@blackbox.home.network>
+ *
+ * @brief  Mucgly expansion benchmark.
+ *
+ * Generates synthetic input files for typical workloads, expands
+ * them with ps_process_file, and reports throughput as MB/s and
+ * macros/s.
+ *
+ * Usage:
+ *   mucgly-bench [-s <MB>] [-r <repeat>] [-d <dir>] [-j] [<workload> ...]
+ *
+ *   -s  Size of generated input per workload (default: 8 MB).
+ *   -r  Number of runs, best run is reported (default: 3).
+ *   -d  Directory for generated files (default: temporary).
+ *   -j  Report as JSON, one line per workload.
+ *   -l  List workloads.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <mruby.h>
+
+#include <mucgly_mod.h>
+
+
+/** Default size of generated input (MB). */
+#define BENCH_SIZE 8
+
+/** Default number of runs per workload. */
+#define BENCH_REPEAT 3
+
+/** Number of files in include chain. */
+#define BENCH_DEPTH 64
+
+/** Number of pairs in multihook workload. */
+#define BENCH_MULTI 128
+
+
+/**
+ * Input generator. Generates the main input file and the files it
+ * depends on.
+ *
+ * @param dir   Directory for files.
+ * @param path  Main input file.
+ * @param size  Approximate size of all input.
+ * @param files Generated files (for cleanup).
+ */
+typedef void (*bench_gen_t)( const gchar* dir, const gchar* path, gsize size, GPtrArray* files );
+
+
+/** Benchmark workload. */
+typedef struct bench_s {
+  const char* name;             /**< Workload name. */
+  const char* info;             /**< Description. */
+  bench_gen_t gen;              /**< Input generator. */
+} bench_t;
+
+
+
+/* ------------------------------------------------------------
+ * Input generators:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Append chunk to buffer until buffer size is reached.
+ *
+ * @param buf   Buffer.
+ * @param chunk Chunk to repeat.
+ * @param size  Target size.
+ */
+static void bench_fill( GString* buf, const gchar* chunk, gsize size )
+{
+  while ( buf->len < size )
+    g_string_append( buf, chunk );
+}
+
+
+/**
+ * Write buffer to file and free buffer. Exit on failure.
+ *
+ * @param path  File name.
+ * @param buf   Content.
+ * @param files Generated files.
+ */
+static void bench_write( const gchar* path, GString* buf, GPtrArray* files )
+{
+  GError* err = NULL;
+
+  if ( !g_file_set_contents( path, buf->str, buf->len, &err ) )
+    {
+      fprintf( stderr, "mucgly-bench: %s\n", err->message );
+      exit( EXIT_FAILURE );
+    }
+
+  g_ptr_array_add( files, g_strdup( path ) );
+  g_string_free( buf, TRUE );
+}
+
+
+/** Mostly literal text. */
+static void bench_gen_literal( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 128 );
+
+  bench_fill( buf,
+              "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do\n"
+              "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut\n"
+              "enim ad minim veniam, quis nostrud exercitation ullamco laboris\n",
+              size );
+
+  bench_write( path, buf, files );
+}
+
+
+/** Macro every ~20 chars. */
+static void bench_gen_macro( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 128 );
+
+  g_string_append( buf, "-<$v = 'value'>-\n" );
+  bench_fill( buf, "text -<.$v>- text\n", size );
+
+  bench_write( path, buf, files );
+}
+
+
+/** Chain of includes, each file includes the next. */
+static void bench_gen_include( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  for ( int i = 0; i < BENCH_DEPTH; i++ )
+    {
+      GString* buf = g_string_sized_new( size / BENCH_DEPTH + 128 );
+      gchar* name;
+
+      bench_fill( buf, "included text with -<.__LINE__.to_s>- line number\n", size / BENCH_DEPTH );
+
+      if ( i+1 < BENCH_DEPTH )
+        {
+          gchar* next = g_strdup_printf( "%s/include-%02d.txt", dir, i+1 );
+          g_string_append_printf( buf, "-<:include %s>-", next );
+          g_free( next );
+        }
+
+      if ( i == 0 )
+        name = g_strdup( path );
+      else
+        name = g_strdup_printf( "%s/include-%02d.txt", dir, i );
+
+      bench_write( name, buf, files );
+      g_free( name );
+    }
+}
+
+
+/** Multihook with BENCH_MULTI pairs, all pairs in use. */
+static void bench_gen_multihook( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 4096 );
+
+  g_string_append( buf, "-<$v = 'value'>-" );
+  g_string_append( buf, "-<Mucgly.multihook(" );
+  for ( int i = 0; i < BENCH_MULTI; i++ )
+    g_string_append_printf( buf, "%s['<%c%c:', ':%c%c>']",
+                            i ? "," : "",
+                            'a' + i / 16, 'a' + i % 16,
+                            'a' + i / 16, 'a' + i % 16 );
+  g_string_append( buf, ")>-\n" );
+
+  for ( int i = 0; buf->len < size; i = ( i + 1 ) % BENCH_MULTI )
+    g_string_append_printf( buf, "text <%c%c:.$v:%c%c> text\n",
+                            'a' + i / 16, 'a' + i % 16,
+                            'a' + i / 16, 'a' + i % 16 );
+
+  bench_write( path, buf, files );
+}
+
+
+/** Escapes and eaters. */
+static void bench_gen_escape( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 128 );
+
+  g_string_append( buf, "-<:eater ~>-" );
+  bench_fill( buf, "esc \\-< and \\\\ and \\~x eat \\ space\\\n", size );
+
+  bench_write( path, buf, files );
+}
+
+
+/** Nested macros. */
+static void bench_gen_nested( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 128 );
+
+  bench_fill( buf, "text -<.'a -<b -<c>- b>- a'>- text\n", size );
+
+  bench_write( path, buf, files );
+}
+
+
+/** Suspended hookends within macros. */
+static void bench_gen_suspend( const gchar* dir, const gchar* path, gsize size, GPtrArray* files )
+{
+  GString* buf = g_string_sized_new( size + 128 );
+
+  g_string_append( buf, "-<Mucgly.multihook( [ '{{', '}}', '{{' ] )>-\n" );
+  bench_fill( buf, "text {{.'a {{b}} a'}} text\n", size );
+
+  bench_write( path, buf, files );
+}
+
+
+/** All workloads. */
+static bench_t bench_list[] = {
+  { "literal",   "Mostly literal text", bench_gen_literal },
+  { "macro",     "Dense .var macros", bench_gen_macro },
+  { "include",   "Deep :include chain", bench_gen_include },
+  { "multihook", "Multihook with many pairs", bench_gen_multihook },
+  { "escape",    "Escapes and eaters", bench_gen_escape },
+  { "nested",    "Nested macros", bench_gen_nested },
+  { "suspend",   "Suspended hookends", bench_gen_suspend },
+  { NULL, NULL, NULL }
+};
+
+
+
+/* ------------------------------------------------------------
+ * Benchmark runner:
+ * ------------------------------------------------------------ */
+
+
+/**
+ * Expand input once with fresh Pstate. Statistics are collected only
+ * for counting runs, since they add overhead to timed runs.
+ *
+ * @param path   Input file.
+ * @param bytes  Input chars processed (or NULL for timed run).
+ * @param macros Macros evaluated (or NULL for timed run).
+ *
+ * @return Expansion time (usecs), or -1 on error.
+ */
+static gint64 bench_run_one( const gchar* path, gint64* bytes, gint64* macros )
+{
+  pstate_t* ps;
+  gchar* msg;
+  gint64 t0, t1;
+
+  /* MRuby setup is not part of measurement. */
+  ps = batch_ps_new();
+  if ( bytes )
+    mucgly_set_stats( ps, TRUE );
+
+  t0 = g_get_monotonic_time();
+  msg = ps_process_trap( ps, (gchar*) path, (gchar*) "/dev/null" );
+  t1 = g_get_monotonic_time();
+
+  if ( bytes )
+    {
+      *bytes = ps->stats->bytes_in;
+      *macros = 0;
+      for ( int i = 0; i < stats_macro_cnt; i++ )
+        *macros += ps->stats->macros[i];
+    }
+
+  ps_rem( ps );
+
+  if ( msg )
+    {
+      fprintf( stderr, "mucgly-bench: %s", msg );
+      g_free( msg );
+      return -1;
+    }
+
+  return t1 - t0;
+}
+
+
+/**
+ * Generate input for workload and report best of repeated runs.
+ *
+ * @param bench  Workload.
+ * @param dir    Directory for input files.
+ * @param size   Input size.
+ * @param repeat Number of runs.
+ * @param json   Report as JSON.
+ *
+ * @return TRUE on success.
+ */
+static gboolean bench_run( bench_t* bench, const gchar* dir, gsize size, int repeat, gboolean json )
+{
+  GPtrArray* files = g_ptr_array_new_with_free_func( g_free );
+  gchar* path = g_strdup_printf( "%s/%s.txt", dir, bench->name );
+  gint64 best = -1;
+  gint64 bytes = 0;
+  gint64 macros = 0;
+  double mbps, mps;
+
+  bench->gen( dir, path, size, files );
+
+  /* Untimed run for counts, timed runs without statistics. */
+  if ( bench_run_one( path, &bytes, &macros ) < 0 )
+    repeat = 0;
+
+  for ( int i = 0; i < repeat; i++ )
+    {
+      gint64 t = bench_run_one( path, NULL, NULL );
+
+      if ( t < 0 )
+        {
+          best = -1;
+          break;
+        }
+
+      if ( best < 0 || t < best )
+        best = t;
+    }
+
+  for ( guint i = 0; i < files->len; i++ )
+    g_unlink( g_ptr_array_index( files, i ) );
+  g_ptr_array_free( files, TRUE );
+  g_free( path );
+
+  if ( best < 0 )
+    return FALSE;
+
+  best = MAX( best, 1 );
+  mbps = (double) bytes / best;
+  mps = (double) macros * 1e6 / best;
+
+  if ( json )
+    printf( "{\"workload\":\"%s\",\"bytes\":%" G_GINT64_FORMAT
+            ",\"macros\":%" G_GINT64_FORMAT ",\"time_us\":%" G_GINT64_FORMAT
+            ",\"mb_per_s\":%.2f,\"macros_per_s\":%.0f}\n",
+            bench->name, bytes, macros, best, mbps, mps );
+  else
+    printf( "%-10s %10.2f MB/s %12.0f macros/s   (%s)\n",
+            bench->name, mbps, mps, bench->info );
+
+  fflush( stdout );
+
+  return TRUE;
+}
+
+
+/**
+ * Find workload by name.
+ *
+ * @param name Workload name.
+ *
+ * @return Workload (or NULL).
+ */
+static bench_t* bench_find( const char* name )
+{
+  for ( bench_t* b = bench_list; b->name; b++ )
+    if ( !strcmp( b->name, name ) )
+      return b;
+
+  return NULL;
+}
+
+
+int main( int argc, char** argv )
+{
+  gsize size = BENCH_SIZE;
+  int repeat = BENCH_REPEAT;
+  gchar* dir = NULL;
+  gboolean tmpdir = FALSE;
+  gboolean json = FALSE;
+  GPtrArray* run = g_ptr_array_new();
+  int ret = EXIT_SUCCESS;
+
+  for ( int i = 1; i < argc; i++ )
+    {
+      if ( !strcmp( argv[i], "-s" ) && i+1 < argc )
+        size = atoi( argv[++i] );
+      else if ( !strcmp( argv[i], "-r" ) && i+1 < argc )
+        repeat = MAX( atoi( argv[++i] ), 1 );
+      else if ( !strcmp( argv[i], "-d" ) && i+1 < argc )
+        dir = g_strdup( argv[++i] );
+      else if ( !strcmp( argv[i], "-j" ) )
+        json = TRUE;
+      else if ( !strcmp( argv[i], "-l" ) )
+        {
+          for ( bench_t* b = bench_list; b->name; b++ )
+            printf( "%-10s %s\n", b->name, b->info );
+          return EXIT_SUCCESS;
+        }
+      else if ( bench_find( argv[i] ) )
+        g_ptr_array_add( run, bench_find( argv[i] ) );
+      else
+        {
+          fprintf( stderr, "mucgly-bench: Unknown option or workload \"%s\"\n", argv[i] );
+          return EXIT_FAILURE;
+        }
+    }
+
+  if ( run->len == 0 )
+    for ( bench_t* b = bench_list; b->name; b++ )
+      g_ptr_array_add( run, b );
+
+  if ( dir == NULL )
+    {
+      GError* err = NULL;
+
+      dir = g_dir_make_tmp( "mucgly-bench-XXXXXX", &err );
+      if ( dir == NULL )
+        {
+          fprintf( stderr, "mucgly-bench: %s\n", err->message );
+          return EXIT_FAILURE;
+        }
+      tmpdir = TRUE;
+    }
+
+  for ( guint i = 0; i < run->len; i++ )
+    if ( !bench_run( g_ptr_array_index( run, i ), dir, size * 1024 * 1024, repeat, json ) )
+      ret = EXIT_FAILURE;
+
+  if ( tmpdir )
+    g_rmdir( dir );
+
+  g_free( dir );
+  g_ptr_array_free( run, TRUE );
+
+  return ret;
+}